@@ -30,11 +30,35 @@
  */
 
 #include <stdlib.h>
+#include <strings.h>
 #include <unistd.h>
 #include <time.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <fcntl.h>
+//CHUCHU_NO_SIMD builds the portable cipher loop only
+#ifndef CHUCHU_NO_SIMD
+#ifdef __AVX2__
+#include <immintrin.h>
+#define CHUCHU_AVX2
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define CHUCHU_SSE2
+#endif
+#endif
 #include "chuchu_common.h"
 
+static uint32_t CRYPT_DC_GetNextKey(CRYPT_SETUP* pc);
+static void CRYPT_DC_CryptWords(CRYPT_SETUP* pc, char* dst, const char* src, unsigned long words);
+
 uint32_t strlcpy(char *dst, const char *src, size_t size) {
   char *d = dst;
   const char *s = src;
@@ -173,12 +197,15 @@ int get_chuchu_config(server_data_t *s, char *fn) {
   FILE *file = fopen(fn,"r");
   int lobby_port=0, login_port=0;
   int max_puzzles=0, max_clients=0, max_rooms=0,i=0;
-  int deedee_server = 0;
-  char lobby_ip[16], buf[1024], db_path[256], info_path[256];
+  int deedee_server = 0, threaded = 0, checkpoint_interval = -1;
+  char lobby_ip[16], buf[1024], db_path[256], info_path[256], synchronous[16], crypt_table_path[256];
+  const char *sync_levels[] = { "OFF", "NORMAL", "FULL", "EXTRA" };
   memset(buf, 0, sizeof(buf));
+  memset(synchronous, 0, sizeof(synchronous));
   memset(lobby_ip, 0, sizeof(lobby_ip));
   memset(db_path, 0, sizeof(db_path));
   memset(info_path, 0, sizeof(info_path));
+  memset(crypt_table_path, 0, sizeof(crypt_table_path));
   
   if (file != NULL) {
     while (fgets(buf, sizeof(buf), file) != NULL) {
@@ -191,6 +218,10 @@ int get_chuchu_config(server_data_t *s, char *fn) {
       sscanf(buf, "CHUCHU_LOBBY_MAX_CLIENTS=%d", &max_clients);
       sscanf(buf, "CHUCHU_LOBBY_MAX_ROOMS=%d", &max_rooms);
       sscanf(buf, "CHUCHU_LOBBY_DEEDEE=%d", &deedee_server);
+      sscanf(buf, "CHUCHU_LOBBY_THREADED=%d", &threaded);
+      sscanf(buf, "CHUCHU_DB_SYNCHRONOUS=%15s", synchronous);
+      sscanf(buf, "CHUCHU_DB_CHECKPOINT_INTERVAL=%d", &checkpoint_interval);
+      sscanf(buf, "CHUCHU_CRYPT_TABLE=%255s", crypt_table_path);
     }
     fclose(file);
   } else {
@@ -230,6 +261,10 @@ int get_chuchu_config(server_data_t *s, char *fn) {
     chuchu_info(SERVER,"Missing CHUCHU_LOBBY_MAX_ROOMS");
     return 0;
   }
+  if (max_rooms > CHUCHU_MAX_ROOMS) {
+    chuchu_info(SERVER,"CHUCHU_LOBBY_MAX_ROOMS too large - Set to %d", CHUCHU_MAX_ROOMS);
+    max_rooms = CHUCHU_MAX_ROOMS;
+  }
   
   strncpy(s->chu_lobby_ip, lobby_ip, sizeof(lobby_ip));
   strncpy(s->chu_db_path, db_path, sizeof(db_path));
@@ -240,8 +275,25 @@ int get_chuchu_config(server_data_t *s, char *fn) {
   else
     s->chu_login_port = (uint16_t)login_port;
   s->m_rooms = max_rooms;
-  s->m_pl_slots = 4;
+  s->m_pl_slots = CHUCHU_MAX_PLAYER_SLOTS;
   s->deedee_server = (char)deedee_server;
+  s->threaded = threaded;
+  s->epoll_fd = -1;
+  //WAL is safe with NORMAL, a crash may only lose the last commits
+  s->db_synchronous = 1;
+  for (i=0;i<4;i++)
+    if (strcasecmp(synchronous, sync_levels[i]) == 0)
+      s->db_synchronous = i;
+  if (synchronous[0] != '\0' && strcasecmp(synchronous, sync_levels[s->db_synchronous]) != 0)
+    chuchu_info(SERVER,"Unknown CHUCHU_DB_SYNCHRONOUS %s - Set to default value", synchronous);
+  s->db_checkpoint_interval = (checkpoint_interval < 0) ? 60 : checkpoint_interval;
+  s->tx_queued_bytes = 0;
+  s->tx_dropped_msgs = 0;
+  s->tx_slow_clients = 0;
+  //Rooms stay in g_l, players may outlive their p_l slot for a bit
+  if (!init_chuchu_pool(&s->player_pool, "players", sizeof(player_t), CHUCHU_POOL_SLAB, 0) ||
+      !init_chuchu_pool(&s->room_pool, "rooms", sizeof(game_room_t), CHUCHU_POOL_SLAB, s->m_rooms))
+    return 0;
   
   chuchu_info(SERVER,"Loaded %s Config:", deedee_server ? "Dee Dee" : "ChuChu");
   chuchu_info(SERVER,"\tCHUCHU_LOGIN_PORT_: %d", s->chu_login_port);
@@ -252,257 +304,1874 @@ int get_chuchu_config(server_data_t *s, char *fn) {
   chuchu_info(SERVER,"\tCHUCHU_MAX_PUZZLES: %d", s->m_puzz);
   chuchu_info(SERVER,"\tCHUCHU_MAX_CLIENTS: %d", s->m_cli);
   chuchu_info(SERVER,"\tCHUCHU_MAX_ROOMS: %d", s->m_rooms);
+  chuchu_info(SERVER,"\tCHUCHU_LOBBY_THREADED: %d", s->threaded);
+  chuchu_info(SERVER,"\tCHUCHU_DB_SYNCHRONOUS: %s", sync_levels[s->db_synchronous]);
+  chuchu_info(SERVER,"\tCHUCHU_DB_CHECKPOINT_INTERVAL: %d", s->db_checkpoint_interval);
+  chuchu_info(SERVER,"\tCHUCHU_CRYPT_TABLE: %s", crypt_table_path[0] ? crypt_table_path : "none");
+  //Optional, handshakes create their keys without it
+  if (crypt_table_path[0] != '\0')
+    init_chuchu_crypt_table(crypt_table_path);
   //Allocate pointer arrays
-  s->puzz_l = calloc((size_t)s->m_puzz, sizeof(puzzle_t *));
-  for(i=0;i<(s->m_puzz);i++)
-    s->puzz_l[i] = NULL;
+  if (!init_chuchu_puzzles(s))
+    return 0;
   
   s->p_l = calloc((size_t)s->m_cli, sizeof(player_t *));
   for(i=0;i<(s->m_cli);i++)
     s->p_l[i] = NULL; 
+  if (!init_chuchu_registry(s))
+    return 0;
   
   s->g_l = calloc((size_t)s->m_rooms, sizeof(game_room_t *));
   for(i=0;i<(s->m_rooms);i++)
     s->g_l[i] = NULL; 
+  s->g_gen = calloc((size_t)s->m_rooms, sizeof(uint16_t));
+  if (s->g_gen == NULL)
+    return 0;
   
   return 1;
 }
 
 /*
- * HELP FUNCTIONS
+ * LOCKS
+ *
+ * Debug builds with -DCHUCHU_LOCK_CHECK (see the Makefile) track
+ * the locks each thread holds and assert on the lock order.
+ * NDEBUG is never defined, so the check is opt-in.
  */
-uint32_t char_to_uint32(char* data) {
-  uint32_t val = (uint32_t)((uint8_t)data[0] << 24 | (uint8_t)data[1] << 16 | (uint8_t)data[2] << 8  | (uint8_t)data[3]);
-  return val;
-}
 
-uint16_t char_to_uint16(char* data) {
-  uint16_t val = (uint16_t)((uint8_t)data[0] << 8 | (uint8_t)data[1]);
-  return val;
-}
+#ifdef CHUCHU_LOCK_CHECK
+//Locks held by this thread, one bit per level of the lock order
+enum { LOCK_PLAYERS = 0x01, LOCK_ROOMS = 0x02, LOCK_ROOM = 0x04, LOCK_REGISTRY = 0x08, LOCK_PUZZLES = 0x10 };
+static __thread unsigned lock_held = 0;
 
-int uint32_to_char(uint32_t data, char* msg) {
-  msg[0] = (char)(data >> 24);
-  msg[1] = (char)(data >> 16);
-  msg[2] = (char)(data >> 8);
-  msg[3] = (char)data;
-  return 4;
+static void lock_order(unsigned level) {
+  //Only locks earlier in the order may be held, not this one or a later one
+  assert((lock_held & ~(level - 1)) == 0);
+  lock_held |= level;
 }
 
-int uint16_to_char(uint16_t data, char* msg) {
-  msg[0] = (char)(data >> 8);
-  msg[1] = (char)data;
-  return 2;
+static void lock_release(unsigned level) {
+  assert(lock_held & level);
+  lock_held &= ~level;
 }
+#else
+#define lock_order(level)
+#define lock_release(level)
+#endif
 
 /*
- * PRINT PACKET as TCPDUMP
+ * Function: init_chuchu_locks
+ * --------------------
+ * creates the server locks, see server_data_t
+ * for the order they are taken in
+ *
+ *  *s: pointer to server data struct
+ *
+ *  returns: 1 => OK
+ *           0 => FAIL
+ *
  */
-void print_chuchu_data(void* pkt,unsigned long pkt_size) {
-  unsigned char* pkt_content = (unsigned char*)pkt;
-  unsigned long i,j,off;
-  char buffer[17];
-  buffer[16] = 0;
-  off = 0;
-  printf("--------------------\n");
-  printf("0000 | ");
-  for (i = 0; i < pkt_size; i++) {
-    if (off == 16) {
-      memcpy(buffer,&pkt_content[i - 16],16);
-      for (j = 0; j < 16; j++) if (buffer[j] < 0x20) buffer[j] = '.';
-      printf("| %s\n%04X | ",buffer,(unsigned int)i);
-      off = 0;
-    }
-    printf("%02X ",pkt_content[i]);
-    off++;
+int init_chuchu_locks(server_data_t *s) {
+  if (pthread_rwlock_init(&s->players_lock, NULL))
+    return 0;
+  if (pthread_rwlock_init(&s->rooms_lock, NULL)) {
+    pthread_rwlock_destroy(&s->players_lock);
+    return 0;
   }
-  buffer[off] = 0;
-  memcpy(buffer,&pkt_content[i - off],off);
-  for (j = 0; j < off; j++) if (buffer[j] < 0x20) buffer[j] = '.';
-  for (j = 0; j < 16 - off; j++) printf("   ");
-  printf("| %s\n",buffer);
+  if (pthread_mutex_init(&s->reg_lock, NULL)) {
+    pthread_rwlock_destroy(&s->rooms_lock);
+    pthread_rwlock_destroy(&s->players_lock);
+    return 0;
+  }
+  if (pthread_mutex_init(&s->puzz_lock, NULL)) {
+    pthread_mutex_destroy(&s->reg_lock);
+    pthread_rwlock_destroy(&s->rooms_lock);
+    pthread_rwlock_destroy(&s->players_lock);
+    return 0;
+  }
+  return 1;
+}
+
+void lock_players(server_data_t *s, int write) {
+  lock_order(LOCK_PLAYERS);
+  if (write)
+    pthread_rwlock_wrlock(&s->players_lock);
+  else
+    pthread_rwlock_rdlock(&s->players_lock);
 }
 
 /*
- * Function: create_chuchu_hdr
+ * Function: unlock_players
  * --------------------
- * create standard chuchu TCP header
- * 
- *  *msg: pointer to msg buffer
- *   msg_id: msg id
- *   msg_flag: msg flag
- *   msg_size: size of msg 
+ * releases the player registry, this is the outermost
+ * lock so the msgs queued while holding it are written
+ * to the sockets here
+ *
+ *  *s: pointer to server data struct
  *
  *  returns: void
  *
  */
-void create_chuchu_hdr(char* msg, uint8_t msg_id, uint8_t msg_flag, uint16_t msg_size) {
-  msg_size = htons(msg_size);
-  msg[0] = (char)msg_id;
-  msg[1] = (char)msg_flag;
-  uint16_to_char(msg_size, &msg[2]);
+void unlock_players(server_data_t *s) {
+  lock_release(LOCK_PLAYERS);
+  pthread_rwlock_unlock(&s->players_lock);
+  flush_chuchu_bcast();
+}
+
+void lock_rooms(server_data_t *s, int write) {
+  lock_order(LOCK_ROOMS);
+  if (write)
+    pthread_rwlock_wrlock(&s->rooms_lock);
+  else
+    pthread_rwlock_rdlock(&s->rooms_lock);
+}
+
+void unlock_rooms(server_data_t *s) {
+  lock_release(LOCK_ROOMS);
+  pthread_rwlock_unlock(&s->rooms_lock);
+}
+
+void lock_room(game_room_t *gr) {
+  lock_order(LOCK_ROOM);
+  pthread_mutex_lock(&gr->mutex);
+}
+
+void unlock_room(game_room_t *gr) {
+  lock_release(LOCK_ROOM);
+  pthread_mutex_unlock(&gr->mutex);
+}
+
+void lock_registry(server_data_t *s) {
+  lock_order(LOCK_REGISTRY);
+  pthread_mutex_lock(&s->reg_lock);
+}
+
+void unlock_registry(server_data_t *s) {
+  lock_release(LOCK_REGISTRY);
+  pthread_mutex_unlock(&s->reg_lock);
+}
+
+void lock_puzzles(server_data_t *s) {
+  lock_order(LOCK_PUZZLES);
+  pthread_mutex_lock(&s->puzz_lock);
+}
+
+void unlock_puzzles(server_data_t *s) {
+  lock_release(LOCK_PUZZLES);
+  pthread_mutex_unlock(&s->puzz_lock);
+}
+
+/*
+ * PUZZLE CATALOG
+ *
+ * puzz_l is dense, in DB order, and grows as puzzles are uploaded.
+ * Two open addressing tables map the id and the name to an index
+ * in puzz_l + 1, 0 is a free slot. Puzzles are never removed.
+ * Callers hold puzz_lock, except while loading at startup.
+ */
+
+static uint32_t puzzle_id_hash(uint32_t id) {
+  return id * 2654435761u;
+}
+
+static uint32_t puzzle_name_hash(const char *p_name) {
+  uint32_t h = 2166136261u;
+
+  while (*p_name)
+    h = (h ^ (uint8_t)*p_name++) * 16777619u;
+  return h;
 }
 
-void send_chuchu_msg(int sock, char* msg, int msg_size) {
-  write(sock, msg, (size_t)msg_size);
+static void index_chuchu_puzzle(server_data_t *s, uint32_t i) {
+  uint32_t h;
+
+  for (h = puzzle_id_hash(s->puzz_l[i]->id) & s->puzz_hash_mask; s->puzz_id_hash[h]; h = (h + 1) & s->puzz_hash_mask);
+  s->puzz_id_hash[h] = i + 1;
+  for (h = puzzle_name_hash(s->puzz_l[i]->p_name) & s->puzz_hash_mask; s->puzz_name_hash[h]; h = (h + 1) & s->puzz_hash_mask);
+  s->puzz_name_hash[h] = i + 1;
 }
 
 /*
- * Function: parse_chuchu_msg
+ * Function: resize_chuchu_puzzles
  * --------------------
- * parse chuchu msg and do some inital sanity checks
- * 
- *   buf: incoming msg
- *   buf_len: length of msg
+ * grows puzz_l to size and rebuilds the indexes,
+ * which are kept at most half full
  *
- *  returns: 0 => SKIP continue
- *           Size states in pkt
+ *  *s: pointer to server data struct
+ *  size: new nr of slots in puzz_l
+ *
+ *  returns: 1 => OK
+ *           0 => FAIL, catalog is unchanged
  *
  */
-uint16_t parse_chuchu_msg(char* buf, int buf_len) {
-  uint16_t pkt_size = 0;
-  
-  //Fetch size in pkt
-  pkt_size = ntohs(char_to_uint16(&buf[2]));  
-  
-  //Parse header
-  if (buf_len < 4) {
-    chuchu_info(SERVER,"Length of packet is less then 4 bytes...[SKIP]");
+static int resize_chuchu_puzzles(server_data_t *s, int size) {
+  puzzle_t **puzz_l;
+  uint32_t *id_hash, *name_hash;
+  uint32_t hash_size = 16, i;
+
+  while (hash_size < (uint32_t)size * 2)
+    hash_size *= 2;
+  puzz_l = realloc(s->puzz_l, (size_t)size * sizeof(puzzle_t *));
+  if (puzz_l == NULL)
     return 0;
-  }
-  
-  if (buf_len >= pkt_size)
-    return pkt_size;
-  
-  if (buf_len < pkt_size) {
-    chuchu_info(SERVER,"<- Packet size %d is greater then buffer size %d", (int)pkt_size, (int)buf_len); 
-    chuchu_error(SERVER,"Expected more data..[SKIP]");
+  s->puzz_l = puzz_l;
+  id_hash = calloc(hash_size, sizeof(uint32_t));
+  name_hash = calloc(hash_size, sizeof(uint32_t));
+  if (id_hash == NULL || name_hash == NULL) {
+    free(id_hash);
+    free(name_hash);
     return 0;
   }
-  
-  return 0;
+  free(s->puzz_id_hash);
+  free(s->puzz_name_hash);
+  s->puzz_id_hash = id_hash;
+  s->puzz_name_hash = name_hash;
+  s->puzz_hash_mask = hash_size - 1;
+  s->puzz_size = size;
+  for (i=0;i<(uint32_t)s->puzz_count;i++)
+    index_chuchu_puzzle(s, i);
+  return 1;
 }
 
 /*
- * Function: init_chuchu_crypt
+ * Function: init_chuchu_puzzles
  * --------------------
- * generates server and client seed 
- * and creates the nec. keys
- * 
- *  *pl: pointer to player struct
+ * creates an empty catalog, m_puzz is only the
+ * starting size
  *
- *  returns: void
+ *  *s: pointer to server data struct
+ *
+ *  returns: 1 => OK
+ *           0 => FAIL
  *
  */
-void init_chuchu_crypt(player_t* pl) {
-  int i=0;
-  srand((unsigned int)time(NULL));
-  char server_seed_dc[4],client_seed_dc[4];
+int init_chuchu_puzzles(server_data_t *s) {
+  s->puzz_l = NULL;
+  s->puzz_id_hash = NULL;
+  s->puzz_name_hash = NULL;
+  s->puzz_count = 0;
+  s->puzz_gen = 0;
+  s->puzz_dl_gen = 0;
+  return resize_chuchu_puzzles(s, s->m_puzz > 0 ? s->m_puzz : 16);
+}
 
-  for(i=0;i<4;i++) {
-    server_seed_dc[i] = (char)(rand()%16);
-    client_seed_dc[i] = (char)(rand()%16);
-  }
+/*
+ * Function: add_chuchu_puzzle
+ * --------------------
+ * appends a puzzle to the catalog, doubles it when full
+ *
+ *  *s: pointer to server data struct
+ *  *puz: puzzle, owned by the catalog from now on
+ *
+ *  returns: 1 => OK
+ *           0 => FAIL, out of memory
+ *
+ */
+int add_chuchu_puzzle(server_data_t *s, puzzle_t *puz) {
+  if (s->puzz_count == s->puzz_size && !resize_chuchu_puzzles(s, s->puzz_size * 2))
+    return 0;
+  s->puzz_l[s->puzz_count] = puz;
+  index_chuchu_puzzle(s, (uint32_t)s->puzz_count);
+  s->puzz_count++;
+  s->puzz_gen++;
+  return 1;
+}
+
+puzzle_t *get_chuchu_puzzle(server_data_t *s, uint32_t id) {
+  uint32_t h, i;
 
-  pl->server_seed =  char_to_uint32(server_seed_dc);
-  pl->client_seed =  char_to_uint32(client_seed_dc);
-    
-  CRYPT_DC_CreateKeys(&pl->server_cipher, pl->server_seed);
-  CRYPT_DC_CreateKeys(&pl->client_cipher, pl->client_seed);  
+  for (h = puzzle_id_hash(id) & s->puzz_hash_mask; (i = s->puzz_id_hash[h]) != 0; h = (h + 1) & s->puzz_hash_mask)
+    if (s->puzz_l[i - 1]->id == id)
+      return s->puzz_l[i - 1];
+  return NULL;
+}
+
+puzzle_t *find_chuchu_puzzle(server_data_t *s, const char *p_name) {
+  uint32_t h, i;
+
+  for (h = puzzle_name_hash(p_name) & s->puzz_hash_mask; (i = s->puzz_name_hash[h]) != 0; h = (h + 1) & s->puzz_hash_mask)
+    if (strcmp(s->puzz_l[i - 1]->p_name, p_name) == 0)
+      return s->puzz_l[i - 1];
+  return NULL;
 }
 
 /*
- * Encrypt msg before sending it out
+ * PLAYER REGISTRY
+ *
+ * Three open addressing tables with linear probing map the client id
+ * of every player, and the Dreamcast id and username of the authorized
+ * ones, to the player. They hold at most m_cli entries and are kept at
+ * most half full, removal shifts the following entries back so no
+ * tombstones are needed. Authorized players are also linked into the
+ * list of the menu they are in, menu_l.
+ * Entries only change with reg_lock held, the players themselves stay
+ * valid as long as players_lock is held.
  */
-void send_chuchu_crypt_msg(int sock, CRYPT_SETUP *sp, char* msg, int msg_size) {
-  char crypt_msg[2048];
-  memset(crypt_msg, 0, sizeof(crypt_msg));
-  memcpy(crypt_msg, msg, (size_t)msg_size);
 
-  crypt_chuchu_msg(sp, crypt_msg, (long unsigned int)msg_size);
-  write(sock, crypt_msg, (size_t)msg_size);
+typedef uint32_t (*player_hash_fn)(const player_t *pl);
+
+static uint32_t player_id_hash(uint32_t client_id) {
+  return client_id * 2654435761u;
+}
+
+static uint32_t player_dc_hash(const char *dreamcast_id) {
+  uint32_t h = 2166136261u;
+  int i;
+
+  for (i=0;i<6;i++)
+    h = (h ^ (uint8_t)dreamcast_id[i]) * 16777619u;
+  return h;
+}
+
+static uint32_t player_name_hash(const char *username) {
+  uint32_t h = 2166136261u;
+
+  while (*username)
+    h = (h ^ (uint8_t)*username++) * 16777619u;
+  return h;
+}
+
+static uint32_t hash_player_id(const player_t *pl) {
+  return player_id_hash(pl->client_id);
+}
+
+static uint32_t hash_player_dc(const player_t *pl) {
+  return player_dc_hash(pl->dreamcast_id);
+}
+
+static uint32_t hash_player_name(const player_t *pl) {
+  return player_name_hash(pl->username);
+}
+
+static void index_chuchu_player(server_data_t *s, player_t **tab, player_t *pl, player_hash_fn hash) {
+  uint32_t h;
+
+  for (h = hash(pl) & s->pl_hash_mask; tab[h]; h = (h + 1) & s->pl_hash_mask);
+  tab[h] = pl;
 }
 
 /*
- * Crypt functions
- * By Fuzziqer Software copyright 2004
+ * Function: unindex_chuchu_player
+ * --------------------
+ * removes a player from one table, the entries after it
+ * in the probe run that may no longer be reachable are
+ * moved back into the hole
+ *
+ *  *s: pointer to server data struct
+ *  **tab: table to remove from
+ *  *pl: pointer to player struct
+ *  hash: key of the table
+ *
+ *  returns: void
+ *
  */
-void crypt_chuchu_msg(CRYPT_SETUP *sp, char *msg, unsigned long msg_size) {
-  CRYPT_DC_CryptData(sp, msg, msg_size);
+static void unindex_chuchu_player(server_data_t *s, player_t **tab, player_t *pl, player_hash_fn hash) {
+  uint32_t mask = s->pl_hash_mask;
+  uint32_t i, j, k;
+
+  for (i = hash(pl) & mask; tab[i] != pl; i = (i + 1) & mask)
+    if (tab[i] == NULL)
+      return;
+  tab[i] = NULL;
+  for (j = (i + 1) & mask; tab[j]; j = (j + 1) & mask) {
+    //Home slot of the entry, leave it if it lies cyclically in (i, j]
+    k = hash(tab[j]) & mask;
+    if (((j - k) & mask) < ((j - i) & mask))
+      continue;
+    tab[i] = tab[j];
+    tab[j] = NULL;
+    i = j;
+  }
 }
 
-void decrypt_chuchu_msg(CRYPT_SETUP *cp, char *msg, unsigned long msg_size) { 
-  CRYPT_DC_CryptData(cp, msg, msg_size);
+static int menu_list_of(uint32_t menu_id) {
+  return menu_id <= PUZZLE_ZONE_FILE ? (int)menu_id : CHUCHU_MENU_LISTS - 1;
 }
 
-void CRYPT_DC_MixKeys(CRYPT_SETUP* pc) {
-  uint32_t esi,edi,eax,ebp,edx;
-  edi = 1;
-  edx = 0x18;
-  eax = edi;
-  while (edx > 0) {
-    esi = pc->keys[eax + 0x1F];
-    ebp = pc->keys[eax];
-    ebp = ebp - esi;
-    pc->keys[eax] = ebp;
-    eax++;
-    edx--;
-  }
-  edi = 0x19;
-  edx = 0x1F;
-  eax = edi;
-  while (edx > 0) {
-    esi = pc->keys[eax - 0x18];
-    ebp = pc->keys[eax];
-    ebp = ebp - esi;
-    pc->keys[eax] = ebp;
-    eax++;
-    edx--;
-  }
+static void link_menu_player(server_data_t *s, player_t *pl) {
+  pl->menu_list = menu_list_of(pl->menu_id);
+  pl->menu_prev = NULL;
+  pl->menu_next = s->menu_l[pl->menu_list];
+  if (pl->menu_next)
+    pl->menu_next->menu_prev = pl;
+  s->menu_l[pl->menu_list] = pl;
 }
 
-void CRYPT_DC_CreateKeys(CRYPT_SETUP* pc, uint32_t val) {
+static void unlink_menu_player(server_data_t *s, player_t *pl) {
+  if (pl->menu_list < 0)
+    return;
+  if (pl->menu_prev)
+    pl->menu_prev->menu_next = pl->menu_next;
+  else
+    s->menu_l[pl->menu_list] = pl->menu_next;
+  if (pl->menu_next)
+    pl->menu_next->menu_prev = pl->menu_prev;
+  pl->menu_list = -1;
+}
 
-  memset(pc, 0, sizeof(CRYPT_SETUP));
-  uint32_t esi,ebx,edi,eax,edx,var1;
-  esi = 1;
-  ebx = val;
-  edi = 0x15;
-  pc->keys[56] = ebx;
-  pc->keys[55] = ebx;
-  while (edi <= 0x46E) {
-    eax = edi;
-    var1 = eax / 55;
-    edx = eax - (var1 * 55);
-    ebx = ebx - esi;
-    edi = edi + 0x15;
-    pc->keys[edx] = esi;
-    esi = ebx;
-    ebx = pc->keys[edx];
+/*
+ * Function: init_chuchu_registry
+ * --------------------
+ * allocates the registry tables for m_cli players
+ *
+ *  *s: pointer to server data struct
+ *
+ *  returns: 1 => OK
+ *           0 => FAIL
+ *
+ */
+int init_chuchu_registry(server_data_t *s) {
+  uint32_t hash_size = 16;
+  int i;
+
+  while (hash_size < (uint32_t)s->m_cli * 2)
+    hash_size *= 2;
+  s->pl_id_hash = calloc(hash_size, sizeof(player_t *));
+  s->pl_dc_hash = calloc(hash_size, sizeof(player_t *));
+  s->pl_name_hash = calloc(hash_size, sizeof(player_t *));
+  if (s->pl_id_hash == NULL || s->pl_dc_hash == NULL || s->pl_name_hash == NULL) {
+    free(s->pl_id_hash);
+    free(s->pl_dc_hash);
+    free(s->pl_name_hash);
+    return 0;
   }
-  CRYPT_DC_MixKeys(pc);
-  CRYPT_DC_MixKeys(pc);
-  CRYPT_DC_MixKeys(pc);
-  CRYPT_DC_MixKeys(pc);
-  pc->pc_posn = 56;
+  s->pl_hash_mask = hash_size - 1;
+  for (i=0;i<CHUCHU_MENU_LISTS;i++)
+    s->menu_l[i] = NULL;
+  return 1;
 }
 
-static uint32_t CRYPT_DC_GetNextKey(CRYPT_SETUP* pc) {    
-  uint32_t re;
-  if (pc->pc_posn == 56) {
-    CRYPT_DC_MixKeys(pc);
-    pc->pc_posn = 1;
+/*
+ * Function: add_chuchu_player
+ * --------------------
+ * puts a new player in a free slot of p_l and
+ * indexes its client id, players lock held for writing
+ *
+ *  *s: pointer to server data struct
+ *  *pl: pointer to player struct
+ *
+ *  returns: 1 => OK
+ *           0 => FAIL, server is full
+ *
+ */
+int add_chuchu_player(server_data_t *s, player_t *pl) {
+  int i;
+
+  pl->menu_list = -1;
+  pl->menu_prev = NULL;
+  pl->menu_next = NULL;
+  for (i=0;i<s->m_cli;i++) {
+    if (s->p_l[i] == NULL) {
+      s->p_l[i] = pl;
+      pl->slot = i;
+      lock_registry(s);
+      index_chuchu_player(s, s->pl_id_hash, pl, hash_player_id);
+      unlock_registry(s);
+      return 1;
+    }
   }
-  re = pc->keys[pc->pc_posn];
-  pc->pc_posn++;
-  return re;
+  return 0;
 }
 
-void CRYPT_DC_CryptData(CRYPT_SETUP* pc,void* data,unsigned long size) {
-  uint32_t x, tmp;
-  for (x = 0; x < size; x += 4) {
-    tmp = *((uint32_t *)(data + x));
+/*
+ * Function: remove_chuchu_player
+ * --------------------
+ * takes a player out of p_l and every index,
+ * players lock held for writing
+ *
+ *  *s: pointer to server data struct
+ *  *pl: pointer to player struct
+ *
+ *  returns: void
+ *
+ */
+void remove_chuchu_player(server_data_t *s, player_t *pl) {
+  lock_registry(s);
+  unindex_chuchu_player(s, s->pl_id_hash, pl, hash_player_id);
+  if (pl->authorized == 1) {
+    unindex_chuchu_player(s, s->pl_dc_hash, pl, hash_player_dc);
+    unindex_chuchu_player(s, s->pl_name_hash, pl, hash_player_name);
+    unlink_menu_player(s, pl);
+  }
+  unlock_registry(s);
+  s->p_l[pl->slot] = NULL;
+}
+
+/*
+ * Function: authorize_chuchu_player
+ * --------------------
+ * marks a logged in player as authorized, indexes its
+ * Dreamcast id and username and links it into the list
+ * of its menu
+ *
+ *  *s: pointer to server data struct
+ *  *pl: pointer to player struct
+ *
+ *  returns: void
+ *
+ */
+void authorize_chuchu_player(server_data_t *s, player_t *pl) {
+  lock_registry(s);
+  if (pl->authorized != 1) {
+    pl->authorized = 1;
+    index_chuchu_player(s, s->pl_dc_hash, pl, hash_player_dc);
+    index_chuchu_player(s, s->pl_name_hash, pl, hash_player_name);
+    link_menu_player(s, pl);
+  }
+  unlock_registry(s);
+}
+
+/*
+ * Function: set_chuchu_player_menu
+ * --------------------
+ * moves a player to another menu, every change
+ * of menu_id goes through here
+ *
+ *  *pl: pointer to player struct
+ *  menu_id: new menu
+ *
+ *  returns: void
+ *
+ */
+void set_chuchu_player_menu(player_t *pl, uint32_t menu_id) {
+  server_data_t *s = pl->data;
+
+  lock_registry(s);
+  if (pl->authorized == 1 && menu_list_of(menu_id) != pl->menu_list) {
+    unlink_menu_player(s, pl);
+    pl->menu_id = menu_id;
+    link_menu_player(s, pl);
+  } else {
+    pl->menu_id = menu_id;
+  }
+  unlock_registry(s);
+}
+
+/*
+ * Function: set_chuchu_player_name
+ * --------------------
+ * sets the username and Dreamcast id a player logs in
+ * with, reindexes them if it is already authorized
+ *
+ *  *pl: pointer to player struct
+ *  *username: new username
+ *  *dreamcast_id: 6 bytes id
+ *
+ *  returns: void
+ *
+ */
+void set_chuchu_player_name(player_t *pl, const char *username, const char *dreamcast_id) {
+  server_data_t *s = pl->data;
+
+  lock_registry(s);
+  if (pl->authorized == 1) {
+    unindex_chuchu_player(s, s->pl_dc_hash, pl, hash_player_dc);
+    unindex_chuchu_player(s, s->pl_name_hash, pl, hash_player_name);
+  }
+  strlcpy(pl->username, username, sizeof(pl->username));
+  memcpy(pl->dreamcast_id, dreamcast_id, 6);
+  if (pl->authorized == 1) {
+    index_chuchu_player(s, s->pl_dc_hash, pl, hash_player_dc);
+    index_chuchu_player(s, s->pl_name_hash, pl, hash_player_name);
+  }
+  unlock_registry(s);
+}
+
+player_t *get_chuchu_player(server_data_t *s, uint32_t client_id) {
+  player_t *pl;
+  uint32_t h;
+
+  lock_registry(s);
+  for (h = player_id_hash(client_id) & s->pl_hash_mask; (pl = s->pl_id_hash[h]) != NULL; h = (h + 1) & s->pl_hash_mask)
+    if (pl->client_id == client_id)
+      break;
+  unlock_registry(s);
+  return pl;
+}
+
+/*
+ * Function: find_chuchu_player
+ * --------------------
+ * finds an authorized player by Dreamcast id, there
+ * can be two while a session is replaced
+ *
+ *  *s: pointer to server data struct
+ *  *dreamcast_id: 6 bytes id
+ *  *except: player to skip, may be NULL
+ *
+ *  returns: pointer to player struct
+ *           NULL => not found
+ *
+ */
+player_t *find_chuchu_player(server_data_t *s, const char *dreamcast_id, player_t *except) {
+  player_t *pl;
+  uint32_t h;
+
+  lock_registry(s);
+  for (h = player_dc_hash(dreamcast_id) & s->pl_hash_mask; (pl = s->pl_dc_hash[h]) != NULL; h = (h + 1) & s->pl_hash_mask)
+    if (pl != except && memcmp(pl->dreamcast_id, dreamcast_id, 6) == 0)
+      break;
+  unlock_registry(s);
+  return pl;
+}
+
+player_t *find_chuchu_player_by_name(server_data_t *s, const char *username, player_t *except) {
+  player_t *pl;
+  uint32_t h;
+
+  lock_registry(s);
+  for (h = player_name_hash(username) & s->pl_hash_mask; (pl = s->pl_name_hash[h]) != NULL; h = (h + 1) & s->pl_hash_mask)
+    if (pl != except && strcmp(pl->username, username) == 0)
+      break;
+  unlock_registry(s);
+  return pl;
+}
+
+/*
+ * Function: get_room_from_item_id
+ * --------------------
+ *
+ * Returns game room from item id, rooms lock held
+ * 
+ *  *s: ptr to server data struct
+ *  item_id: id of pressed game room
+ *
+ *  returns: ptr to game room
+ *           NULL => no room, or the id of a removed one
+ *
+ */
+game_room_t* get_room_from_item_id(server_data_t *s, uint32_t item_id) {
+  int i = CHUCHU_ROOM_SLOT(item_id);
+
+  if (i < 0 || i >= s->m_rooms || s->g_l[i] == NULL)
+    return NULL;
+  if (s->g_l[i]->item_id != item_id)
+    return NULL;
+  return s->g_l[i];
+}
+
+/*
+ * SLAB POOLS
+ *
+ * Players and game rooms come from pools of fixed-size objects, one
+ * cache line aligned slab of per_slab objects at a time. Freed objects
+ * go on a free list and slabs are never given back, so connection
+ * churn does not reach malloc and the in use count shows any leak.
+ */
+
+/*
+ * Function: init_chuchu_pool
+ * --------------------
+ * sets up an empty pool
+ *
+ *  *pool: pointer to pool
+ *  *name: name in the logs
+ *  size: size of an object
+ *  per_slab: objects allocated at a time
+ *  max: objects in use at most, 0 => no limit
+ *
+ *  returns: 1 => OK
+ *           0 => FAILED
+ *
+ */
+int init_chuchu_pool(chuchu_pool_t *pool, const char *name, size_t size, int per_slab, int max) {
+  pool->name = name;
+  //Every object starts on a cache line and can hold the free list link
+  pool->size = (size + CHUCHU_CACHE_LINE - 1) & ~(size_t)(CHUCHU_CACHE_LINE - 1);
+  pool->per_slab = per_slab;
+  pool->max = max;
+  pool->free_l = NULL;
+  pool->slabs = 0;
+  pool->in_use = 0;
+  pool->high_water = 0;
+  pool->failures = 0;
+  return pthread_mutex_init(&pool->lock, NULL) == 0;
+}
+
+/*
+ * Function: alloc_chuchu_pool
+ * --------------------
+ * takes an object from the pool, adds a slab
+ * if the free list is empty. The object is
+ * not zeroed.
+ *
+ *  *pool: pointer to pool
+ *
+ *  returns: pointer to object
+ *           NULL => pool is full or out of memory
+ *
+ */
+void *alloc_chuchu_pool(chuchu_pool_t *pool) {
+  char *slab;
+  void *p = NULL;
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->max > 0 && pool->in_use >= pool->max) {
+    pool->failures++;
+    pthread_mutex_unlock(&pool->lock);
+    chuchu_error(SERVER, "Pool %s is full, %d in use", pool->name, pool->in_use);
+    return NULL;
+  }
+  if (pool->free_l == NULL) {
+    slab = (char *)aligned_alloc(CHUCHU_CACHE_LINE, pool->size * (size_t)pool->per_slab);
+    if (slab == NULL) {
+      pool->failures++;
+      pthread_mutex_unlock(&pool->lock);
+      chuchu_error(SERVER, "Could not allocate a slab of pool %s", pool->name);
+      return NULL;
+    }
+    for (i=pool->per_slab-1;i>=0;i--) {
+      *(void **)&slab[pool->size * (size_t)i] = pool->free_l;
+      pool->free_l = &slab[pool->size * (size_t)i];
+    }
+    pool->slabs++;
+  }
+  p = pool->free_l;
+  pool->free_l = *(void **)p;
+  if (++pool->in_use > pool->high_water)
+    pool->high_water = pool->in_use;
+  pthread_mutex_unlock(&pool->lock);
+  return p;
+}
+
+void free_chuchu_pool(chuchu_pool_t *pool, void *p) {
+  pthread_mutex_lock(&pool->lock);
+  *(void **)p = pool->free_l;
+  pool->free_l = p;
+  pool->in_use--;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void log_chuchu_pool(chuchu_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  chuchu_info(SERVER, "Pool %s: %d in use, %d high water, %d slabs of %d, %llu failures",
+	      pool->name, pool->in_use, pool->high_water, pool->slabs, pool->per_slab,
+	      (unsigned long long)pool->failures);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * HELP FUNCTIONS
+ */
+uint32_t char_to_uint32(char* data) {
+  uint32_t val = (uint32_t)((uint8_t)data[0] << 24 | (uint8_t)data[1] << 16 | (uint8_t)data[2] << 8  | (uint8_t)data[3]);
+  return val;
+}
+
+uint16_t char_to_uint16(char* data) {
+  uint16_t val = (uint16_t)((uint8_t)data[0] << 8 | (uint8_t)data[1]);
+  return val;
+}
+
+int uint32_to_char(uint32_t data, char* msg) {
+  msg[0] = (char)(data >> 24);
+  msg[1] = (char)(data >> 16);
+  msg[2] = (char)(data >> 8);
+  msg[3] = (char)data;
+  return 4;
+}
+
+int uint16_to_char(uint16_t data, char* msg) {
+  msg[0] = (char)(data >> 8);
+  msg[1] = (char)data;
+  return 2;
+}
+
+/*
+ * PRINT PACKET as TCPDUMP
+ */
+void print_chuchu_data(void* pkt,unsigned long pkt_size) {
+  unsigned char* pkt_content = (unsigned char*)pkt;
+  unsigned long i,j,off;
+  char buffer[17];
+  buffer[16] = 0;
+  off = 0;
+  printf("--------------------\n");
+  printf("0000 | ");
+  for (i = 0; i < pkt_size; i++) {
+    if (off == 16) {
+      memcpy(buffer,&pkt_content[i - 16],16);
+      for (j = 0; j < 16; j++) if (buffer[j] < 0x20) buffer[j] = '.';
+      printf("| %s\n%04X | ",buffer,(unsigned int)i);
+      off = 0;
+    }
+    printf("%02X ",pkt_content[i]);
+    off++;
+  }
+  buffer[off] = 0;
+  memcpy(buffer,&pkt_content[i - off],off);
+  for (j = 0; j < off; j++) if (buffer[j] < 0x20) buffer[j] = '.';
+  for (j = 0; j < 16 - off; j++) printf("   ");
+  printf("| %s\n",buffer);
+}
+
+/*
+ * Function: create_chuchu_hdr
+ * --------------------
+ * create standard chuchu TCP header
+ * 
+ *  *msg: pointer to msg buffer
+ *   msg_id: msg id
+ *   msg_flag: msg flag
+ *   msg_size: size of msg 
+ *
+ *  returns: void
+ *
+ */
+void create_chuchu_hdr(char* msg, uint8_t msg_id, uint8_t msg_flag, uint16_t msg_size) {
+  msg_size = htons(msg_size);
+  msg[0] = (char)msg_id;
+  msg[1] = (char)msg_flag;
+  uint16_to_char(msg_size, &msg[2]);
+}
+
+/*
+ * Function: watch_chuchu_tx
+ * --------------------
+ * enables EPOLLOUT for a player socket registered in the
+ * lobby event loop while its outbound queue is not empty,
+ * and EPOLLIN unless input is paused, tx mutex held
+ *
+ *  *pl: pointer to player struct
+ *  force: update even if EPOLLOUT doesn't change
+ *
+ *  returns: void
+ *
+ */
+static void watch_chuchu_tx(player_t *pl, int force) {
+  server_data_t *s = (server_data_t *)pl->data;
+  struct epoll_event ev;
+  int enable = (pl->tx.first != NULL && !pl->tx.closing);
+
+  if (s->epoll_fd < 0 || (enable == pl->tx.armed && !force))
+    return;
+  memset(&ev, 0, sizeof(ev));
+  if (!pl->rx_paused)
+    ev.events = EPOLLIN | EPOLLRDHUP;
+  if (enable)
+    ev.events |= EPOLLOUT;
+  ev.data.ptr = pl;
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, pl->sock, &ev);
+  pl->tx.armed = enable;
+}
+
+/*
+ * Function: pause_chuchu_rx
+ * --------------------
+ * stops or resumes reading from a player socket in
+ * the lobby event loop, used while a DB job of the
+ * player is pending so the receive buffer can't fill
+ *
+ *  *pl: pointer to player struct
+ *  pause: 1 => stop reading
+ *         0 => resume
+ *
+ *  returns: void
+ *
+ */
+void pause_chuchu_rx(player_t *pl, int pause) {
+  pthread_mutex_lock(&pl->tx.mutex);
+  if (pl->rx_paused != pause && !pl->tx.closing) {
+    pl->rx_paused = pause;
+    watch_chuchu_tx(pl, 1);
+  }
+  pthread_mutex_unlock(&pl->tx.mutex);
+}
+
+/*
+ * Function: init_chuchu_tx
+ * --------------------
+ * sets up the outbound queue of a player
+ *
+ *  *pl: pointer to player struct
+ *
+ *  returns: void
+ *
+ */
+void init_chuchu_tx(player_t *pl) {
+  pl->refs = 1;
+  pl->tx.first = NULL;
+  pl->tx.last = NULL;
+  pl->tx.bytes = 0;
+  pl->tx.closing = 0;
+  pl->tx.armed = 0;
+  pthread_mutex_init(&pl->tx.mutex, NULL);
+}
+
+/*
+ * Function: free_chuchu_tx
+ * --------------------
+ * drops all queued data of a player
+ *
+ *  *pl: pointer to player struct
+ *
+ *  returns: void
+ *
+ */
+void free_chuchu_tx(player_t *pl) {
+  chuchu_tx_seg_t *seg = pl->tx.first, *next = NULL;
+
+  while (seg) {
+    next = seg->next;
+    free(seg);
+    seg = next;
+  }
+  pl->tx.first = NULL;
+  pl->tx.last = NULL;
+  pl->tx.bytes = 0;
+  pthread_mutex_destroy(&pl->tx.mutex);
+}
+
+int pending_chuchu_tx(player_t *pl) {
+  return __atomic_load_n(&pl->tx.bytes, __ATOMIC_RELAXED) > 0;
+}
+
+/*
+ * Function: close_chuchu_tx
+ * --------------------
+ * stops all writes to the player socket, called
+ * before the socket is closed
+ *
+ *  *pl: pointer to player struct
+ *
+ *  returns: void
+ *
+ */
+void close_chuchu_tx(player_t *pl) {
+  pthread_mutex_lock(&pl->tx.mutex);
+  pl->tx.closing = 1;
+  pthread_mutex_unlock(&pl->tx.mutex);
+}
+
+/*
+ * Function: put_chuchu_player
+ * --------------------
+ * drops a reference to the player, the last
+ * one frees it
+ *
+ *  *pl: pointer to player struct
+ *
+ *  returns: void
+ *
+ */
+void put_chuchu_player(player_t *pl) {
+  if (__atomic_sub_fetch(&pl->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free_chuchu_tx(pl);
+    free_chuchu_pool(&((server_data_t *)pl->data)->player_pool, pl);
+  }
+}
+
+/*
+ * Function: crypt_chuchu_copy
+ * --------------------
+ * encrypts src into dst in one pass, dst needs
+ * room for size rounded up to 4 bytes
+ *
+ *  *sp: pointer to server cipher
+ *  *dst: encrypted output
+ *  *src: plain msg
+ *  size: size of msg
+ *
+ *  returns: void
+ *
+ */
+static void crypt_chuchu_copy(CRYPT_SETUP *sp, char *dst, const char *src, uint32_t size) {
+  uint32_t x = size & ~3U, tmp;
+
+  CRYPT_DC_CryptWords(sp, dst, src, x / 4);
+  if (x < size) {
+    tmp = 0;
+    memcpy(&tmp, &src[x], size - x);
+    tmp = LE32(tmp) ^ CRYPT_DC_GetNextKey(sp);
+    tmp = LE32(tmp);
+    memcpy(&dst[x], &tmp, 4);
+  }
+}
+
+/*
+ * Function: push_chuchu_tx
+ * --------------------
+ * appends a msg to the outbound queue, the segments
+ * are gathered into one queue segment and encrypted
+ * there, tx mutex held
+ *
+ *  *pl: pointer to player struct
+ *  *iov: segments of the msg
+ *  cnt: nr of segments
+ *  size: size of all segments
+ *  *sp: server cipher to encrypt the queued copy with,
+ *       NULL if data is already encrypted or plain
+ *
+ *  returns: 0 => OK
+ *          -1 => Out of memory
+ *
+ */
+static int push_chuchu_tx(player_t *pl, const struct iovec *iov, int cnt, uint32_t size, CRYPT_SETUP *sp) {
+  chuchu_tx_seg_t *seg = pl->tx.last;
+  //The cipher works on whole words
+  uint32_t room = (size + 3) & ~3U, tail;
+  int i;
+
+  if (seg == NULL || seg->size - seg->tail < room) {
+    seg = malloc(sizeof(chuchu_tx_seg_t) + (room > CHUCHU_TX_SEG_SIZE ? room : CHUCHU_TX_SEG_SIZE));
+    if (seg == NULL)
+      return -1;
+    seg->next = NULL;
+    seg->head = 0;
+    seg->tail = 0;
+    seg->size = room > CHUCHU_TX_SEG_SIZE ? room : CHUCHU_TX_SEG_SIZE;
+    if (pl->tx.last)
+      pl->tx.last->next = seg;
+    else
+      pl->tx.first = seg;
+    pl->tx.last = seg;
+  }
+  if (sp && cnt == 1) {
+    crypt_chuchu_copy(sp, &seg->data[seg->tail], (const char *)iov[0].iov_base, size);
+  } else {
+    for (i=0,tail=seg->tail;i<cnt;i++) {
+      memcpy(&seg->data[tail], iov[i].iov_base, iov[i].iov_len);
+      tail += (uint32_t)iov[i].iov_len;
+    }
+    if (sp)
+      CRYPT_DC_CryptData(sp, &seg->data[seg->tail], size);
+  }
+  seg->tail += size;
+  pl->tx.bytes += size;
+
+  return 0;
+}
+
+/*
+ * Function: write_chuchu_tx
+ * --------------------
+ * writes as much of the outbound queue as the socket
+ * takes, a few segments per sendmsg, tx mutex held
+ *
+ *  *pl: pointer to player struct
+ *
+ *  returns: 0 => OK
+ *          -1 => socket error
+ *
+ */
+static int write_chuchu_tx(player_t *pl) {
+  struct iovec iov[16];
+  struct msghdr mh;
+  chuchu_tx_seg_t *seg = NULL;
+  ssize_t n = 0;
+  size_t len = 0;
+  int cnt = 0;
+
+  while (pl->tx.first) {
+    cnt = 0;
+    for (seg = pl->tx.first; seg && cnt < 16; seg = seg->next) {
+      iov[cnt].iov_base = &seg->data[seg->head];
+      iov[cnt].iov_len = seg->tail - seg->head;
+      cnt++;
+    }
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = (size_t)cnt;
+    n = sendmsg(pl->sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	return 0;
+      return -1;
+    }
+    pl->tx.bytes -= (uint32_t)n;
+    //Release what has been sent
+    while (n > 0) {
+      seg = pl->tx.first;
+      len = seg->tail - seg->head;
+      if ((size_t)n < len) {
+	seg->head += (uint32_t)n;
+	break;
+      }
+      n -= (ssize_t)len;
+      pl->tx.first = seg->next;
+      if (pl->tx.first == NULL)
+	pl->tx.last = NULL;
+      free(seg);
+    }
+  }
+  return 0;
+}
+
+//Flags of send_chuchu_iov
+enum { TX_DEFER = 0x01, TX_INPLACE = 0x02 };
+
+/*
+ * Function: send_chuchu_iov
+ * --------------------
+ * sends a msg to the player. Blocking players (login server)
+ * get a plain blocking send. Otherwise the msg is sent directly
+ * when nothing is pending and what the socket does not take is
+ * queued until it is writable. A player that lets the queue grow
+ * past CHUCHU_TX_HIGH_WATER is too slow and gets disconnected.
+ *
+ * The msg may be split in segments, only the last one may end
+ * in the middle of a cipher word. Encrypted msgs are never staged:
+ * segments the caller owns are encrypted in place with TX_INPLACE
+ * and sent as they are, TX_DEFER encrypts them into the queue.
+ *
+ *  *pl: pointer to player struct
+ *  *iov: segments of the msg, used up by the send
+ *  cnt: nr of segments
+ *  *sp: server cipher, NULL to send msg as it is
+ *  flags: TX_DEFER => only queue, the caller writes the socket later
+ *         TX_INPLACE => encrypt the segments themselves
+ *
+ *  returns: 1 => queue was empty, caller must flush (defer only)
+ *           0 => OK
+ *
+ */
+static int send_chuchu_iov(player_t *pl, struct iovec *iov, int cnt, CRYPT_SETUP *sp, int flags) {
+  server_data_t *s = (server_data_t *)pl->data;
+  struct msghdr mh;
+  ssize_t n = 0;
+  uint32_t size = 0, queued = 0;
+  int i;
+
+  assert(sp == NULL || (flags & (TX_DEFER | TX_INPLACE)));
+  for (i=0;i<cnt;i++) {
+    assert(sp == NULL || i == cnt - 1 || (iov[i].iov_len & 3) == 0);
+    size += (uint32_t)iov[i].iov_len;
+  }
+  assert(size <= MAX_PKT_SIZE);
+  if (size > MAX_PKT_SIZE) {
+    chuchu_error(SERVER, "Msg of %u bytes for socket %d is too large", size, pl->sock);
+    return 0;
+  }
+
+  pthread_mutex_lock(&pl->tx.mutex);
+  if (pl->tx.closing) {
+    __atomic_add_fetch(&s->tx_dropped_msgs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pl->tx.mutex);
+    return 0;
+  }
+  if (pl->tx.bytes + size > CHUCHU_TX_HIGH_WATER) {
+    //Slow consumer, the reader sees the shutdown and cleans up
+    pl->tx.closing = 1;
+    __atomic_add_fetch(&s->tx_dropped_msgs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->tx_slow_clients, 1, __ATOMIC_RELAXED);
+    shutdown(pl->sock, SHUT_RDWR);
+    chuchu_error(SERVER, "Socket %d is too slow, %u bytes queued - Disconnecting", pl->sock, pl->tx.bytes);
+    pthread_mutex_unlock(&pl->tx.mutex);
+    return 0;
+  }
+  //Under the tx mutex, the keys are used in queue order
+  if (sp && (flags & TX_INPLACE)) {
+    for (i=0;i<cnt;i++)
+      CRYPT_DC_CryptData(sp, iov[i].iov_base, iov[i].iov_len);
+    sp = NULL;
+  }
+
+  //Keep the order, only write directly if nothing is pending
+  if (pl->tx.first == NULL && !(flags & TX_DEFER)) {
+    while (size > 0) {
+      memset(&mh, 0, sizeof(mh));
+      mh.msg_iov = iov;
+      mh.msg_iovlen = (size_t)cnt;
+      n = sendmsg(pl->sock, &mh, pl->nonblock ? MSG_DONTWAIT | MSG_NOSIGNAL : MSG_NOSIGNAL);
+      if (n < 0) {
+	if (errno == EINTR)
+	  continue;
+	if (pl->nonblock && (errno == EAGAIN || errno == EWOULDBLOCK))
+	  break;
+	//Broken socket, the reader will see it and disconnect
+	pthread_mutex_unlock(&pl->tx.mutex);
+	return 0;
+      }
+      size -= (uint32_t)n;
+      //Skip what the socket took
+      while (n > 0 && (size_t)n >= iov->iov_len) {
+	n -= (ssize_t)iov->iov_len;
+	iov++;
+	cnt--;
+      }
+      if (n > 0) {
+	iov->iov_base = (char *)iov->iov_base + n;
+	iov->iov_len -= (size_t)n;
+      }
+    }
+    if (size == 0) {
+      pthread_mutex_unlock(&pl->tx.mutex);
+      return 0;
+    }
+  }
+
+  queued = pl->tx.bytes;
+  if (push_chuchu_tx(pl, iov, cnt, size, sp) < 0) {
+    chuchu_error(SERVER, "Could not queue %u bytes for socket %d", size, pl->sock);
+    __atomic_add_fetch(&s->tx_dropped_msgs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pl->tx.mutex);
+    return 0;
+  }
+  __atomic_add_fetch(&s->tx_queued_bytes, size, __ATOMIC_RELAXED);
+  if (!(flags & TX_DEFER))
+    watch_chuchu_tx(pl, 0);
+  pthread_mutex_unlock(&pl->tx.mutex);
+  return ((flags & TX_DEFER) && queued == 0);
+}
+
+/*
+ * Function: flush_chuchu_msg
+ * --------------------
+ * writes pending data of a player socket,
+ * called when the socket is writable
+ *
+ *  *pl: pointer to player struct
+ *
+ *  returns: 0 => OK
+ *          -1 => socket error
+ *
+ */
+int flush_chuchu_msg(player_t *pl) {
+  int rc = 0;
+
+  pthread_mutex_lock(&pl->tx.mutex);
+  if (!pl->tx.closing)
+    rc = write_chuchu_tx(pl);
+  watch_chuchu_tx(pl, 0);
+  pthread_mutex_unlock(&pl->tx.mutex);
+  return rc;
+}
+
+void send_chuchu_msg(player_t *pl, char* msg, int msg_size) {
+  struct iovec iov = { msg, (size_t)msg_size };
+
+  send_chuchu_iov(pl, &iov, 1, NULL, 0);
+}
+
+/*
+ * Players with a msg queued by this thread, their sockets
+ * are written once the player registry lock is released.
+ * The batch grows instead of writing sockets under the locks.
+ */
+#define CHUCHU_BCAST_BATCH 1024
+static __thread player_t **bcast_pl = NULL;
+static __thread int bcast_cnt = 0;
+static __thread int bcast_max = 0;
+
+/*
+ * Function: bcast_chuchu_player
+ * --------------------
+ * queues one recipient of a broadcast, the plain msg is
+ * encrypted straight into the outbound queue
+ *
+ *  *pl: pointer to player struct
+ *  *msg: plain msg, shared by all recipients
+ *  size: size of msg
+ *
+ *  returns: void
+ *
+ */
+static void bcast_chuchu_player(player_t *pl, const char *msg, uint32_t size) {
+  struct iovec iov = { (void *)msg, size };
+  player_t **grown;
+  int max;
+
+  if (!send_chuchu_iov(pl, &iov, 1, &pl->server_cipher, TX_DEFER))
+    return;
+  if (bcast_cnt == bcast_max) {
+    max = bcast_max ? bcast_max * 2 : CHUCHU_BCAST_BATCH;
+    grown = (player_t **)realloc(bcast_pl, (size_t)max * sizeof(player_t *));
+    if (grown == NULL) {
+      //Out of memory, better a write under the locks than a lost msg
+      chuchu_error(SERVER, "Could not grow the broadcast batch to %d players", max);
+      flush_chuchu_msg(pl);
+      return;
+    }
+    bcast_pl = grown;
+    bcast_max = max;
+  }
+  __atomic_add_fetch(&pl->refs, 1, __ATOMIC_RELAXED);
+  bcast_pl[bcast_cnt++] = pl;
+}
+
+/*
+ * Function: send_chuchu_bcast
+ * --------------------
+ * sends the same msg to a set of players, called with
+ * players_lock held, and the room mutex for BCAST_GAME_ROOM.
+ * The menu lists are walked under reg_lock, taken here.
+ * The msg is encrypted into each queue right away so the
+ * order between msgs stays the same for every player, the
+ * sockets are written by flush_chuchu_bcast
+ *
+ *  *s: pointer to server data struct, NULL for BCAST_GAME_ROOM
+ *  set: BCAST_AUTHORIZED => all authorized players
+ *       BCAST_ROOM_MENU => authorized players in the room menu
+ *       BCAST_GAME_ROOM => players in the game room gr
+ *  *gr: game room for BCAST_GAME_ROOM
+ *  *msg: plain msg
+ *  msg_size: size of msg
+ *
+ *  returns: void
+ *
+ */
+void send_chuchu_bcast(server_data_t *s, BCAST_SET set, game_room_t *gr, char* msg, int msg_size) {
+  int i;
+  player_t *pl;
+
+  switch (set) {
+  case BCAST_AUTHORIZED:
+    lock_registry(s);
+    for (i=0;i<CHUCHU_MENU_LISTS;i++)
+      for (pl = s->menu_l[i]; pl; pl = pl->menu_next)
+	bcast_chuchu_player(pl, msg, (uint32_t)msg_size);
+    unlock_registry(s);
+    break;
+  case BCAST_ROOM_MENU:
+    lock_registry(s);
+    for (pl = s->menu_l[ROOM_MENU]; pl; pl = pl->menu_next)
+      bcast_chuchu_player(pl, msg, (uint32_t)msg_size);
+    unlock_registry(s);
+    break;
+  case BCAST_GAME_ROOM:
+    for (i=0;i<gr->m_pl_slots;i++)
+      if (gr->player_slots[i])
+	bcast_chuchu_player(gr->player_slots[i], msg, (uint32_t)msg_size);
+    break;
+  }
+}
+
+/*
+ * Function: queue_chuchu_crypt_msg
+ * --------------------
+ * like send_chuchu_crypt_msg but the socket is only
+ * written by flush_chuchu_bcast, used while holding
+ * the server locks
+ *
+ *  *pl: pointer to player struct
+ *  *msg: plain msg
+ *  msg_size: size of msg
+ *
+ *  returns: void
+ *
+ */
+void queue_chuchu_crypt_msg(player_t *pl, char* msg, int msg_size) {
+  bcast_chuchu_player(pl, msg, (uint32_t)msg_size);
+}
+
+/*
+ * Function: flush_chuchu_bcast
+ * --------------------
+ * writes the sockets of the players this thread has
+ * queued msgs for, called after the player registry
+ * lock is released
+ *
+ *  returns: void
+ *
+ */
+void flush_chuchu_bcast(void) {
+  int i;
+
+  for (i=0;i<bcast_cnt;i++) {
+    flush_chuchu_msg(bcast_pl[i]);
+    put_chuchu_player(bcast_pl[i]);
+  }
+  bcast_cnt = 0;
+}
+
+/*
+ * Function: init_chuchu_stream
+ * --------------------
+ * resets the receive buffer of a connection
+ * 
+ *   st: pointer to stream struct
+ *
+ *  returns: void
+ *
+ */
+void init_chuchu_stream(chuchu_stream_t *st) {
+  st->head = 0;
+  st->dec = 0;
+  st->tail = 0;
+}
+
+/*
+ * Function: compact_chuchu_stream
+ * --------------------
+ * moves the unhandled data to the start of the buffer
+ * 
+ *   st: pointer to stream struct
+ *
+ *  returns: void
+ *
+ */
+static void compact_chuchu_stream(chuchu_stream_t *st) {
+  if (st->head == 0)
+    return;
+  if (st->tail > st->head)
+    memmove(st->buf, &st->buf[st->head], st->tail - st->head);
+  st->dec -= st->head;
+  st->tail -= st->head;
+  st->head = 0;
+}
+
+/*
+ * Function: recv_chuchu_stream
+ * --------------------
+ * receives more data at the end of the stream buffer
+ * 
+ *   sock: socket to read from
+ *   st: pointer to stream struct
+ *
+ *  returns: same as recv()
+ *
+ */
+ssize_t recv_chuchu_stream(int sock, chuchu_stream_t *st) {
+  ssize_t read_size = 0;
+
+  compact_chuchu_stream(st);
+  read_size = recv(sock, &st->buf[st->tail], sizeof(st->buf) - st->tail, 0);
+  if (read_size > 0)
+    st->tail += (uint32_t)read_size;
+  return read_size;
+}
+
+/*
+ * Function: write_chuchu_stream
+ * --------------------
+ * appends received data to the stream buffer
+ * 
+ *   st: pointer to stream struct
+ *   data: received data
+ *   size: size of received data
+ *
+ *  returns: 0 => OK
+ *          -1 => Buffer overflow
+ *
+ */
+int write_chuchu_stream(chuchu_stream_t *st, const char *data, size_t size) {
+  compact_chuchu_stream(st);
+  if (size > sizeof(st->buf) - st->tail)
+    return -1;
+  memcpy(&st->buf[st->tail], data, size);
+  st->tail = (uint32_t)(st->tail + size);
+  return 0;
+}
+
+/*
+ * Function: crypt_chuchu_tail
+ * --------------------
+ * decrypts the last 1-3 bytes of a frame, the key word is
+ * consumed like the sender does for unaligned packets but
+ * the bytes of the next frame are left alone
+ * 
+ *   cp: pointer to client cipher
+ *   data: last bytes of the frame
+ *   size: nr of bytes
+ *
+ *  returns: void
+ *
+ */
+static void crypt_chuchu_tail(CRYPT_SETUP *cp, char *data, uint32_t size) {
+  char word[4];
+
+  memset(word, 0, sizeof(word));
+  memcpy(word, data, size);
+  CRYPT_DC_CryptData(cp, word, 4);
+  memcpy(data, word, size);
+}
+
+/*
+ * Function: next_chuchu_msg
+ * --------------------
+ * decrypts the complete 4 byte words received so far and
+ * returns the next complete frame, partial frames stay in
+ * the buffer until the rest arrives
+ * 
+ *   st: pointer to stream struct
+ *   cp: pointer to client cipher
+ *   frame: set to the frame, valid until the next recv
+ *
+ *  returns: >0 => Size of frame
+ *            0 => Need more data
+ *           -1 => Corrupt frame
+ *
+ */
+int next_chuchu_msg(chuchu_stream_t *st, CRYPT_SETUP *cp, char **frame) {
+  uint32_t pkt_size = 0, end = 0, n = 0;
+
+  if (st->tail - st->head < 4)
+    return 0;
+  //Header of a new frame
+  if (st->dec == st->head) {
+    CRYPT_DC_CryptData(cp, &st->buf[st->head], 4);
+    st->dec += 4;
+  }
+  pkt_size = ntohs(char_to_uint16(&st->buf[st->head + 2]));
+  if (pkt_size < 4 || pkt_size > sizeof(st->buf)) {
+    chuchu_error(SERVER,"Invalid packet size %d", (int)pkt_size);
+    return -1;
+  }
+
+  end = st->head + pkt_size;
+  if (st->tail < end) {
+    //Partial frame, only decrypt what is complete
+    n = (st->tail - st->dec) & ~3U;
+    CRYPT_DC_CryptData(cp, &st->buf[st->dec], n);
+    st->dec += n;
+    return 0;
+  }
+  n = (end - st->dec) & ~3U;
+  CRYPT_DC_CryptData(cp, &st->buf[st->dec], n);
+  st->dec += n;
+  if (st->dec < end) {
+    crypt_chuchu_tail(cp, &st->buf[st->dec], end - st->dec);
+    st->dec = end;
+  }
+
+  *frame = &st->buf[st->head];
+  st->head = end;
+  //Word padding after an unaligned frame, dropped like before
+  if (st->tail == end + ((4 - (pkt_size & 3)) & 3))
+    st->head = st->tail;
+  if (st->head == st->tail)
+    init_chuchu_stream(st);
+  return (int)pkt_size;
+}
+
+/*
+ * HANDSHAKE KEYS
+ *
+ * Seeds are four bytes of 0..15, so there are 65536 of them. They
+ * come from a per-thread xorshift generator seeded by getrandom.
+ * With CHUCHU_CRYPT_TABLE set the initial keys of every seed are
+ * kept in a file that both servers map, and a handshake copies them
+ * instead of running CRYPT_DC_CreateKeys twice.
+ */
+
+#define CRYPT_DC_SEEDS 0x10000
+#define CRYPT_DC_KEYS_SIZE (CRYPT_DC_KEYS * sizeof(uint32_t))
+#define CRYPT_DC_TABLE_SIZE (CRYPT_DC_SEEDS * CRYPT_DC_KEYS_SIZE)
+
+static const uint32_t *crypt_table = NULL;
+static __thread uint64_t crypt_rng = 0;
+
+//Index 0xabcd => seed 0x0a0b0c0d
+static uint32_t crypt_dc_seed(uint32_t idx) {
+  return (idx & 0xf000) << 12 | (idx & 0x0f00) << 8 | (idx & 0x00f0) << 4 | (idx & 0x000f);
+}
+
+static uint32_t next_chuchu_random(void) {
+  uint64_t x = crypt_rng;
+
+  if (x == 0 && (getrandom(&x, sizeof(x), 0) != (ssize_t)sizeof(x) || x == 0)) {
+    chuchu_error(SERVER, "getrandom failed: %s", strerror(errno));
+    x = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&crypt_rng ^ 0x9e3779b97f4a7c15ULL;
+  }
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  crypt_rng = x;
+  return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/*
+ * Function: map_chuchu_crypt_table
+ * --------------------
+ * maps a key table and checks it against
+ * CRYPT_DC_CreateKeys for a few seeds
+ *
+ *  *path: table file
+ *
+ *  returns: ptr to table
+ *           NULL => missing or not valid
+ *
+ */
+static const uint32_t *map_chuchu_crypt_table(const char *path) {
+  const uint32_t check[] = { 0x0000, 0x1234, 0xbeef, 0xffff };
+  CRYPT_SETUP c;
+  struct stat st;
+  uint32_t *t;
+  size_t i;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size != CRYPT_DC_TABLE_SIZE) {
+    close(fd);
+    return NULL;
+  }
+  t = (uint32_t *)mmap(NULL, CRYPT_DC_TABLE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (t == MAP_FAILED)
+    return NULL;
+  for (i=0;i<sizeof(check)/sizeof(check[0]);i++) {
+    CRYPT_DC_CreateKeys(&c, crypt_dc_seed(check[i]));
+    if (memcmp(c.keys, &t[check[i] * CRYPT_DC_KEYS], CRYPT_DC_KEYS_SIZE) != 0) {
+      munmap(t, CRYPT_DC_TABLE_SIZE);
+      return NULL;
+    }
+  }
+  return t;
+}
+
+/*
+ * Function: write_chuchu_crypt_table
+ * --------------------
+ * builds the key table of all seeds, the file
+ * is replaced at once so the other server never
+ * maps half of it
+ *
+ *  *path: table file
+ *
+ *  returns: 1 => OK
+ *           0 => FAILED
+ *
+ */
+static int write_chuchu_crypt_table(const char *path) {
+  char tmp[512];
+  CRYPT_SETUP c;
+  FILE *file;
+  uint32_t idx;
+  int ok = 1;
+
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  if ((file = fopen(tmp, "wb")) == NULL) {
+    chuchu_error(SERVER, "Could not create key table %s: %s", tmp, strerror(errno));
+    return 0;
+  }
+  chuchu_info(SERVER, "Building key table %s", path);
+  for (idx=0;ok && idx<CRYPT_DC_SEEDS;idx++) {
+    CRYPT_DC_CreateKeys(&c, crypt_dc_seed(idx));
+    ok = fwrite(c.keys, CRYPT_DC_KEYS_SIZE, 1, file) == 1;
+  }
+  if (fclose(file) != 0)
+    ok = 0;
+  if (!ok || rename(tmp, path) < 0) {
+    chuchu_error(SERVER, "Could not write key table %s: %s", path, strerror(errno));
+    unlink(tmp);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Function: init_chuchu_crypt_table
+ * --------------------
+ * maps the key table, builds it first if it
+ * is missing or does not match
+ *
+ *  *path: table file
+ *
+ *  returns: 1 => OK
+ *           0 => FAILED, keys are created per handshake
+ *
+ */
+int init_chuchu_crypt_table(const char *path) {
+  const uint32_t *t;
+
+  if ((t = map_chuchu_crypt_table(path)) == NULL &&
+      (!write_chuchu_crypt_table(path) || (t = map_chuchu_crypt_table(path)) == NULL)) {
+    chuchu_error(SERVER, "Key table %s not usable, creating keys per handshake", path);
+    return 0;
+  }
+  crypt_table = t;
+  return 1;
+}
+
+static void init_chuchu_keys(CRYPT_SETUP *pc, uint32_t idx) {
+  if (crypt_table == NULL) {
+    CRYPT_DC_CreateKeys(pc, crypt_dc_seed(idx));
+    return;
+  }
+  memcpy(pc->keys, &crypt_table[idx * CRYPT_DC_KEYS], CRYPT_DC_KEYS_SIZE);
+  pc->pc_posn = 56;
+}
+
+/*
+ * Function: init_chuchu_crypt
+ * --------------------
+ * generates server and client seed 
+ * and creates the nec. keys
+ * 
+ *  *pl: pointer to player struct
+ *
+ *  returns: void
+ *
+ */
+void init_chuchu_crypt(player_t* pl) {
+  uint32_t r = next_chuchu_random();
+
+  pl->server_seed = crypt_dc_seed(r & 0xffff);
+  pl->client_seed = crypt_dc_seed(r >> 16);
+  init_chuchu_keys(&pl->server_cipher, r & 0xffff);
+  init_chuchu_keys(&pl->client_cipher, r >> 16);
+}
+
+/*
+ * Encrypt msg in place and send it out, the
+ * caller owns msg and must not send it again
+ */
+void send_chuchu_crypt_msg(player_t *pl, char* msg, int msg_size) {
+  struct iovec iov = { msg, (size_t)msg_size };
+
+  send_chuchu_iov(pl, &iov, 1, &pl->server_cipher, TX_INPLACE);
+}
+
+/*
+ * Crypt functions
+ * By Fuzziqer Software copyright 2004
+ */
+void crypt_chuchu_msg(CRYPT_SETUP *sp, char *msg, unsigned long msg_size) {
+  CRYPT_DC_CryptData(sp, msg, msg_size);
+}
+
+void decrypt_chuchu_msg(CRYPT_SETUP *cp, char *msg, unsigned long msg_size) { 
+  CRYPT_DC_CryptData(cp, msg, msg_size);
+}
+
+void CRYPT_DC_MixKeys(CRYPT_SETUP* pc) {
+  uint32_t esi,edi,eax,ebp,edx;
+  edi = 1;
+  edx = 0x18;
+  eax = edi;
+  while (edx > 0) {
+    esi = pc->keys[eax + 0x1F];
+    ebp = pc->keys[eax];
+    ebp = ebp - esi;
+    pc->keys[eax] = ebp;
+    eax++;
+    edx--;
+  }
+  edi = 0x19;
+  edx = 0x1F;
+  eax = edi;
+  while (edx > 0) {
+    esi = pc->keys[eax - 0x18];
+    ebp = pc->keys[eax];
+    ebp = ebp - esi;
+    pc->keys[eax] = ebp;
+    eax++;
+    edx--;
+  }
+}
+
+void CRYPT_DC_CreateKeys(CRYPT_SETUP* pc, uint32_t val) {
+
+  memset(pc, 0, sizeof(CRYPT_SETUP));
+  uint32_t esi,ebx,edi,eax,edx,var1;
+  esi = 1;
+  ebx = val;
+  edi = 0x15;
+  pc->keys[56] = ebx;
+  pc->keys[55] = ebx;
+  while (edi <= 0x46E) {
+    eax = edi;
+    var1 = eax / 55;
+    edx = eax - (var1 * 55);
+    ebx = ebx - esi;
+    edi = edi + 0x15;
+    pc->keys[edx] = esi;
+    esi = ebx;
+    ebx = pc->keys[edx];
+  }
+  CRYPT_DC_MixKeys(pc);
+  CRYPT_DC_MixKeys(pc);
+  CRYPT_DC_MixKeys(pc);
+  CRYPT_DC_MixKeys(pc);
+  pc->pc_posn = 56;
+}
+
+static uint32_t CRYPT_DC_GetNextKey(CRYPT_SETUP* pc) {    
+  uint32_t re;
+  if (pc->pc_posn == 56) {
+    CRYPT_DC_MixKeys(pc);
+    pc->pc_posn = 1;
+  }
+  re = pc->keys[pc->pc_posn];
+  pc->pc_posn++;
+  return re;
+}
+
+/*
+ * Function: CRYPT_DC_XorKeys
+ * --------------------
+ * xors words with a run of keys, whole vectors at a
+ * time where the CPU has them
+ *
+ *  dst: output, may be src
+ *  src: input, any alignment
+ *  keys: keys for the words
+ *  n: nr of words
+ *
+ *  returns: void
+ *
+ */
+static void CRYPT_DC_XorKeys(char* dst, const char* src, const uint32_t* keys, uint32_t n) {
+  uint32_t i = 0, tmp;
+
+#ifdef CHUCHU_AVX2
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_si256((__m256i *)&dst[i * 4],
+			_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&src[i * 4]),
+					 _mm256_loadu_si256((const __m256i *)&keys[i])));
+#endif
+#ifdef CHUCHU_SSE2
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_si128((__m128i *)&dst[i * 4],
+		     _mm_xor_si128(_mm_loadu_si128((const __m128i *)&src[i * 4]),
+				   _mm_loadu_si128((const __m128i *)&keys[i])));
+#endif
+  for (; i < n; i++) {
+    memcpy(&tmp, &src[i * 4], 4);
+    tmp = LE32(tmp) ^ keys[i];
+    tmp = LE32(tmp);
+    memcpy(&dst[i * 4], &tmp, 4);
+  }
+}
+
+/*
+ * Function: CRYPT_DC_CryptWords
+ * --------------------
+ * encrypts whole words, keys 1..55 are one block of
+ * the keystream so each MixKeys pass covers 55 words
+ *
+ *  pc: pointer to cipher
+ *  dst: output, may be src
+ *  src: input, any alignment
+ *  words: nr of 4 byte words
+ *
+ *  returns: void
+ *
+ */
+static void CRYPT_DC_CryptWords(CRYPT_SETUP* pc, char* dst, const char* src, unsigned long words) {
+  uint32_t n;
+
+  while (words > 0) {
+    if (pc->pc_posn == 56) {
+      CRYPT_DC_MixKeys(pc);
+      pc->pc_posn = 1;
+    }
+    n = 56 - pc->pc_posn;
+    if (n > words)
+      n = (uint32_t)words;
+    CRYPT_DC_XorKeys(dst, src, &pc->keys[pc->pc_posn], n);
+    pc->pc_posn += n;
+    dst += n * 4;
+    src += n * 4;
+    words -= n;
+  }
+}
+
+//A last partial word uses up a key, bytes past size are left alone
+void CRYPT_DC_CryptData(CRYPT_SETUP* pc,void* data,unsigned long size) {
+  char *p = (char *)data;
+  unsigned long x = size & ~3UL;
+  uint32_t tmp = 0;
+
+  CRYPT_DC_CryptWords(pc, p, p, x / 4);
+  if (x < size) {
+    memcpy(&tmp, &p[x], size - x);
     tmp = LE32(tmp) ^ CRYPT_DC_GetNextKey(pc);
-    *((uint32_t *)(data + x)) = LE32(tmp);
+    tmp = LE32(tmp);
+    memcpy(&p[x], &tmp, size - x);
   }
 }
@@ -2,6 +2,8 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <time.h>
+#include "chuchu_timer.h"
 
 #if defined(__BIG_ENDIAN__) || defined(WORDS_BIGENDIAN)
 #define LE16(x) (((x >> 8) & 0xFF) | ((x & 0xFF) << 8))
@@ -18,19 +20,74 @@
 #define MAX_PASSWD_LEN 17
 #define MAX_PKT_SIZE 4096
 
+#define CHUCHU_CACHE_LINE 64
+
+//The DC cipher only ever uses keys 0..56
+#define CRYPT_DC_KEYS 57
+
 typedef struct {
-  uint32_t keys[1042];
   uint32_t pc_posn;
-} CRYPT_SETUP;
+  uint32_t keys[CRYPT_DC_KEYS];
+} __attribute__((aligned(CHUCHU_CACHE_LINE))) CRYPT_SETUP;
+
+//Receive buffer, frames are decrypted and handed out in place
+typedef struct {
+  uint32_t head;
+  uint32_t dec;
+  uint32_t tail;
+  char buf[MAX_PKT_SIZE];
+} chuchu_stream_t;
+
+//Outbound queue, holds msgs that are already encrypted
+#define CHUCHU_TX_SEG_SIZE 1000
+#define CHUCHU_TX_HIGH_WATER (64 * 1024)
+
+typedef struct chuchu_tx_seg {
+  struct chuchu_tx_seg *next;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t size;
+  char data[];
+} chuchu_tx_seg_t;
+
+typedef struct {
+  chuchu_tx_seg_t *first;
+  chuchu_tx_seg_t *last;
+  uint32_t bytes;
+  int closing;
+  int armed;
+  pthread_mutex_t mutex;
+} chuchu_txq_t;
 
 typedef struct {
   char p_name[MAX_UNAME_LEN];
   char u_name[MAX_UNAME_LEN];
   uint32_t id;
   uint16_t dl;
+  uint8_t dl_dirty;
 } puzzle_t;
 
+//Objects per slab of the player and room pools
+#define CHUCHU_POOL_SLAB 16
+
+//Fixed-size objects carved from slabs that are never given back
 typedef struct {
+  pthread_mutex_t lock;
+  const char *name;
+  size_t size;
+  int per_slab;
+  int max;
+  void *free_l;
+  int slabs;
+  int in_use;
+  int high_water;
+  uint64_t failures;
+} chuchu_pool_t;
+
+//Menu lists of the player registry, one per MENU_ITEM_ID and one for the rest
+#define CHUCHU_MENU_LISTS 7
+
+typedef struct chuchu_player {
   int sock;
   uint32_t won_rnds, lost_rnds, total_rnds;
   uint32_t db_won_rnds, db_lost_rnds, db_total_rnds;
@@ -50,9 +107,46 @@ typedef struct {
   CRYPT_SETUP client_cipher;
   CRYPT_SETUP server_cipher;
   void *data;
+
+  //Connection state
+  chuchu_stream_t rx;
+  struct chuchu_db_job *db_job;
+  int rx_paused;
+  int nonblock;
+  //Closed by the event loop, stale events are skipped
+  int closed;
+  int refs;
+  time_t last_active;
+  chuchu_timer_t idle;
+  chuchu_txq_t tx;
+
+  //Seat taken in a game room, see join_game_room
+  struct game_room *room;
+  int seat;
+
+  //Registry, see add_chuchu_player
+  int slot;
+  int menu_list;
+  struct chuchu_player *menu_prev;
+  struct chuchu_player *menu_next;
 } player_t;
 
-typedef struct {
+//Mostly the receive buffer, 10k idle connections take ~50 MB
+#define CHUCHU_PLAYER_MAX_SIZE (5 * 1024)
+_Static_assert(sizeof(player_t) <= CHUCHU_PLAYER_MAX_SIZE, "player_t is larger than CHUCHU_PLAYER_MAX_SIZE");
+
+/*
+ * Game rooms stay in their g_l slot for life, the item id is the
+ * slot plus the generation of the slot so a stale id from an old
+ * menu never matches the room that reused the slot
+ */
+#define CHUCHU_ROOM_ITEM_BASE 0x2000
+#define CHUCHU_MAX_ROOMS (0x10000 - CHUCHU_ROOM_ITEM_BASE)
+#define CHUCHU_ROOM_ITEM(slot, gen) ((uint32_t)(CHUCHU_ROOM_ITEM_BASE + (slot)) | ((uint32_t)(gen) << 16))
+#define CHUCHU_ROOM_SLOT(item_id) ((int)((item_id) & 0xffff) - CHUCHU_ROOM_ITEM_BASE)
+#define CHUCHU_MAX_PLAYER_SLOTS 4
+
+typedef struct game_room {
   char g_name[MAX_UNAME_LEN];
   char g_passwd[MAX_PASSWD_LEN];
   char creator[MAX_UNAME_LEN];
@@ -65,7 +159,10 @@ typedef struct {
   int passwd_protected;
   int static_room;
   uint32_t duration;
-  player_t **player_slots;
+  player_t *player_slots[CHUCHU_MAX_PLAYER_SLOTS];
+  pthread_mutex_t mutex;
+  //User rooms only, see expire_game_room
+  chuchu_timer_t expire;
 } game_room_t;
 
 typedef struct {
@@ -79,12 +176,79 @@ typedef struct {
   char chu_db_path[256];
   char chu_info_path[256];
   char deedee_server;
-  pthread_mutex_t mutex;
+  int threaded;
+  int epoll_fd;
+  int timer_fd;
+  int db_synchronous;
+  int db_checkpoint_interval;
 
-  //Data
+  /*
+   * Locks, always taken in this order and released in reverse:
+   *  1. players_lock: p_l and the players in it, read for
+   *     handling msgs, write to add/remove a player
+   *  2. rooms_lock: g_l, a game room ptr is only valid while
+   *     it is held, write to create/remove rooms
+   *  3. game_room_t mutex: taken_seats and player_slots of one
+   *     room, never hold two rooms at the same time
+   *  4. reg_lock: the player registry indexes, menu lists and
+   *     menu_id of the authorized players
+   *  5. puzz_lock: the puzzle catalog and download counters
+   *  6. db_mutex: DB worker queue, never held while taking another
+   * Debug builds assert the order, see lock_players
+   */
+  pthread_rwlock_t players_lock;
+  pthread_rwlock_t rooms_lock;
+  pthread_mutex_t reg_lock;
+  pthread_mutex_t puzz_lock;
+
+  //DB worker queue, see post_chuchu_db_job
+  struct chuchu_db_job *db_first;
+  struct chuchu_db_job *db_last;
+  struct chuchu_db_job *db_done;
+  int db_flush;
+  int db_due;
+  int db_event_fd;
+  pthread_mutex_t db_mutex;
+  pthread_cond_t db_cond;
+  pthread_cond_t db_done_cond;
+
+  //DB maintenance counters, written by its thread only
+  uint64_t db_checkpoints;
+  uint64_t db_checkpoint_usec;
+  uint64_t db_checkpoint_max_usec;
+  uint64_t db_wal_bytes;
+  uint64_t db_vacuumed_pages;
+
+  //Outbound queue counters
+  uint64_t tx_queued_bytes;
+  uint64_t tx_dropped_msgs;
+  uint64_t tx_slow_clients;
+
+  //Slab pools, see alloc_chuchu_pool
+  chuchu_pool_t player_pool;
+  chuchu_pool_t room_pool;
+
+  //Puzzle catalog, see add_chuchu_puzzle
   puzzle_t **puzz_l;
+  int puzz_count;
+  int puzz_size;
+  uint32_t *puzz_id_hash;
+  uint32_t *puzz_name_hash;
+  uint32_t puzz_hash_mask;
+  uint32_t puzz_gen;
+  uint32_t puzz_dl_gen;
+
+  //Player registry, see add_chuchu_player
+  player_t **pl_id_hash;
+  player_t **pl_dc_hash;
+  player_t **pl_name_hash;
+  uint32_t pl_hash_mask;
+  player_t *menu_l[CHUCHU_MENU_LISTS];
+
+  //Data
   player_t **p_l;
   game_room_t **g_l;
+  uint16_t *g_gen;
 } server_data_t;
 
 typedef enum {
@@ -105,6 +269,13 @@ typedef enum {
   PLAYER_STAT_MSG = 0x1b,
 } MSG_ID;
   
+//Broadcast recipients
+typedef enum {
+  BCAST_AUTHORIZED = 0x00,
+  BCAST_ROOM_MENU = 0x01,
+  BCAST_GAME_ROOM = 0x02,
+} BCAST_SET;
+
 typedef enum {
   SERVER_MENU = 0x00000000,
   ROOM_MENU = 0x00000001,
@@ -172,6 +343,7 @@ int get_chuchu_config(server_data_t *s, char *fn);
 //Handler
 void *chuchu_client_handler(void *);
 void init_chuchu_crypt(player_t* pl);
+int init_chuchu_crypt_table(const char *path);
   
 //Crypt
 void CRYPT_DC_MixKeys(CRYPT_SETUP* pc);
@@ -179,7 +351,54 @@ void CRYPT_DC_CreateKeys(CRYPT_SETUP* pc, uint32_t val);
 void CRYPT_DC_CryptData(CRYPT_SETUP* pc,void* data,unsigned long size);
 void crypt_chuchu_msg(CRYPT_SETUP *sp, char *msg, unsigned long msg_size);
 void decrypt_chuchu_msg(CRYPT_SETUP *cp, char *msg, unsigned long msg_size);
-void send_chuchu_crypt_msg(int sock, CRYPT_SETUP *sp, char* msg, int msg_size);
+void send_chuchu_crypt_msg(player_t *pl, char* msg, int msg_size);
+void init_chuchu_tx(player_t *pl);
+void free_chuchu_tx(player_t *pl);
+int pending_chuchu_tx(player_t *pl);
+void close_chuchu_tx(player_t *pl);
+void put_chuchu_player(player_t *pl);
+int init_chuchu_pool(chuchu_pool_t *pool, const char *name, size_t size, int per_slab, int max);
+void *alloc_chuchu_pool(chuchu_pool_t *pool);
+void free_chuchu_pool(chuchu_pool_t *pool, void *p);
+void log_chuchu_pool(chuchu_pool_t *pool);
+int flush_chuchu_msg(player_t *pl);
+void pause_chuchu_rx(player_t *pl, int pause);
+void send_chuchu_bcast(server_data_t *s, BCAST_SET set, game_room_t *gr, char* msg, int msg_size);
+void flush_chuchu_bcast(void);
+void queue_chuchu_crypt_msg(player_t *pl, char* msg, int msg_size);
+
+//Locks
+int init_chuchu_locks(server_data_t *s);
+void lock_players(server_data_t *s, int write);
+void unlock_players(server_data_t *s);
+void lock_rooms(server_data_t *s, int write);
+void unlock_rooms(server_data_t *s);
+void lock_room(game_room_t *gr);
+void unlock_room(game_room_t *gr);
+void lock_registry(server_data_t *s);
+void unlock_registry(server_data_t *s);
+void lock_puzzles(server_data_t *s);
+void unlock_puzzles(server_data_t *s);
+
+//Puzzle catalog
+int init_chuchu_puzzles(server_data_t *s);
+int add_chuchu_puzzle(server_data_t *s, puzzle_t *puz);
+puzzle_t *get_chuchu_puzzle(server_data_t *s, uint32_t id);
+puzzle_t *find_chuchu_puzzle(server_data_t *s, const char *p_name);
+
+//Player registry
+int init_chuchu_registry(server_data_t *s);
+int add_chuchu_player(server_data_t *s, player_t *pl);
+void remove_chuchu_player(server_data_t *s, player_t *pl);
+void authorize_chuchu_player(server_data_t *s, player_t *pl);
+void set_chuchu_player_menu(player_t *pl, uint32_t menu_id);
+void set_chuchu_player_name(player_t *pl, const char *username, const char *dreamcast_id);
+player_t *get_chuchu_player(server_data_t *s, uint32_t client_id);
+player_t *find_chuchu_player(server_data_t *s, const char *dreamcast_id, player_t *except);
+player_t *find_chuchu_player_by_name(server_data_t *s, const char *username, player_t *except);
+
+//Game rooms
+game_room_t* get_room_from_item_id(server_data_t *s, uint32_t item_id);
 
 //Help
 #define strlcpy my_strlcpy
@@ -190,8 +409,13 @@ int uint32_to_char(uint32_t data, char* msg);
 int uint16_to_char(uint16_t data, char* msg);
 void print_chuchu_data(void* ds,unsigned long data_size);
 void create_chuchu_hdr(char* msg, uint8_t msg_id, uint8_t msg_flag, uint16_t msg_size);
-void send_chuchu_msg(int sock, char* msg, int msg_size);
-uint16_t parse_chuchu_msg(char* buf, int buf_len);
+void send_chuchu_msg(player_t *pl, char* msg, int msg_size);
+
+//Stream
+void init_chuchu_stream(chuchu_stream_t *st);
+ssize_t recv_chuchu_stream(int sock, chuchu_stream_t *st);
+int write_chuchu_stream(chuchu_stream_t *st, const char *data, size_t size);
+int next_chuchu_msg(chuchu_stream_t *st, CRYPT_SETUP *cp, char **frame);
 
 #ifdef DCNET
 //Discord
@@ -20,10 +20,17 @@
  * ChuChu Lobby Server for Dreamcast
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>    
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <arpa/inet.h> 
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <signal.h>
 #ifdef DCNET
 #include <dcserver/status.h>
 #endif
@@ -31,18 +38,23 @@
 #include "chuchu_sql.h"
 #include "chuchu_msg.h"
 
+#define CHUCHU_MAX_EVENTS 64
+//Idle players are disconnected after 30 min
+#define CHUCHU_IDLE_TIMEOUT 1800
+//Threaded mode, retry interval for queued output
+#define CHUCHU_TX_RETRY_MS 100
+//Empty user created rooms are removed 24 h after they were created
+#define CHUCHU_ROOM_TTL (24 * 3600)
+//Rooms still in use at that time are looked at again after 10 min
+#define CHUCHU_ROOM_RECHECK 600
+//Pool counters are logged every hour
+#define CHUCHU_STATS_INTERVAL 3600
+
 uint16_t create_chuchu_game_menu(char* msg, game_room_t *gr);
 uint16_t create_chuchu_room_menu(server_data_t* s, char* msg);
+uint16_t create_chuchu_menu_msg(player_t *pl, uint32_t menu_id, uint32_t item_id, char* msg);
 void send_txt_to_all(server_data_t *s, char* username, int txt_flag);
 
-static void lock_server(server_data_t *server) {
-  pthread_mutex_lock(&server->mutex);
-}
-
-static void unlock_server(server_data_t *server) {
-  pthread_mutex_unlock(&server->mutex);
-}
-
 /*
  * Function: init_game_rooms
  * --------------------
@@ -63,44 +75,52 @@ void init_game_rooms(server_data_t *s) {
   int nrooms = s->deedee_server ? 2 : 5;
   for (int i = 0; i < nrooms; i++) {
     if (s->g_l[i] == NULL) { 
-      game_room_t *gr = (game_room_t *)malloc(sizeof(game_room_t));
+      game_room_t *gr = (game_room_t *)alloc_chuchu_pool(&s->room_pool);
+      if (gr == NULL)
+	return;
       strlcpy(gr->g_name, r_menu[i], sizeof(gr->g_name));
       gr->l_icon = TEAM_ICON;
       gr->r_icon = (uint8_t)r_icons[i];
       gr->menu_id = (uint32_t)GAME_MENU;
-      gr->item_id = (uint32_t)(0x2000 + i);
+      gr->item_id = CHUCHU_ROOM_ITEM(i, s->g_gen[i]);
       gr->taken_seats = 0;
       gr->passwd_protected = 0;
       gr->static_room = 1;
       strlcpy(gr->creator, "Admin", MAX_UNAME_LEN);
       gr->duration = 0;
       gr->m_pl_slots = max_player_slots;
-      gr->player_slots = calloc((size_t)max_player_slots, sizeof(player_t *));
+      memset(gr->player_slots, 0, sizeof(gr->player_slots));
+      pthread_mutex_init(&gr->mutex, NULL);
+      init_chuchu_timer(&gr->expire, NULL, NULL);
       s->g_l[i] = gr;
     }
   }
 }
 
 /*
- * Function: get_room_from_item_id
+ * Function: remove_room_seat
  * --------------------
  *
- * Returns game room from item id
+ * Frees a seat and moves the players after it up one
+ * seat, so the seats stay in join order. Game room locked.
  * 
- *  *s: ptr to server data struct
- *  item_id: id of pressed game room
+ *  *gr: ptr to game room struct
+ *  seat: index in player_slots
  *
- *  returns: ptr to game room
+ *  returns: void
  *
  */
-game_room_t* get_room_from_item_id(server_data_t *s, uint32_t item_id) {
+static void remove_room_seat(game_room_t *gr, int seat) {
   int i;
-  for(i=0;i<s->m_rooms;i++)
-    if(s->g_l[i])
-      if (s->g_l[i]->item_id == item_id)
-	return s->g_l[i];
-  
-  return NULL;
+
+  __atomic_store_n(&gr->player_slots[seat]->room, NULL, __ATOMIC_RELAXED);
+  gr->taken_seats--;
+  for (i=seat+1;i<gr->m_pl_slots;i++) {
+    gr->player_slots[i-1] = gr->player_slots[i];
+    if (gr->player_slots[i-1])
+      gr->player_slots[i-1]->seat = i-1;
+  }
+  gr->player_slots[gr->m_pl_slots-1] = NULL;
 }
 
 /*
@@ -109,7 +129,7 @@ game_room_t* get_room_from_item_id(server_data_t *s, uint32_t item_id) {
  *
  * When a user enters a game room, this function looks
  * if the joining user has timed out and have a ptr
- * in the game room list.
+ * in the game room list. Game room locked.
  * 
  *  *gr: ptr to game room struct
  *  *pl: ptr to player struct
@@ -118,36 +138,19 @@ game_room_t* get_room_from_item_id(server_data_t *s, uint32_t item_id) {
  *
  */
 void validate_game_room(game_room_t *gr, player_t *pl) {
-  int i;
-  int max_player_slots = gr->m_pl_slots;
-  int found = 0;
+  int i = 0;
   
-  for (i=0;i<max_player_slots;i++) {
-    if (gr->player_slots[i] != NULL) {
-      if (gr->player_slots[i]->username[0] == '\0') {
-	chuchu_info(LOBBY_SERVER,"Found a ghost...remove");
-	gr->taken_seats--;
-	gr->player_slots[i] = NULL;
-	found = 1;
-      } else if (memcmp(pl->dreamcast_id, gr->player_slots[i]->dreamcast_id, 6) == 0) {
-	chuchu_info(LOBBY_SERVER,"Found a duplicate...remove");
-	gr->taken_seats--;
-	gr->player_slots[i] = NULL;
-	found = 1;
-      }
-    }
-  }
-  
-  if (found) {
-    //Rearrange after validation
-    for (i=1;i<max_player_slots;i++) {
-      if (gr->player_slots[i-1] == NULL) {
-	gr->player_slots[i-1] = gr->player_slots[i];
-	gr->player_slots[i] = NULL;
-      }
+  while (i < gr->m_pl_slots && gr->player_slots[i] != NULL) {
+    if (gr->player_slots[i]->username[0] == '\0') {
+      chuchu_info(LOBBY_SERVER,"Found a ghost...remove");
+      remove_room_seat(gr, i);
+    } else if (memcmp(pl->dreamcast_id, gr->player_slots[i]->dreamcast_id, 6) == 0) {
+      chuchu_info(LOBBY_SERVER,"Found a duplicate...remove");
+      remove_room_seat(gr, i);
+    } else {
+      i++;
     }
   }
-  return;
 }
 
 
@@ -156,7 +159,7 @@ void validate_game_room(game_room_t *gr, player_t *pl) {
  * --------------------
  *
  * When a user leaves a game room or disconnects, this function
- * removes the user from the game rooms.
+ * removes the user from the game room it has a seat in.
  * 
  *  *pl: ptr to player struct
  *  menu_id: id of the menu
@@ -167,40 +170,28 @@ void validate_game_room(game_room_t *gr, player_t *pl) {
  */
 void leave_game_room(player_t *pl, uint32_t menu_id, uint32_t item_id) {
   char msg[MAX_PKT_SIZE];
-  int i=0,j=0,k=0;
-  game_room_t *gr = NULL;
+  game_room_t *gr;
   server_data_t *s = (server_data_t *)pl->data;
-  int max_rooms = s->m_rooms;
-  int max_player_slots = s->m_pl_slots;
 
-  for(i=0;i<max_rooms;i++) {
-    if (s->g_l[i] != NULL) {
-      //Just to be safe
-      for (j=0;j<max_player_slots;j++) {
-	if(s->g_l[i]->player_slots[j] != NULL) { 
-	  if(s->g_l[i]->player_slots[j]->client_id == pl->client_id) {
-	    s->g_l[i]->taken_seats--;
-	    //Leaving user is set to NULL
-	    chuchu_info(LOBBY_SERVER,"User %s left room %s", s->g_l[i]->player_slots[j]->username, s->g_l[i]->g_name);
-	    s->g_l[i]->player_slots[j] = NULL;
-	      
-	    //Rearrange array
-	    for (k=1;k<max_player_slots;k++) {
-	      if (s->g_l[i]->player_slots[k-1] == NULL) {
-		s->g_l[i]->player_slots[k-1] = s->g_l[i]->player_slots[k];
-		s->g_l[i]->player_slots[k] = NULL;
-	      }
-	    }
-	    gr = s->g_l[i];
-	    //Need to notify the game room users
-	    memset(msg,0,sizeof(msg));
-	    create_chuchu_game_menu(msg, gr);
-	    return;
-	  }
-	}
-      }
-    }
+  //The room can't be removed while the rooms lock is held
+  lock_rooms(s, 0);
+  gr = __atomic_load_n(&pl->room, __ATOMIC_RELAXED);
+  if (gr == NULL) {
+    unlock_rooms(s);
+    return;
   }
+  lock_room(gr);
+  //The seat may have been taken away meanwhile, see validate_game_room
+  //and create_chuchu_start_game_msg
+  if (__atomic_load_n(&pl->room, __ATOMIC_RELAXED) == gr && gr->player_slots[pl->seat] == pl) {
+    chuchu_info(LOBBY_SERVER,"User %s left room %s", pl->username, gr->g_name);
+    remove_room_seat(gr, pl->seat);
+    //Need to notify the game room users
+    memset(msg,0,sizeof(msg));
+    create_chuchu_game_menu(msg, gr);
+  }
+  unlock_room(gr);
+  unlock_rooms(s);
 }
 
 /*
@@ -208,7 +199,7 @@ void leave_game_room(player_t *pl, uint32_t menu_id, uint32_t item_id) {
  * --------------------
  *
  * When a user joins  a game room, this function
- * adds the user to the game rooms.
+ * adds the user to the game rooms. Game room locked.
  * 
  *  *pl: ptr to player struct
  *  *gr: ptr to game room struct
@@ -218,17 +209,20 @@ void leave_game_room(player_t *pl, uint32_t menu_id, uint32_t item_id) {
  */
 void join_game_room(player_t *pl, game_room_t *gr) {
   int i;
+#ifdef DCNET
   server_data_t *s = pl->data;
-  int max_clients = s->m_cli;
+#endif
   
   //Sanity check....probably not needed anymore
   validate_game_room(gr, pl);
   
-  for (i=0;i<max_clients;i++) {
+  for (i=0;i<gr->m_pl_slots;i++) {
     if(!gr->player_slots[i]) {
       chuchu_info(LOBBY_SERVER,"User %s joined room %s", pl->username, gr->g_name); 
       gr->player_slots[i] = pl;
       gr->taken_seats++;
+      pl->seat = i;
+      __atomic_store_n(&pl->room, gr, __ATOMIC_RELAXED);
 #ifdef DCNET
       discordRoomJoined(s, pl->username, gr->g_name);
 #endif
@@ -239,48 +233,44 @@ void join_game_room(player_t *pl, game_room_t *gr) {
 
 
 /*
- * Function: check_after_old_game_rooms
+ * Function: expire_game_room
  * --------------------
- * Checks after user created game rooms, is triggered
- * when somebody tries to create a new game room, will
- * remove the game room if it is older then 5h. This is
- * so the server is not filled up with game rooms.
+ * Timer callback of a user created game room, removes
+ * it CHUCHU_ROOM_TTL after it was created if nobody
+ * is in it, so the server is not filled up with game
+ * rooms. Runs on the lobby loop without locks held.
  * 
- *  *s: ptr to server data struct
+ *  *t: expire timer of the game room
  *
  *  returns: void
  *
  */
-void check_after_old_game_rooms(server_data_t *s) {
-  int i=0,j=0;
-  uint32_t now=0,duration=0;
-  time_t seconds=0;
-  game_room_t *gr;
-  int max_rooms = s->m_rooms;
-  seconds = time(NULL);
-  now = (uint32_t)(seconds/3600);
-  
-  for(i=0;i<max_rooms;i++) {
-    if (s->g_l[i] != NULL) {
-      if (s->g_l[i]->static_room == 0) {
-	duration = (s->g_l[i]->duration)/3600;
-	//If game room is empty and created more then 24 h ago, remove
-	if (s->g_l[i]->taken_seats == 0 && (now - duration) >= 24) {
-	  chuchu_info(LOBBY_SERVER,"Game room %s, been active %d h...remove",s->g_l[i]->g_name, (now - duration));
-	  gr = s->g_l[i];
-	  free(gr);
-	  s->g_l[i] = NULL;
-	}
-      }
-    }
-  }  
-  //Rearrange array
-  for (j=1;j<max_rooms;j++) {
-    if (s->g_l[j-1] == NULL) {
-      s->g_l[j-1] = s->g_l[j];
-      s->g_l[j] = NULL;
-    }
+static void expire_game_room(chuchu_timer_t *t) {
+  game_room_t *gr = chuchu_timer_entry(t, game_room_t, expire);
+  server_data_t *s = (server_data_t *)t->data;
+  char msg[MAX_PKT_SIZE];
+  int i = CHUCHU_ROOM_SLOT(gr->item_id);
+
+  lock_players(s, 0);
+  lock_rooms(s, 1);
+  if (gr->taken_seats != 0) {
+    add_chuchu_timer(&gr->expire, CHUCHU_ROOM_RECHECK * 1000);
+    unlock_rooms(s);
+    unlock_players(s);
+    return;
   }
+  chuchu_info(LOBBY_SERVER,"Game room %s, been active %d h...remove", gr->g_name, (int)((time(NULL) - gr->duration) / 3600));
+  s->g_l[i] = NULL;
+  //Ids handed out for this room are stale from now on
+  s->g_gen[i]++;
+  pthread_mutex_destroy(&gr->mutex);
+  free_chuchu_pool(&s->room_pool, gr);
+  unlock_rooms(s);
+
+  //Rebuild room menu
+  memset(msg,0,sizeof(msg));
+  create_chuchu_room_menu(s, msg);
+  unlock_players(s);
 }
 
 /*
@@ -310,9 +300,10 @@ int create_game_room(server_data_t *s, const char* username, char* buf) {
   strlcpy(room_name, &buf[0xc], sizeof(room_name));
   strlcpy(room_password, &buf[0x1c], sizeof(room_password));
   
-  check_after_old_game_rooms(s);
+  lock_rooms(s, 1);
   
   if (room_name[0] == '\0' || strlen(room_name) == 0) {
+    unlock_rooms(s);
     chuchu_error(LOBBY_SERVER, "Player did not enter a game room name [SKIP]");
     return 0;
   }
@@ -323,7 +314,9 @@ int create_game_room(server_data_t *s, const char* username, char* buf) {
   
   for(i=0;i<max_rooms;i++) {
     if (s->g_l[i] == NULL) {
-      game_room_t *gr = (game_room_t *)malloc(sizeof(game_room_t));
+      game_room_t *gr = (game_room_t *)alloc_chuchu_pool(&s->room_pool);
+      if (gr == NULL)
+	break;
       strlcpy(gr->g_name, room_name, sizeof(gr->g_name));
       
       if (passwd_protected) {
@@ -336,14 +329,18 @@ int create_game_room(server_data_t *s, const char* username, char* buf) {
       gr->l_icon = TEAM_ICON;
       gr->r_icon = MICE_ICON;
       gr->menu_id = (uint32_t)GAME_MENU;
-      gr->item_id = (uint32_t)(0x2000 + i);
+      gr->item_id = CHUCHU_ROOM_ITEM(i, s->g_gen[i]);
       gr->taken_seats = 0;
       gr->passwd_protected = passwd_protected;
       gr->static_room = 0;
       gr->duration = (uint32_t)seconds;
       gr->m_pl_slots = max_player_slots;
-      gr->player_slots = calloc((size_t)max_player_slots, sizeof(player_t *));
+      memset(gr->player_slots, 0, sizeof(gr->player_slots));
+      pthread_mutex_init(&gr->mutex, NULL);
+      init_chuchu_timer(&gr->expire, expire_game_room, s);
+      add_chuchu_timer(&gr->expire, (uint64_t)CHUCHU_ROOM_TTL * 1000);
       s->g_l[i] = gr;
+      unlock_rooms(s);
 
       //Rebuild room menu
       memset(msg,0,sizeof(msg));
@@ -352,9 +349,47 @@ int create_game_room(server_data_t *s, const char* username, char* buf) {
       return 1;
     }
   }
+  unlock_rooms(s);
   return 0;
 }
 
+/*
+ * Function: store_player_ranking
+ * --------------------
+ * 
+ * Function that posts the rounds a player played
+ * in this session to the DB worker, nothing waits
+ * for the result
+ *
+ *  *pl: ptr to player struct
+ *
+ *  returns: 1 => OK
+ *           0 => FAILED
+ *
+ */
+static int store_player_ranking(player_t *pl) {
+  chuchu_db_job_t *job = new_chuchu_db_job(NULL, DB_UPDATE_RANKING, NULL);
+
+  if (job == NULL)
+    return 0;
+  strlcpy(job->username, pl->username, sizeof(job->username));
+  memcpy(job->dreamcast_id, pl->dreamcast_id, 6);
+  /*
+   Important, chuchu sends a updated stat packet after each game, so
+   we need to keep the orig. values and new apart. Only the new ones
+   are sent, the worker adds them to the DB so two sessions of the
+   same player can't overwrite each other
+  */
+  job->won_rnds = pl->won_rnds;
+  job->lost_rnds = pl->lost_rnds;
+  job->total_rnds = pl->total_rnds;
+  //The worker drops the cached top ranking if this update may change it
+  job->ranked_won = pl->db_won_rnds + pl->won_rnds;
+  chuchu_info(LOBBY_SERVER,"[%s] Ranking before [%d][%d][%d]",pl->username,pl->db_won_rnds,pl->db_lost_rnds,pl->db_total_rnds);
+  post_chuchu_db_job((server_data_t *)pl->data, job);
+  return 1;
+}
+
 /*
  * Function: if_session_exists
  * --------------------
@@ -370,32 +405,24 @@ int create_game_room(server_data_t *s, const char* username, char* buf) {
  *
  */
 void if_session_exists(server_data_t *s, player_t *pl) {
-  int i=0;
-  int max_clients = s->m_cli;
-
-  for(i=0;i<max_clients;i++) {
-    if (s->p_l[i] != NULL && s->p_l[i] != pl) {
-      if (s->p_l[i]->authorized == 1) {
-	if(memcmp(pl->dreamcast_id, s->p_l[i]->dreamcast_id, 6) == 0) {
-	  chuchu_info(LOBBY_SERVER,"Found a old session for %s", pl->username);
-	  //Set so the old sessions doesn't store in the DB
-	  s->p_l[i]->store_ranking = 0;
-	  //Copy ranking values to DB before reading the old
-	  if ((s->p_l[i]->won_rnds != 0) || (s->p_l[i]->lost_rnds != 0)) {
-	    pl->won_rnds = s->p_l[i]->won_rnds;
-	    pl->lost_rnds = s->p_l[i]->lost_rnds;
-	    pl->total_rnds = s->p_l[i]->total_rnds;
-	    if (!update_player_ranking_to_chuchu_db(s->chu_db_path, pl)) {
-	      chuchu_error(LOBBY_SERVER,"Could not update player %s stats", pl->username);
-	    }
-	    pl->won_rnds = 0;
-	    pl->lost_rnds = 0;
-	    pl->total_rnds = 0;
-	  }
-	  return;
-	}
-      }
+  player_t *old = find_chuchu_player(s, pl->dreamcast_id, pl);
+
+  if (old == NULL)
+    return;
+  chuchu_info(LOBBY_SERVER,"Found a old session for %s", pl->username);
+  //Set so the old sessions doesn't store in the DB
+  old->store_ranking = 0;
+  //Copy ranking values to DB before reading the old
+  if ((old->won_rnds != 0) || (old->lost_rnds != 0)) {
+    pl->won_rnds = old->won_rnds;
+    pl->lost_rnds = old->lost_rnds;
+    pl->total_rnds = old->total_rnds;
+    if (!store_player_ranking(pl)) {
+      chuchu_error(LOBBY_SERVER,"Could not update player %s stats", pl->username);
     }
+    pl->won_rnds = 0;
+    pl->lost_rnds = 0;
+    pl->total_rnds = 0;
   }
 }
 
@@ -403,7 +430,8 @@ void if_session_exists(server_data_t *s, player_t *pl) {
  * Function: add_player
  * --------------------
  * 
- * Function to add player to the server struct 
+ * Function to add player to the server struct,
+ * players lock held for writing
  *
  *  *s: ptr to server data struct
  *  *pl: ptr to player struct
@@ -413,9 +441,6 @@ void if_session_exists(server_data_t *s, player_t *pl) {
  *
  */
 int add_player(server_data_t *s, player_t *pl) {
-  int i;
-  int max_clients = s->m_cli;
-
   //Init values
   memset(pl->username, 0, MAX_UNAME_LEN);
   memset(pl->dreamcast_id, 0, 6);
@@ -431,13 +456,12 @@ int add_player(server_data_t *s, player_t *pl) {
   pl->store_ranking = 1;
   pl->authorized = 0;
   pl->created_game_room = 0;
+  pl->room = NULL;
+  pl->seat = 0;
 
-  for(i=0;i<max_clients;i++) {
-    if(!(s->p_l[i])) {
-      s->p_l[i] = pl;
-      chuchu_info(LOBBY_SERVER,"Added client: 0x%02x", pl->client_id);
-      return 1;
-    }
+  if (add_chuchu_player(s, pl)) {
+    chuchu_info(LOBBY_SERVER,"Added client: 0x%02x", pl->client_id);
+    return 1;
   }
   chuchu_info(LOBBY_SERVER,"Could not add client: 0x%02x", pl->client_id);
   return 0;
@@ -458,36 +482,30 @@ int add_player(server_data_t *s, player_t *pl) {
  */
 void delete_player(player_t *pl){
   server_data_t *s = pl->data;
-  lock_server(s);
-  int max_clients = s->m_cli;
+  lock_players(s, 1);
   char u_name[MAX_UNAME_LEN];
-  int i=0;
 
   if ((pl->authorized == 1) && (pl->store_ranking == 1)) {
     if ((pl->won_rnds != 0) || (pl->lost_rnds != 0)) {
-      if (!update_player_ranking_to_chuchu_db(s->chu_db_path, pl)) {
+      if (!store_player_ranking(pl)) {
 	chuchu_error(LOBBY_SERVER,"Could not update player %s stats", pl->username);
       }
     } 
-    leave_game_room(pl, pl->menu_id, pl->item_id);
     memset(u_name, 0, sizeof(u_name));
     strlcpy(u_name, pl->username, sizeof(u_name));
     send_txt_to_all(s, u_name, LEAVE_SERVER);
   }
+  //Also done for replaced sessions, the slot must not outlive the player
+  if (pl->authorized == 1)
+    leave_game_room(pl, pl->menu_id, pl->item_id);
 #ifdef DCNET
   if (pl->authorized == 1)
       statusLeave(s->deedee_server ? "deedee" : "chuchu", inet_ntoa(pl->addr.sin_addr), ntohs(pl->addr.sin_port), pl->username);
 #endif
 
-  for(i=0;i<max_clients;i++) {
-    if (s->p_l[i] != NULL) {
-      if(s->p_l[i]->client_id == pl->client_id) {
-	chuchu_info(LOBBY_SERVER,"Removed client: 0x%02x", pl->client_id);
-	s->p_l[i] = NULL;
-      }
-    }
-  }
-  unlock_server(s);
+  remove_chuchu_player(s, pl);
+  chuchu_info(LOBBY_SERVER,"Removed client: 0x%02x", pl->client_id);
+  unlock_players(s);
 }
 
 /*
@@ -569,6 +587,8 @@ uint16_t create_chuchu_server_menu(server_data_t* s, char* msg) {
  * 
  * Function to create the room menu display (0x07)
  * Chuchu hdr flag has the nr of menu entries in packet. 
+ * Rooms are locked for writing so the menus are
+ * sent out in the order they were built.
  *
  *  *s:   ptr to server data struct
  *  *msg: ptr to outgoing client msg
@@ -580,13 +600,14 @@ uint16_t create_chuchu_room_menu(server_data_t* s, char* msg) {
   uint16_t pkt_size=4;
   int i=0,entries=0;
   int max_rooms = s->m_rooms;
-  int max_clients = s->m_cli;
+  player_t *pl;
   
   pkt_size = create_chuchu_menu_item(msg, pkt_size, 0x00, ROOM_MENU, DOOR_ICON, EMPTY_ICON, "Game Rooms");
   pkt_size = create_chuchu_menu_item(msg, pkt_size, 0xee, SERVER_MENU, EXIT_ICON, EMPTY_ICON, "Exit");
   pkt_size = create_chuchu_menu_item(msg, pkt_size, 0xcc, ROOM_MENU, CREATE_TEAM_ICON, EMPTY_ICON, "Create Game Room");
   entries += 2;
 
+  lock_rooms(s, 1);
   //Add all rooms
   for(i=0;i<max_rooms;i++) {
     if (s->g_l[i]) {
@@ -599,25 +620,18 @@ uint16_t create_chuchu_room_menu(server_data_t* s, char* msg) {
   }
   
   //Add all users in the rooms menu
-  for(i=0;i<max_clients;i++) {
-    if(s->p_l[i] && (s->p_l[i]->authorized == 1)) {
-      if (s->p_l[i]->menu_id == ROOM_MENU)
-	{
-	  pkt_size = create_chuchu_menu_item(msg, pkt_size, s->p_l[i]->client_id, ROOM_MENU, GUY_ICON, MICE_ICON, s->p_l[i]->username);
-	  entries++;
-	}
-    }
+  lock_registry(s);
+  for (pl = s->menu_l[ROOM_MENU]; pl; pl = pl->menu_next) {
+    pkt_size = create_chuchu_menu_item(msg, pkt_size, pl->client_id, ROOM_MENU, GUY_ICON, MICE_ICON, pl->username);
+    entries++;
   }
+  unlock_registry(s);
   //Create header
   create_chuchu_hdr(msg, 0x07, (uint8_t)entries, pkt_size);
 
   //Update all other users in the rooms menu
-  for(i=0;i<max_clients; i++) {
-    if(s->p_l[i] && (s->p_l[i]->authorized == 1)) {
-	if (s->p_l[i]->menu_id == ROOM_MENU)
-	  send_chuchu_crypt_msg(s->p_l[i]->sock, &s->p_l[i]->server_cipher, msg, pkt_size);
-      }
-  }
+  send_chuchu_bcast(s, BCAST_ROOM_MENU, NULL, msg, pkt_size);
+  unlock_rooms(s);
   
   return 0;
 }
@@ -648,34 +662,214 @@ uint16_t create_chuchu_puzzle_land_menu(char *msg) {
   return pkt_size;
 }
 
+/*
+ * PUZZLE ZONE PAGES
+ *
+ * The puzzle zone is split in pages of at most m_puzz puzzles, one
+ * 0x07 packet each. All pages of a sort order are built at once and
+ * kept until the catalog changes, the most downloaded order is also
+ * rebuilt after ZONE_DL_TTL seconds if there were downloads.
+ * Pages are guarded by puzz_lock.
+ */
+
+typedef enum {
+  ZONE_NEWEST = 0x00,
+  ZONE_MOST_DOWNLOADED = 0x01,
+  ZONE_BY_CREATOR = 0x02,
+  ZONE_SORT_COUNT,
+} ZONE_SORT;
+
+//Item id of a page in PUZZLE_ZONE_MENU, item 0 is the first newest page
+#define ZONE_ITEM(sort, page) ((uint32_t)((sort) + 1) << 16 | (uint32_t)(page))
+#define ZONE_DL_TTL 60
+//Title, exit, prev, next and the sort items
+#define ZONE_NAV_ITEMS 7
+//An item is 0x1c bytes, room is left for the add info msg
+#define ZONE_MAX_ITEMS ((MAX_PKT_SIZE - 4 - 256) / 0x1c)
+
+typedef struct {
+  int built;
+  uint32_t gen;
+  uint32_t dl_gen;
+  time_t time;
+  int pages;
+  uint16_t *size;
+  uint32_t *off;
+  char *pkt;
+} chuchu_zone_view_t;
+
+static chuchu_zone_view_t zone_views[ZONE_SORT_COUNT];
+
+static int zone_newest(const void *a, const void *b) {
+  const puzzle_t *pa = *(puzzle_t * const *)a, *pb = *(puzzle_t * const *)b;
+
+  return pa->id < pb->id ? 1 : pa->id > pb->id ? -1 : 0;
+}
+
+static int zone_most_downloaded(const void *a, const void *b) {
+  const puzzle_t *pa = *(puzzle_t * const *)a, *pb = *(puzzle_t * const *)b;
+
+  if (pa->dl != pb->dl)
+    return pa->dl < pb->dl ? 1 : -1;
+  return zone_newest(a, b);
+}
+
+static int zone_by_creator(const void *a, const void *b) {
+  const puzzle_t *pa = *(puzzle_t * const *)a, *pb = *(puzzle_t * const *)b;
+  int rc = strcmp(pa->u_name, pb->u_name);
+
+  if (rc == 0)
+    rc = strcmp(pa->p_name, pb->p_name);
+  return rc;
+}
+
+static int (*zone_cmp[ZONE_SORT_COUNT])(const void *, const void *) = {
+  [ZONE_NEWEST] = zone_newest,
+  [ZONE_MOST_DOWNLOADED] = zone_most_downloaded,
+  [ZONE_BY_CREATOR] = zone_by_creator,
+};
+
+/*
+ * Function: build_chuchu_zone_view
+ * --------------------
+ * 
+ * Sorts the catalog and builds all the page packets
+ * of one sort order, puzz_lock must be held
+ *
+ *  *s: ptr to server data struct
+ *  sort: sort order
+ *
+ *  returns: 1 => OK
+ *           0 => FAILED, out of memory
+ *           
+ */
+static int build_chuchu_zone_view(server_data_t *s, ZONE_SORT sort) {
+  chuchu_zone_view_t *v = &zone_views[sort];
+  const char *sort_names[ZONE_SORT_COUNT] = { "Newest", "Most downloaded", "By creator" };
+  puzzle_t **sorted = NULL;
+  char msg[MAX_PKT_SIZE], title[40], *pkt;
+  int per_page, pages, page, i, n, entries;
+  uint32_t off = 0;
+  uint16_t pkt_size;
+
+  per_page = s->m_puzz < ZONE_MAX_ITEMS - ZONE_NAV_ITEMS ? s->m_puzz : ZONE_MAX_ITEMS - ZONE_NAV_ITEMS;
+  pages = s->puzz_count > 0 ? (s->puzz_count + per_page - 1) / per_page : 1;
+  if (s->puzz_count > 0) {
+    sorted = (puzzle_t **)malloc((size_t)s->puzz_count * sizeof(puzzle_t *));
+    if (sorted == NULL)
+      return 0;
+    memcpy(sorted, s->puzz_l, (size_t)s->puzz_count * sizeof(puzzle_t *));
+    qsort(sorted, (size_t)s->puzz_count, sizeof(puzzle_t *), zone_cmp[sort]);
+  }
+  free(v->pkt);
+  free(v->size);
+  free(v->off);
+  v->built = 0;
+  v->pkt = (char *)malloc((size_t)pages * MAX_PKT_SIZE);
+  v->size = (uint16_t *)malloc((size_t)pages * sizeof(uint16_t));
+  v->off = (uint32_t *)malloc((size_t)pages * sizeof(uint32_t));
+  if (v->pkt == NULL || v->size == NULL || v->off == NULL) {
+    free(v->pkt);
+    free(v->size);
+    free(v->off);
+    v->pkt = NULL;
+    v->size = NULL;
+    v->off = NULL;
+    free(sorted);
+    return 0;
+  }
+
+  for (page=0;page<pages;page++) {
+    memset(msg, 0, sizeof(msg));
+    pkt_size = 4;
+    //Item text is at most 17 chars
+    if (pages > 1)
+      snprintf(title, sizeof(title), "Zone page %d/%d", page + 1, pages);
+    else
+      strlcpy(title, "Puzzle zone", sizeof(title));
+    title[MAX_UNAME_LEN] = '\0';
+    pkt_size = create_chuchu_menu_item(msg, pkt_size, ZONE_ITEM(sort, page), PUZZLE_ZONE_MENU, PUZZLE_FLAG_ICON, EMPTY_ICON, title);
+    pkt_size = create_chuchu_menu_item(msg, pkt_size, 0xee, PUZZLE_LAND_MENU, EXIT_ICON, EMPTY_ICON, "Exit");
+    entries = 1;
+    if (page > 0) {
+      pkt_size = create_chuchu_menu_item(msg, pkt_size, ZONE_ITEM(sort, page - 1), PUZZLE_ZONE_MENU, GO_ICON, EMPTY_ICON, "Prev page");
+      entries++;
+    }
+    if (page < pages - 1) {
+      pkt_size = create_chuchu_menu_item(msg, pkt_size, ZONE_ITEM(sort, page + 1), PUZZLE_ZONE_MENU, GO_ICON, EMPTY_ICON, "Next page");
+      entries++;
+    }
+    for (i=0;i<ZONE_SORT_COUNT;i++) {
+      if (i == (int)sort)
+	continue;
+      pkt_size = create_chuchu_menu_item(msg, pkt_size, ZONE_ITEM(i, 0), PUZZLE_ZONE_MENU, MEMO_ICON, EMPTY_ICON, sort_names[i]);
+      entries++;
+    }
+    for (n=page*per_page;n<s->puzz_count && n<(page+1)*per_page;n++) {
+      pkt_size = create_chuchu_menu_item(msg, pkt_size, sorted[n]->id, PUZZLE_ZONE_FILE, PUZZLE_DOWNLOAD_ICON, EMPTY_ICON, sorted[n]->p_name);
+      entries++;
+    }
+    create_chuchu_hdr(msg, 0x07, (uint8_t)entries, pkt_size);
+    memcpy(&v->pkt[off], msg, pkt_size);
+    v->size[page] = pkt_size;
+    v->off[page] = off;
+    off += pkt_size;
+  }
+  free(sorted);
+  //Pages are packed, give back the rest
+  if ((pkt = (char *)realloc(v->pkt, off)) != NULL)
+    v->pkt = pkt;
+
+  v->pages = pages;
+  v->gen = s->puzz_gen;
+  v->dl_gen = s->puzz_dl_gen;
+  v->time = time(NULL);
+  v->built = 1;
+  chuchu_info(LOBBY_SERVER, "Built %d puzzle zone pages sorted by %s", pages, sort_names[sort]);
+  return 1;
+}
+
 /*
  * Function: create_chuchu_puzzle_zone_menu
  * --------------------
  * 
  * Function to create the puzzle zone menu display (0x07)
  * Chuchu hdr flag has the nr of menu entries in packet. 
+ * Copies a cached page, built again if the catalog changed.
  *
+ *  *s: ptr to server data struct
  *  *msg: ptr to outgoing client msg
+ *  item_id: page and sort order, see ZONE_ITEM
  *
  *  returns: packet size
  *           
  */
-uint16_t create_chuchu_puzzle_zone_menu(server_data_t *s, char* msg) {
-  uint16_t pkt_size = 4;
-  int entries, i, max_puzzles = s->m_puzz;
+uint16_t create_chuchu_puzzle_zone_menu(server_data_t *s, char* msg, uint32_t item_id) {
+  chuchu_zone_view_t *v;
+  uint16_t pkt_size = 0;
+  uint32_t sort = ZONE_NEWEST, page = 0;
   
-  pkt_size = create_chuchu_menu_item(msg, pkt_size, 0x00, PUZZLE_ZONE_MENU, PUZZLE_FLAG_ICON, EMPTY_ICON, "Puzzle zone");
-  pkt_size = create_chuchu_menu_item(msg, pkt_size, 0xee, PUZZLE_LAND_MENU, EXIT_ICON, EMPTY_ICON, "Exit");
-  entries=1;
+  if (item_id >> 16 > 0 && item_id >> 16 <= ZONE_SORT_COUNT) {
+    sort = (item_id >> 16) - 1;
+    page = item_id & 0xffff;
+  }
+  v = &zone_views[sort];
 
-  //Get all puzzles
-  for(i=0;i<max_puzzles;i++) {
-    if(s->puzz_l[i]) {
-      pkt_size = create_chuchu_menu_item(msg, pkt_size, s->puzz_l[i]->id, PUZZLE_ZONE_FILE, PUZZLE_DOWNLOAD_ICON, EMPTY_ICON, s->puzz_l[i]->p_name);
-      entries++;
+  lock_puzzles(s);
+  if (!v->built || v->gen != s->puzz_gen ||
+      (v->dl_gen != s->puzz_dl_gen && sort == ZONE_MOST_DOWNLOADED && time(NULL) - v->time >= ZONE_DL_TTL)) {
+    if (!build_chuchu_zone_view(s, (ZONE_SORT)sort)) {
+      unlock_puzzles(s);
+      return 0;
     }
   }
-  create_chuchu_hdr(msg, 0x07, (uint8_t)entries, pkt_size);
+  //Catalog may have shrunk the nr of pages since the client got this item
+  if (page >= (uint32_t)v->pages)
+    page = (uint32_t)v->pages - 1;
+  pkt_size = v->size[page];
+  memcpy(msg, &v->pkt[v->off[page]], pkt_size);
+  unlock_puzzles(s);
+
   return pkt_size;
 }
 
@@ -685,6 +879,7 @@ uint16_t create_chuchu_puzzle_zone_menu(server_data_t *s, char* msg) {
  * 
  * Function to create the game room menu display (0x07)
  * Chuchu hdr flag has the nr of menu entries in packet. 
+ * Game room locked.
  *
  *  *msg: ptr to outgoing client msg
  *  *gr;  ptr to game room struct
@@ -713,14 +908,84 @@ uint16_t create_chuchu_game_menu(char* msg, game_room_t *gr) {
   create_chuchu_hdr(msg, 0x07, (uint8_t)entries, pkt_size);
 
   //Update all other users in game_room, so they can see the newly joined player
-  for(i=0;i<max_player_slots;i++)
-    if(gr->player_slots[i])
-      send_chuchu_crypt_msg(gr->player_slots[i]->sock, &gr->player_slots[i]->server_cipher, msg, pkt_size);
+  send_chuchu_bcast(NULL, BCAST_GAME_ROOM, gr, msg, pkt_size);
   
   return 0;
 }
 
 
+/*
+ * Function: post_player_db_job
+ * --------------------
+ * 
+ * Function that posts a DB job that replies to the
+ * player, the msgs that follow are held back until
+ * its done callback has run
+ *
+ *  *pl: ptr to player struct
+ *  *job: ptr to DB job
+ *
+ *  returns: void
+ *           
+ */
+static void post_player_db_job(player_t *pl, chuchu_db_job_t *job) {
+  pl->db_job = job;
+  pause_chuchu_rx(pl, 1);
+  post_chuchu_db_job((server_data_t *)pl->data, job);
+}
+
+/*
+ * Function: top_ranking_chuchu_done
+ * --------------------
+ * 
+ * Done callback of DB_TOP_RANKING, sends the
+ * top ranking in a large green window (0x1a)
+ *
+ *  *job: ptr to DB job
+ *
+ *  returns: 0 => OK
+ *           
+ */
+static int top_ranking_chuchu_done(chuchu_db_job_t *job) {
+  uint16_t pkt_size;
+
+  if (job->size == 0) {
+    chuchu_error(SERVER, "Could not generate top ranking msg");
+    return 0;
+  }
+  //Padding
+  pkt_size = (uint16_t)(job->size + 4 + 4);
+  create_chuchu_hdr(job->data, 0x1a, 0x01, pkt_size);
+  queue_chuchu_crypt_msg(job->pl, job->data, pkt_size);
+  return 0;
+}
+
+/*
+ * Function: puzzle_chuchu_done
+ * --------------------
+ * 
+ * Done callback of DB_READ_PUZZLE, sends the
+ * puzzle data (0x13) or a notify msg
+ *
+ *  *job: ptr to DB job
+ *
+ *  returns: 0 => OK
+ *           
+ */
+static int puzzle_chuchu_done(chuchu_db_job_t *job) {
+  uint16_t pkt_size;
+
+  //Something went wrong, sent notify msg
+  if (job->size == 0) {
+    pkt_size = create_chuchu_notify_msg(job->data, 0x05);
+  } else {
+    pkt_size = (uint16_t)(job->size + 4);
+    create_chuchu_hdr(job->data, 0x13, 0x00, pkt_size);
+  }
+  queue_chuchu_crypt_msg(job->pl, job->data, pkt_size);
+  return 0;
+}
+
 /*
  * Function: create_chuchu_menu_msg
  * --------------------
@@ -742,21 +1007,33 @@ uint16_t create_chuchu_game_menu(char* msg, game_room_t *gr) {
 uint16_t create_chuchu_menu_msg(player_t *pl, uint32_t menu_id, uint32_t item_id, char* msg) {
   uint16_t pkt_size = 0;
   uint32_t prev_menu_id, prev_item_id;
-  int rc = 0;
   game_room_t *gr;
+  chuchu_db_job_t *job;
   server_data_t *s = pl->data;
   MENU_ITEM_ID id = menu_id;
 
   //Store prev state and update to the new
   prev_menu_id = pl->menu_id;
   prev_item_id = pl->item_id;
-  pl->menu_id = menu_id;
+  set_chuchu_player_menu(pl, menu_id);
   pl->item_id = item_id;
    
   switch(id) {
   case SERVER_MENU:
-    if (item_id == 0xcc)
-      return create_chuchu_info_msg(msg, s, RANKING);
+    if (item_id == 0xcc) {
+      pkt_size = (uint16_t)get_top_ranking_from_cache(&msg[4]);
+      if (pkt_size > 0) {
+	//Padding
+	pkt_size = (uint16_t)(pkt_size + 4 + 4);
+	create_chuchu_hdr(msg, 0x1a, 0x01, pkt_size);
+	return pkt_size;
+      }
+      //Reply sent by top_ranking_chuchu_done
+      job = new_chuchu_db_job(pl, DB_TOP_RANKING, top_ranking_chuchu_done);
+      if (job)
+	post_player_db_job(pl, job);
+      return 0;
+    }
     if (item_id == 0xdd)
       return create_chuchu_info_msg(msg, s, NEWS);
     return create_chuchu_server_menu(s, msg);
@@ -765,15 +1042,24 @@ uint16_t create_chuchu_menu_msg(player_t *pl, uint32_t menu_id, uint32_t item_id
       leave_game_room(pl, prev_menu_id, prev_item_id);
     return create_chuchu_room_menu(s, msg);
   case GAME_MENU:
+    //A player only ever has one seat
+    if (item_id != 0xff && __atomic_load_n(&pl->room, __ATOMIC_RELAXED) != NULL)
+      leave_game_room(pl, prev_menu_id, prev_item_id);
+    lock_rooms(s, 0);
     if (item_id == 0xff) {
       gr = get_room_from_item_id(s, prev_item_id);
-      if (gr == NULL)
+      if (gr == NULL) {
+	unlock_rooms(s);
 	return 0;
+      }
+      lock_room(gr);
       //Do we have atleast two players?
       if (gr->taken_seats < 2) {
+	unlock_room(gr);
+	unlock_rooms(s);
 	pkt_size = create_chuchu_notify_msg(msg, 0x01);
-	send_chuchu_crypt_msg(pl->sock, &pl->server_cipher, msg, pkt_size);
-	pl->menu_id = prev_menu_id;
+	queue_chuchu_crypt_msg(pl, msg, pkt_size);
+	set_chuchu_player_menu(pl, prev_menu_id);
 	pl->item_id = prev_item_id; 
 	return 0;
       }
@@ -781,26 +1067,37 @@ uint16_t create_chuchu_menu_msg(player_t *pl, uint32_t menu_id, uint32_t item_id
 #ifdef DCNET
       discordGameStart(gr);
 #endif
-      return create_chuchu_start_game_msg(gr);
+      create_chuchu_start_game_msg(gr);
+      unlock_room(gr);
+      unlock_rooms(s);
+      return 0;
     } 
     //Else a player is joing a game room
     gr = get_room_from_item_id(s, item_id); 
-    if (gr == NULL)
+    if (gr == NULL) {
+      unlock_rooms(s);
       return 0; 
+    }
+    lock_room(gr);
     //If the game room is full send a notify and restore position of player
     //This checks how many taken seats there are in the game room, but also if there are seats 
     //for "several controllers", for example, 3 taken seats and a player with two people/controllers
     //wants to join = Denied.
     if (gr->taken_seats >= 4 || ((pl->controllers + gr->taken_seats) > 4)) {
+      unlock_room(gr);
+      unlock_rooms(s);
       pkt_size = create_chuchu_notify_msg(msg, 0x02);
-      send_chuchu_crypt_msg(pl->sock, &pl->server_cipher, msg, pkt_size);
-      pl->menu_id = prev_menu_id;
+      queue_chuchu_crypt_msg(pl, msg, pkt_size);
+      set_chuchu_player_menu(pl, prev_menu_id);
       pl->item_id = prev_item_id; 
       return 0;
     }
     //Else update the game room with the new player
     join_game_room(pl, gr);
-    return create_chuchu_game_menu(msg, gr);
+    create_chuchu_game_menu(msg, gr);
+    unlock_room(gr);
+    unlock_rooms(s);
+    return 0;
     //Puzze land has been pressed
   case PUZZLE_LAND_MENU:
     if (item_id == 0xaa) {
@@ -813,25 +1110,25 @@ uint16_t create_chuchu_menu_msg(player_t *pl, uint32_t menu_id, uint32_t item_id
     pkt_size = create_chuchu_puzzle_land_menu(msg);
     break;
   case PUZZLE_ZONE_MENU:
-    pkt_size = create_chuchu_puzzle_zone_menu(s, msg);
+    pkt_size = create_chuchu_puzzle_zone_menu(s, msg, item_id);
     pkt_size = (uint16_t)(pkt_size + create_chuchu_add_info(s, &msg[pkt_size], PUZZLE_ZONE_MENU, 0x00));
     break;
   case PUZZLE_ZONE_FILE:
     //Item id is the id of the rowid in the DB
-    pkt_size = (uint16_t)read_puzzle_in_chuchu_db(s, s->chu_db_path, &msg[4], item_id);
-    //Something went wrong, sent notify msg
-    if (pkt_size == 0) {
-      pkt_size = create_chuchu_notify_msg(msg, 0x05);
+    pkt_size = (uint16_t)get_puzzle_from_cache(item_id, &msg[4]);
+    if (pkt_size > 0) {
+      pkt_size = (uint16_t)(pkt_size + 4);
+      create_chuchu_hdr(msg, 0x13, 0x00, pkt_size);
+      count_puzzle_download(s, item_id);
       return pkt_size;
     }
-    //Send puzzle data
-    rc = update_puzzle_downloaded_to_chuchu_db(s, s->chu_db_path, item_id);
-    if (rc != 1)
-      chuchu_info(LOBBY_SERVER,"Could not update puzzle downloaded");
-    
-    pkt_size = (uint16_t)(pkt_size + 4);
-    create_chuchu_hdr(msg, 0x13, 0x00, pkt_size);
-    break;
+    //Reply sent by puzzle_chuchu_done
+    job = new_chuchu_db_job(pl, DB_READ_PUZZLE, puzzle_chuchu_done);
+    if (job == NULL)
+      return create_chuchu_notify_msg(msg, 0x05);
+    job->id = item_id;
+    post_player_db_job(pl, job);
+    return 0;
   default:
     pkt_size = create_chuchu_server_menu(s, msg);
     break;
@@ -859,7 +1156,6 @@ void send_txt_to_all(server_data_t *s, char* username, int txt_flag) {
   char msg[MAX_PKT_SIZE], chat_msg[64];
   uint16_t pkt_size = 0;
   uint32_t menu_id = 0, item_id = 0;
-  int i, max_client = s->m_cli;
 
   memset(chat_msg, 0, sizeof(chat_msg));
   memset(msg, 0, sizeof(msg)); 
@@ -890,11 +1186,118 @@ void send_txt_to_all(server_data_t *s, char* username, int txt_flag) {
   //Create header
   create_chuchu_hdr(msg, 0x06, 0x00, pkt_size);
   //Send to all
-  for(i=0;i<max_client;i++) {
-    if(s->p_l[i] && (s->p_l[i]->authorized == 1)) {
-      send_chuchu_crypt_msg(s->p_l[i]->sock, &s->p_l[i]->server_cipher, msg, pkt_size);
+  send_chuchu_bcast(s, BCAST_AUTHORIZED, NULL, msg, pkt_size);
+}
+
+/*
+ * Function: login_chuchu_player
+ * --------------------
+ * 
+ * Function that creates the reply to the login
+ * request once the ranking of the player is read
+ *
+ *  *pl: ptr to player data struct
+ *  controllers: nr of controllers, msg flag of the request
+ *  *dc_id: DC ID to ack.
+ *  *msg: ptr to outgoing client msg
+ *
+ *  returns: packet size
+ *           
+ */
+static uint16_t login_chuchu_player(player_t *pl, uint8_t controllers, const char *dc_id, char* msg) {
+  server_data_t *s = (server_data_t*)pl->data;
+  uint16_t msg_size = 0;
+
+  //Amount of controllers
+  if (controllers != 0x00) {
+    pl->controllers = controllers;
+    chuchu_info(LOBBY_SERVER," <- 0x%02x players on this dreamcast wants to play", controllers);
+    send_txt_to_all(s, pl->username, JOIN_SERVER);
+  }
+  //Ack. the DC ID again, sets it on the DC, a must to play the game
+  memcpy(&msg[0x04], dc_id, 6);
+  msg_size = create_chuchu_resent_login_request_msg(msg, 0x00, 12); 
+  msg_size = (uint16_t)(msg_size + create_chuchu_menu_msg(pl, SERVER_MENU, 0x00, &msg[msg_size])); 
+#ifdef DCNET
+  statusJoin(s->deedee_server ? "deedee" : "chuchu", inet_ntoa(pl->addr.sin_addr), ntohs(pl->addr.sin_port), pl->username);
+#endif
+  return msg_size;
+}
+
+/*
+ * Function: login_chuchu_done
+ * --------------------
+ * 
+ * Done callback of DB_READ_RANKING, authorizes
+ * the player and replies to the login request,
+ * job id has the msg flag of the request
+ *
+ *  *job: ptr to DB job
+ *
+ *  returns: 0 => OK
+ *          -1 => Disconnect player
+ *           
+ */
+static int login_chuchu_done(chuchu_db_job_t *job) {
+  player_t *pl = job->pl;
+  uint16_t msg_size = 0;
+
+  if (job->rc == 1) {
+    chuchu_info(LOBBY_SERVER,"Stats fetched for username: %s", pl->username);
+  } else {
+    //If this happens disconnnect user
+    chuchu_error(LOBBY_SERVER,"Could not get stats for username: %s", pl->username);
+    return -1;
+  }
+  //Find if a old session exist and get the stat and save it.
+  if_session_exists((server_data_t*)pl->data, pl);
+	
+  //Set authorized
+  authorize_chuchu_player((server_data_t*)pl->data, pl);
+  msg_size = login_chuchu_player(pl, (uint8_t)job->id, pl->dreamcast_id, job->data);
+  queue_chuchu_crypt_msg(pl, job->data, msg_size);
+  return 0;
+}
+
+/*
+ * Function: upload_chuchu_done
+ * --------------------
+ * 
+ * Done callback of DB_UPLOAD_PUZZLE, sends the
+ * puzzle land menu and how the upload went
+ *
+ *  *job: ptr to DB job
+ *
+ *  returns: 0 => OK
+ *           
+ */
+static int upload_chuchu_done(chuchu_db_job_t *job) {
+  uint16_t msg_size = 0;
+  int n_flag = 0;
+
+  //New Puzzle
+  if (job->found == 0) {
+    if (job->rc == 1) {
+      //Upload OK
+      n_flag = 0x04;
+    } else {
+      //Something went wrong
+      n_flag = 0x03;
     }
+  } else if (job->found == 1) {
+    //Puzzle name is already in the DB
+    n_flag = 0x06;
+  } else {
+    chuchu_error(LOBBY_SERVER,"Error in DB");
+    //Something went wrong 
+    n_flag = 0x03;
   }
+  //The puzzle data is not needed anymore
+  memset(job->data, 0, sizeof(job->data));
+  msg_size = create_chuchu_puzzle_land_menu(job->data);
+  msg_size = (uint16_t)(msg_size + create_chuchu_notify_msg(&job->data[msg_size], (uint8_t)n_flag));
+  queue_chuchu_crypt_msg(job->pl, job->data, msg_size);
+  return 0;
 }
 
 /*
@@ -912,17 +1315,16 @@ void send_txt_to_all(server_data_t *s, char* username, int txt_flag) {
  *           
  */
 int handle_chuchu_msg(player_t *pl, char* msg, char* buf) {
-  char username[MAX_UNAME_LEN], puzzlename[MAX_UNAME_LEN], entered_passwd[MAX_PASSWD_LEN];
+  char username[MAX_UNAME_LEN], entered_passwd[MAX_PASSWD_LEN];
   char join_chat_msg[64];
   uint8_t msg_id=0, msg_flag=0;
   uint16_t msg_size=0, msg_len=0;
   uint32_t menu_id=0, item_id=0;
   server_data_t *s = (server_data_t*)pl->data;
-  int rc = 0;
+  chuchu_db_job_t *job;
 
   memset(username, 0, sizeof(username));
   memset(entered_passwd, 0, sizeof(entered_passwd));
-  memset(puzzlename, 0, sizeof(puzzlename));
   memset(join_chat_msg, 0, sizeof(join_chat_msg));
   
   msg_id = (uint8_t)buf[0];
@@ -942,37 +1344,17 @@ int handle_chuchu_msg(player_t *pl, char* msg, char* buf) {
       //Print this for the first packet
       if (strcmp(pl->username, username) != 0) {
 	chuchu_info(LOBBY_SERVER," <- Username: %s is trying to join...", username);
-	strlcpy(pl->username, username, sizeof(pl->username));
-	memcpy(pl->dreamcast_id, &buf[0x06], 6);
+	set_chuchu_player_name(pl, username, &buf[0x06]);
 
-	//Get stats/ranking aswell
-	rc = read_ranking_from_chuchu_db(s->chu_db_path, pl); 
-	if (rc == 1) {
-	  chuchu_info(LOBBY_SERVER,"Stats fetched for username: %s", username);
-	} else {
-	  //If this happens disconnnect user
-	  chuchu_error(LOBBY_SERVER,"Could not get stats for username: %s", username);
+	//Get stats/ranking aswell, reply sent by login_chuchu_done
+	job = new_chuchu_db_job(pl, DB_READ_RANKING, login_chuchu_done);
+	if (job == NULL)
 	  return -1;
-	}
-	//Find if a old session exist and get the stat and save it.
-	if_session_exists(s,pl);
-	
-	//Set authorized
-	pl->authorized = 1;
-      }
-      //Amount of controllers
-      if (msg_flag != 0x00) {
-	pl->controllers = msg_flag;
-	chuchu_info(LOBBY_SERVER," <- 0x%02x players on this dreamcast wants to play", msg_flag);
-	send_txt_to_all(s, username, JOIN_SERVER);
+	job->id = msg_flag;
+	post_player_db_job(pl, job);
+	return 0;
       }
-      //Ack. the DC ID again, sets it on the DC, a must to play the game
-      memcpy(&msg[0x04], &buf[0x06], 6);
-      msg_size = create_chuchu_resent_login_request_msg(msg, 0x00, 12); 
-      msg_size = (uint16_t)(msg_size + create_chuchu_menu_msg(pl, SERVER_MENU, 0x00, &msg[msg_size])); 
-#ifdef DCNET
-      statusJoin(s->deedee_server ? "deedee" : "chuchu", inet_ntoa(pl->addr.sin_addr), ntohs(pl->addr.sin_port), username);
-#endif
+      msg_size = login_chuchu_player(pl, msg_flag, &buf[0x06], msg);
     } else {
       chuchu_error(LOBBY_SERVER,"RESENT LOGIN REQUEST MSG is corrupt");
       return -1;
@@ -1003,17 +1385,20 @@ int handle_chuchu_msg(player_t *pl, char* msg, char* buf) {
 	break;
       } else if (msg_len == 0x2c && msg_flag == 0x01 && item_id >= 0x2000) {
 	chuchu_info(LOBBY_SERVER, "Trying to join password protected game room");
+	lock_rooms(s, 0);
 	game_room_t *gr = get_room_from_item_id(s, item_id);
-	if (gr->passwd_protected) {
+	if (gr && gr->passwd_protected) {
 	  strlcpy(entered_passwd, &buf[0x1c], sizeof(entered_passwd));
 
 	  if (strcmp(gr->g_passwd, entered_passwd) != 0) {
+	    unlock_rooms(s);
 	    //Invalid password
 	    chuchu_error(LOBBY_SERVER, "User %s typed the wrong password",pl->username);
 	    msg_size = create_chuchu_notify_msg(msg, 0x08);
 	    break;
 	  }
 	}
+	unlock_rooms(s);
       }
       msg_size = create_chuchu_menu_msg(pl, menu_id, item_id, msg);
       break;
@@ -1042,31 +1427,19 @@ int handle_chuchu_msg(player_t *pl, char* msg, char* buf) {
       chuchu_error(LOBBY_SERVER,"Overflow no thanks");
       break;
     }
-    strlcpy(puzzlename, &buf[4], sizeof(puzzlename));
-    
-    int n_flag = 0;
-    msg_size = create_chuchu_puzzle_land_menu(msg);
-    rc = is_puzzle_in_chuchu_db(s->chu_db_path, puzzlename, pl->username);
-    //New Puzzle
-    if (rc == 0) {
-      rc = write_puzzle_in_chuchu_db(s, puzzlename, pl->username, &buf[0x14], (msg_len - 0x14));
-      if (rc == 1) {
-	//Upload OK
-	n_flag = 0x04;
-      } else {
-	//Something went wrong
-	n_flag = 0x03;
-      }
-    } else if (rc == 1) {
-      //Puzzle name is already in the DB
-      n_flag = 0x06;
-    } else {
-      chuchu_error(LOBBY_SERVER,"Error in DB");
-      //Something went wrong 
-      n_flag = 0x03;
+    //Reply sent by upload_chuchu_done
+    job = new_chuchu_db_job(pl, DB_UPLOAD_PUZZLE, upload_chuchu_done);
+    if (job == NULL) {
+      msg_size = create_chuchu_puzzle_land_menu(msg);
+      msg_size = (uint16_t)(msg_size + create_chuchu_notify_msg(&msg[msg_size], 0x03));
+      break;
     }
-    msg_size = (uint16_t)(msg_size + create_chuchu_notify_msg(&msg[msg_size], n_flag));
-    break;
+    strlcpy(job->p_name, &buf[4], sizeof(job->p_name));
+    strlcpy(job->username, pl->username, sizeof(job->username));
+    job->size = msg_len - 0x14;
+    memcpy(job->data, &buf[0x14], (size_t)job->size);
+    post_player_db_job(pl, job);
+    return 0;
 
   case PLAYER_STAT_MSG:
     if (msg_len == 0x14) {
@@ -1093,32 +1466,454 @@ int handle_chuchu_msg(player_t *pl, char* msg, char* buf) {
   return msg_size;
 }
 
+static chuchu_timer_t stats_timer;
+
+static void log_chuchu_stats(chuchu_timer_t *t) {
+  server_data_t *s = (server_data_t *)t->data;
+
+  log_chuchu_pool(&s->player_pool);
+  log_chuchu_pool(&s->room_pool);
+  add_chuchu_timer(t, (uint64_t)CHUCHU_STATS_INTERVAL * 1000);
+}
+
 #ifdef DCNET
-void *status_update_thread(void *p)
+static chuchu_timer_t status_timer;
+
+static void status_update_timer(chuchu_timer_t *t)
 {
-	server_data_t *server = (server_data_t *)p;
-	const char *game_id = server->deedee_server ? "deedee" : "chuchu";
-	statusReset(game_id);
-	for (;;) {
-		sleep((unsigned)statusPingInterval());
-		statusPing(game_id);
-	}
-	return NULL;
+	server_data_t *server = (server_data_t *)t->data;
+	statusPing(server->deedee_server ? "deedee" : "chuchu");
+	add_chuchu_timer(t, (uint64_t)statusPingInterval() * 1000);
 }
 #endif
 
+/*
+ * Function: new_chuchu_player
+ * --------------------
+ * 
+ * Function that allocates the player struct
+ * of an accepted connection and adds it to
+ * the server struct
+ *
+ *  *s: ptr to server data struct
+ *  client_sock: accepted socket
+ *  *client: address of the client
+ *
+ *  returns: ptr to player struct
+ *           NULL => server is full
+ *           
+ */
+static player_t *new_chuchu_player(server_data_t *s, int client_sock, struct sockaddr_in *client) {
+  player_t *pl = (player_t *)alloc_chuchu_pool(&s->player_pool);
+  int success = 0;
+
+  if (pl == NULL)
+    return NULL;
+  pl->addr = *client;
+  pl->sock = client_sock;
+  pl->client_id = (uint32_t)(client_sock + 0x0100);
+  pl->data = s;
+  init_chuchu_stream(&pl->rx);
+  pl->db_job = NULL;
+  pl->rx_paused = 0;
+  pl->nonblock = 0;
+  pl->closed = 0;
+  pl->last_active = time(NULL);
+  init_chuchu_tx(pl);
+  lock_players(s, 1);
+  success = add_player(s, pl);
+  unlock_players(s);
+  if (!success) {
+    put_chuchu_player(pl);
+    return NULL;
+  }
+  return pl;
+}
+
+/*
+ * Function: process_chuchu_msg
+ * --------------------
+ * 
+ * Function that handles all complete
+ * msgs/pkts in the receive buffer
+ *
+ *  *pl: ptr to player data struct
+ *  *s_msg: ptr to outgoing client msg
+ *
+ *  returns: 0 => OK
+ *          -1 => Disconnect player
+ *           
+ */
+static int process_chuchu_msg(player_t *pl, char *s_msg) {
+  server_data_t *s = (server_data_t *)pl->data;
+  ssize_t write_size = 0;
+  char *c_msg = NULL;
+  int pkt_size = 0;
+
+  //One lock for the whole batch, replies are written after unlock
+  lock_players(s, 0);
+  //Stop at a msg waiting for the DB, the rest is handled after it
+  while (pl->db_job == NULL && (pkt_size = next_chuchu_msg(&pl->rx, &pl->client_cipher, &c_msg)) > 0) {
+    //Handle msg, do some initial checks
+    write_size = (ssize_t)handle_chuchu_msg(pl, s_msg, c_msg);
+    if (write_size > 0)
+      queue_chuchu_crypt_msg(pl, s_msg, (int)write_size);
+    if (write_size < 0) {
+      unlock_players(s);
+      chuchu_info(LOBBY_SERVER,"Client with socket %d is not following protocol - Disconnecting", pl->sock);
+      return -1;
+    }
+    memset(s_msg, 0, MAX_PKT_SIZE);
+  }
+  unlock_players(s);
+  return pkt_size < 0 ? -1 : 0;
+}
+
+/*
+ * Function: complete_chuchu_db_job
+ * --------------------
+ * 
+ * Function that runs the done callback of a
+ * finished DB job on the thread of the player
+ * and handles the msgs that waited for it
+ *
+ *  *job: ptr to DB job
+ *  *s_msg: ptr to outgoing client msg
+ *
+ *  returns: 0 => OK
+ *          -1 => Disconnect player
+ *           
+ */
+static int complete_chuchu_db_job(chuchu_db_job_t *job, char *s_msg) {
+  player_t *pl = job->pl;
+  server_data_t *s = (server_data_t *)pl->data;
+  int rc = 0;
+
+  pl->db_job = NULL;
+  //Player left while the worker was busy
+  if (pl->tx.closing) {
+    free_chuchu_db_job(job);
+    return 0;
+  }
+  lock_players(s, 0);
+  rc = job->done(job);
+  unlock_players(s);
+  free_chuchu_db_job(job);
+  if (rc < 0) {
+    chuchu_info(LOBBY_SERVER,"Client with socket %d is not following protocol - Disconnecting", pl->sock);
+    return -1;
+  }
+  pause_chuchu_rx(pl, 0);
+  return process_chuchu_msg(pl, s_msg);
+}
+
+/*
+ * Function: close_chuchu_client
+ * --------------------
+ * 
+ * Function that removes a player from the
+ * event loop, closes the socket and drops the
+ * reference of the connection. The events batch
+ * holds its own references, so the player stays
+ * valid until the batch is done with it
+ *
+ *  *pl: ptr to player data struct
+ *
+ *  returns: void
+ *           
+ */
+static void close_chuchu_client(player_t *pl) {
+  server_data_t *s = (server_data_t *)pl->data;
+
+  if (pl->closed)
+    return;
+  pl->closed = 1;
+  del_chuchu_timer(&pl->idle);
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, pl->sock, NULL);
+  delete_player(pl);
+  close_chuchu_tx(pl);
+  close(pl->sock);
+  put_chuchu_player(pl);
+}
+
+/*
+ * Function: idle_chuchu_client
+ * --------------------
+ * 
+ * Idle timer of a player in the event loop, disconnects
+ * it if it has not sent anything for CHUCHU_IDLE_TIMEOUT
+ * seconds, same as the socket timeout in threaded mode.
+ * Reads don't touch the timer, it is moved on from here.
+ *
+ *  *t: idle timer of the player
+ *
+ *  returns: void
+ *           
+ */
+static void idle_chuchu_client(chuchu_timer_t *t) {
+  player_t *pl = chuchu_timer_entry(t, player_t, idle);
+  time_t idle = time(NULL) - pl->last_active;
+
+  if (idle < CHUCHU_IDLE_TIMEOUT) {
+    add_chuchu_timer(t, (uint64_t)(CHUCHU_IDLE_TIMEOUT - idle) * 1000);
+    return;
+  }
+  chuchu_info(LOBBY_SERVER,"Client with socket %d timed out", pl->sock);
+  close_chuchu_client(pl);
+}
+
+/*
+ * Function: accept_chuchu_clients
+ * --------------------
+ * 
+ * Function that accepts all pending connections
+ * on the non-blocking listen socket and registers
+ * them in the event loop
+ *
+ *  *s: ptr to server data struct
+ *  socket_desc: listen socket
+ *
+ *  returns: void
+ *           
+ */
+static void accept_chuchu_clients(server_data_t *s, int socket_desc) {
+  struct sockaddr_in client;
+  socklen_t c = sizeof(client);
+  struct epoll_event ev;
+  char s_msg[MAX_PKT_SIZE];
+  int client_sock;
+  uint16_t write_size = 0;
+  player_t *pl;
+
+  for (;;) {
+    c = sizeof(client);
+    client_sock = accept4(socket_desc, (struct sockaddr *)&client, &c, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_sock < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+	continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+	perror("Accept failed");
+      return;
+    }
+    chuchu_info(LOBBY_SERVER,"Connection accepted from %s on socket %d", inet_ntoa(client.sin_addr), client_sock);
+    pl = new_chuchu_player(s, client_sock, &client);
+    if (pl == NULL) {
+      close(client_sock);
+      continue;
+    }
+    pl->nonblock = 1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = pl;
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+      perror("epoll_ctl");
+      delete_player(pl);
+      close(client_sock);
+      put_chuchu_player(pl);
+      continue;
+    }
+    init_chuchu_timer(&pl->idle, idle_chuchu_client, NULL);
+    add_chuchu_timer(&pl->idle, CHUCHU_IDLE_TIMEOUT * 1000);
+
+    init_chuchu_crypt(pl);
+    //Send inital message to the client
+    memset(s_msg, 0, sizeof(s_msg));
+    write_size = create_chuchu_copyright_msg(pl, s_msg, LOBBY_SERVER);
+    send_chuchu_msg(pl, s_msg, (int)write_size);
+  }
+}
+
+/*
+ * Function: read_chuchu_client
+ * --------------------
+ * 
+ * Function that reads from a readable
+ * player socket and handles the msgs
+ *
+ *  *pl: ptr to player data struct
+ *  *s_msg: ptr to outgoing client msg
+ *
+ *  returns: 0 => OK
+ *          -1 => Disconnect player
+ *           
+ */
+static int read_chuchu_client(player_t *pl, char *s_msg) {
+  ssize_t read_size = recv_chuchu_stream(pl->sock, &pl->rx);
+
+  if (read_size == 0) {
+    chuchu_info(LOBBY_SERVER,"Client with socket %d [%s] disconnected", pl->sock, inet_ntoa(pl->addr.sin_addr));
+    return -1;
+  }
+  if (read_size < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return 0;
+    chuchu_info(LOBBY_SERVER,"recv failed");
+    return -1;
+  }
+  pl->last_active = time(NULL);
+
+  return process_chuchu_msg(pl, s_msg);
+}
+
+//Players in an events batch, not the listen socket or eventfds
+static player_t *chuchu_event_player(server_data_t *s, struct epoll_event *ev) {
+  if (ev->data.ptr == NULL || ev->data.ptr == &s->db_event_fd || ev->data.ptr == &s->timer_fd)
+    return NULL;
+  return (player_t *)ev->data.ptr;
+}
+
+/*
+ * Function: chuchu_event_loop
+ * --------------------
+ * 
+ * Non-blocking epoll event loop that serves all
+ * connections from a single thread
+ *
+ *  *s: ptr to server data struct
+ *  socket_desc: listen socket
+ *
+ *  returns: 1 => FAILED
+ *           
+ */
+static int chuchu_event_loop(server_data_t *s, int socket_desc) {
+  struct epoll_event ev, events[CHUCHU_MAX_EVENTS];
+  char s_msg[MAX_PKT_SIZE];
+  chuchu_db_job_t *job, *next;
+  player_t *pl;
+  int i, n;
+
+  memset(s_msg, 0, sizeof(s_msg));
+  s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (s->epoll_fd < 0) {
+    perror("epoll_create1");
+    return 1;
+  }
+  fcntl(socket_desc, F_SETFL, fcntl(socket_desc, F_GETFL) | O_NONBLOCK);
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, socket_desc, &ev) < 0) {
+    perror("epoll_ctl");
+    return 1;
+  }
+  //Finished DB jobs
+  ev.data.ptr = &s->db_event_fd;
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->db_event_fd, &ev) < 0) {
+    perror("epoll_ctl");
+    return 1;
+  }
+  //Timers armed by other threads
+  ev.data.ptr = &s->timer_fd;
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->timer_fd, &ev) < 0) {
+    perror("epoll_ctl");
+    return 1;
+  }
+
+  for (;;) {
+    n = epoll_wait(s->epoll_fd, events, CHUCHU_MAX_EVENTS, run_chuchu_timers());
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("epoll_wait");
+      return 1;
+    }
+    //A player closed by an earlier entry may still have one in the batch
+    for (i=0;i<n;i++) {
+      if ((pl = chuchu_event_player(s, &events[i])) != NULL)
+	__atomic_add_fetch(&pl->refs, 1, __ATOMIC_RELAXED);
+    }
+    for (i=0;i<n;i++) {
+      pl = (player_t *)events[i].data.ptr;
+      if (pl == NULL) {
+	accept_chuchu_clients(s, socket_desc);
+	continue;
+      }
+      if (events[i].data.ptr == &s->db_event_fd) {
+	for (job = get_chuchu_db_done(s); job; job = next) {
+	  next = job->next;
+	  pl = job->pl;
+	  if (complete_chuchu_db_job(job, s_msg) < 0)
+	    close_chuchu_client(pl);
+	}
+	continue;
+      }
+      if (events[i].data.ptr == &s->timer_fd || pl->closed)
+	continue;
+      if ((events[i].events & EPOLLOUT) && flush_chuchu_msg(pl) < 0) {
+	chuchu_info(LOBBY_SERVER,"send failed");
+	close_chuchu_client(pl);
+	continue;
+      }
+      if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && read_chuchu_client(pl, s_msg) < 0)
+	close_chuchu_client(pl);
+    }
+    for (i=0;i<n;i++) {
+      if ((pl = chuchu_event_player(s, &events[i])) != NULL)
+	put_chuchu_player(pl);
+    }
+  }
+  return 1;
+}
+
+/*
+ * Function: chuchu_signal_thread
+ * --------------------
+ *
+ * Waits for SIGTERM/SIGINT and writes the buffered
+ * rankings to the DB before exiting
+ * 
+ *  *data: ptr to server data struct
+ *
+ *  returns: never
+ *
+ */
+static void *chuchu_signal_thread(void *data) {
+  server_data_t *s = (server_data_t *)data;
+  sigset_t set;
+  int sig;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigwait(&set, &sig);
+  chuchu_info(LOBBY_SERVER,"Got signal %d, flushing DB", sig);
+  flush_chuchu_db_worker(s);
+  log_chuchu_pool(&s->player_pool);
+  log_chuchu_pool(&s->room_pool);
+  exit(0);
+}
+
 int main(int argc , char *argv[]) {
   int socket_desc , client_sock , c, optval;
   struct sockaddr_in server , client;
   server_data_t s_data;
+  struct pollfd pfd[2];
+  sigset_t sigs;
 
   //Load cfg and init server_data
   if (!get_chuchu_config(&s_data, argc >= 2 ? argv[1] : "chuchu.cfg"))
     return 0;
 
+  //Every thread inherits this, only chuchu_signal_thread gets them
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  //Upgrade the DB schema if needed
+  if (!migrate_chuchu_db(s_data.chu_db_path))
+    return 1;
+  if (!start_chuchu_db_maintenance(&s_data))
+    return 1;
+
   //Load puzzles from DB to array
   if(!load_puzzles_to_array(&s_data))
     return 0;
+
+  //Load news, reloaded when the file changes
+  if (!start_chuchu_news(&s_data))
+    return 1;
   
   //Init game rooms
   init_game_rooms(&s_data);
@@ -1143,38 +1938,69 @@ int main(int argc , char *argv[]) {
   }
   chuchu_info(LOBBY_SERVER,"Bind done");
   
-  listen(socket_desc , 3);
+  listen(socket_desc , SOMAXCONN);
 
   chuchu_info(LOBBY_SERVER,"Waiting for incoming connections...");
+  chuchu_info(LOBBY_SERVER,"%zu bytes per connection, %zu KB for %d clients",
+	      sizeof(player_t), sizeof(player_t) * (size_t)s_data.m_cli / 1024, s_data.m_cli);
   
   c = sizeof(struct sockaddr_in);
   pthread_t thread_id;
-  if (pthread_mutex_init(&s_data.mutex, NULL)) {
-	  perror("pthread_mutex_init");
+  if (!init_chuchu_locks(&s_data)) {
+	  perror("init_chuchu_locks");
 	  return 1;
   }
-#ifdef DCNET
-  if (pthread_create(&thread_id, NULL, status_update_thread, &s_data) < 0)
-    perror("Could not create status update thread");
+  //Driven by the accept or event loop below
+  if ((s_data.timer_fd = init_chuchu_timers()) < 0)
+    return 1;
+  //The event loop is woken up by an eventfd, threads wait for their job
+  if (!start_chuchu_db_worker(&s_data, s_data.threaded ? -1 : eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+    perror("start_chuchu_db_worker");
+    return 1;
+  }
+  if (pthread_create(&thread_id, NULL, chuchu_signal_thread, &s_data) < 0)
+    perror("Could not create signal thread");
   else
     pthread_detach(thread_id);
+  init_chuchu_timer(&stats_timer, log_chuchu_stats, &s_data);
+  add_chuchu_timer(&stats_timer, (uint64_t)CHUCHU_STATS_INTERVAL * 1000);
+#ifdef DCNET
+  statusReset(s_data.deedee_server ? "deedee" : "chuchu");
+  init_chuchu_timer(&status_timer, status_update_timer, &s_data);
+  add_chuchu_timer(&status_timer, (uint64_t)statusPingInterval() * 1000);
 #endif
 
-  while( (client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c)) ) {
+  if (!s_data.threaded)
+    return chuchu_event_loop(&s_data, socket_desc);
+
+  //This thread only accepts and runs the timers
+  fcntl(socket_desc, F_SETFL, fcntl(socket_desc, F_GETFL) | O_NONBLOCK);
+  pfd[0].fd = socket_desc;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = s_data.timer_fd;
+  pfd[1].events = POLLIN;
+  for (;;) {
+    pfd[0].revents = 0;
+    if (poll(pfd, 2, run_chuchu_timers()) < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+    if (!(pfd[0].revents & POLLIN))
+      continue;
+    client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c);
+    if (client_sock < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK)
+	continue;
+      perror("Accept failed");
+      return 1;
+    }
     chuchu_info(LOBBY_SERVER,"Connection accepted from %s on socket %d", inet_ntoa(client.sin_addr), client_sock);
     //Store player data
-    player_t *pl = (player_t *)malloc(sizeof(player_t));
-    pl->addr = client;
-    pl->sock = client_sock;
-    pl->client_id = (uint32_t)(client_sock + 0x0100);
-    lock_server(&s_data);
-    int success = add_player(&s_data, pl);
-    unlock_server(&s_data);
-    if (!success) {
-	free(pl);
-	return 0;
+    player_t *pl = new_chuchu_player(&s_data, client_sock, &client);
+    if (pl == NULL) {
+      close(client_sock);
+      continue;
     }
-    pl->data = &s_data;
     
     if( pthread_create( &thread_id , NULL ,  chuchu_client_handler , (void*)pl) < 0) {
       perror("Could not create thread");
@@ -1184,11 +2010,6 @@ int main(int argc , char *argv[]) {
     chuchu_info(LOBBY_SERVER,"Handler assigned");
     pthread_detach(thread_id);
   }
-  pthread_mutex_destroy(&s_data.mutex);
-  if (client_sock < 0) {
-    perror("Accept failed");
-    return 1;
-  }
   
   return 0;
 }
@@ -1210,75 +2031,82 @@ void *chuchu_client_handler(void *data) {
   int sock = pl->sock;
   ssize_t read_size=0;
   ssize_t write_size=0;
-  int index=0, n_index=0;
-  char c_msg[MAX_PKT_SIZE], s_msg[MAX_PKT_SIZE];
+  struct pollfd pfd;
+  chuchu_db_job_t *job;
+  int rc = 0;
+  char s_msg[MAX_PKT_SIZE];
 
-  memset(c_msg, 0, sizeof(c_msg));
   memset(s_msg, 0, sizeof(s_msg));
 
-  struct timeval tv;
-  tv.tv_sec = 1800;       /* Timeout in seconds */
-  tv.tv_usec = 0;
-  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO,(char *)&tv,sizeof(struct timeval));
-  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,(char *)&tv,sizeof(struct timeval));
-
+  //Sends never block, other threads queue to this player
+  pl->nonblock = 1;
   init_chuchu_crypt(pl);
   
   //Send inital message to the client
   write_size = create_chuchu_copyright_msg(pl,s_msg,LOBBY_SERVER);
   if (write_size != 0) {
-    send_chuchu_msg(sock, s_msg , (int)write_size);
+    send_chuchu_msg(pl, s_msg , (int)write_size);
     memset(s_msg, 0, sizeof(s_msg));
   } else {
     delete_player(pl); 
-    free(pl);
+    put_chuchu_player(pl);
     return 0;
   }
 
-  //Receive a message from client
-  while( (read_size = recv(sock , c_msg , sizeof(c_msg) , 0)) > 0 ) {
-    //Decrypt msg
-    decrypt_chuchu_msg(&pl->client_cipher, c_msg, (long unsigned int)read_size);
-    
-    //Parse msg
-    index = 0;
-    n_index = 0;
-    while (read_size > 0) {
-      if ((n_index = parse_chuchu_msg(&c_msg[index], (int)read_size)) > 0) {
-    lock_server((server_data_t *)pl->data);
-	//Handle msg, do some initial checks
-	write_size = (ssize_t)handle_chuchu_msg(pl, s_msg, &c_msg[index]);
-    unlock_server((server_data_t *)pl->data);
-	if (write_size > 0)
-	  send_chuchu_crypt_msg(sock, &pl->server_cipher, s_msg, (int)write_size);
-	if (write_size < 0) {
-	  chuchu_info(LOBBY_SERVER,"Client with socket %d is not following protocol - Disconnecting", sock);
-	  delete_player(pl);
-	  free(pl);
-	  close(sock);
-	  return 0;
-	}
-	//Decrease size
-	read_size -= n_index;
-	//Update pointer in recv buff
-	index += n_index;
-      } else
+  //Receive a message from client, write the queue when possible
+  for (;;) {
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    if (pending_chuchu_tx(pl))
+      pfd.events |= POLLOUT;
+    rc = poll(&pfd, 1, pending_chuchu_tx(pl) ? CHUCHU_TX_RETRY_MS : 1000);
+    if (rc < 0) {
+      if (errno == EINTR)
+	continue;
+      read_size = -1;
+      break;
+    }
+    if (pending_chuchu_tx(pl) && flush_chuchu_msg(pl) < 0) {
+      read_size = -1;
+      break;
+    }
+    if (rc == 0 || !(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+      if (time(NULL) - pl->last_active >= CHUCHU_IDLE_TIMEOUT) {
+	chuchu_info(LOBBY_SERVER,"Client with socket %d [%s] timed out", sock, inet_ntoa(pl->addr.sin_addr));
+	read_size = -1;
 	break;
-      memset(s_msg, 0, sizeof(s_msg)); 
+      }
+      continue;
+    }
+    if ((read_size = recv_chuchu_stream(sock, &pl->rx)) <= 0)
+      break;
+    pl->last_active = time(NULL);
+    
+    //Decrypt, parse and handle msg, wait here for the DB if needed
+    rc = process_chuchu_msg(pl, s_msg);
+    while (rc >= 0 && pl->db_job) {
+      job = pl->db_job;
+      wait_chuchu_db_job(pl->data, job);
+      rc = complete_chuchu_db_job(job, s_msg);
+    }
+    if (rc < 0) {
+      delete_player(pl);
+      close_chuchu_tx(pl);
+      close(sock);
+      put_chuchu_player(pl);
+      return 0;
     }
-    memset(c_msg, 0, sizeof(c_msg));
   }
   
-  if(read_size == 0) {
+  if(read_size == 0)
     chuchu_info(LOBBY_SERVER,"Client with socket %d [%s] disconnected", sock, inet_ntoa(pl->addr.sin_addr));
-    close(sock);
-  } else if(read_size == -1) {
+  else
     chuchu_info(LOBBY_SERVER,"recv failed");
-    close(sock);
-  }
   
   delete_player(pl);
-  free(pl);
+  close_chuchu_tx(pl);
+  close(sock);
+  put_chuchu_player(pl);
   
   return 0;
-} 
+}
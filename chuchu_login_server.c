@@ -24,9 +24,17 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
 #include "chuchu_common.h"
 #include "chuchu_sql.h"
 #include "chuchu_msg.h"
+#ifdef IO_URING
+#include <sys/eventfd.h>
+#include "chuchu_uring.h"
+#endif
+
+//Same as the socket timeout of the threaded handler
+#define CHUCHU_LOGIN_TIMEOUT 1800
 
 /*
  * Function:  auth_process 
@@ -149,6 +157,524 @@ int auth_process(player_t *pl, char* msg, char* buf, AUTH_PROCESS *auth_state) {
   return msg_size;
 }
 
+/*
+ * Function: init_login_player
+ * --------------------
+ * initializes the player struct of an accepted connection
+ * 
+ *  pl: pointer to player struct
+ *  s: pointer to server data struct
+ *  sock: accepted socket
+ *  client: address of the client
+ *
+ *  returns: void
+ *
+ */
+static void init_login_player(player_t *pl, server_data_t *s, int sock, struct sockaddr_in *client) {
+  pl->addr = *client;
+  pl->sock = sock;
+  memset(pl->username, 0, MAX_UNAME_LEN);
+  memset(pl->dreamcast_id, 0, 6);
+  pl->controllers = 1;
+  pl->client_id = (uint32_t)(sock + 0x10000000);
+  pl->menu_id = SERVER_MENU;
+  pl->item_id = 0x00000000;
+  pl->data = s;
+  init_chuchu_stream(&pl->rx);
+  pl->db_job = NULL;
+  pl->rx_paused = 0;
+  pl->nonblock = 0;
+  init_chuchu_tx(pl);
+}
+
+#ifdef IO_URING
+#define LOGIN_URING_ENTRIES 256
+#define LOGIN_URING_BUFS 256
+#define LOGIN_URING_BUF_SIZE 1024
+
+//Op type is stored in the low bits of the SQE user data
+typedef enum {
+  URING_ACCEPT = 0x00,
+  URING_RECV = 0x01,
+  URING_SEND = 0x02,
+  URING_CLOSE = 0x03,
+  URING_TIMEOUT = 0x04,
+  URING_AUTH = 0x05,
+} URING_OP;
+
+#define URING_OP_MASK 0x07
+
+typedef struct {
+  player_t pl;
+  chuchu_uring_t *r;
+  AUTH_PROCESS a_state;
+  //DB_RUN job is processing the stream, counts as pending
+  int in_auth;
+  int pending;
+  int recv_armed;
+  //No new ops, freed when pending drops to 0
+  int closing;
+  //A CLOSE op owns the socket, or it is closed already
+  int close_queued;
+  int s_len;
+  struct __kernel_timespec ts;
+  char hello[128];
+  char s_msg[MAX_PKT_SIZE];
+} login_conn_t;
+
+//Only the ring thread allocates and frees connections
+static chuchu_pool_t conn_pool;
+//Count of the DB worker's eventfd, read by the ring
+static uint64_t auth_events;
+
+static void login_uring_accept(chuchu_uring_t *r, int socket_desc) {
+  struct io_uring_sqe *sqe = chuchu_uring_get_sqe(r);
+
+  if (sqe == NULL)
+    return;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = socket_desc;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = URING_ACCEPT;
+}
+
+/*
+ * Function: login_uring_close
+ * --------------------
+ * stops a connection and queues the close of its socket
+ * unless a linked CLOSE already owns it, the conn struct
+ * is freed when all its ops have completed
+ * 
+ *  r: pointer to ring struct
+ *  conn: pointer to login connection
+ *
+ *  returns: void
+ *
+ */
+static void login_uring_close(chuchu_uring_t *r, login_conn_t *conn) {
+  struct io_uring_sqe *sqe;
+
+  if (conn->closing)
+    return;
+  conn->closing = 1;
+  //Wake up the pending recv
+  if (conn->recv_armed)
+    shutdown(conn->pl.sock, SHUT_RDWR);
+  if (conn->close_queued)
+    return;
+  conn->close_queued = 1;
+  sqe = chuchu_uring_get_sqe(r);
+  if (sqe == NULL) {
+    close(conn->pl.sock);
+    return;
+  }
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = conn->pl.sock;
+  sqe->user_data = (uint64_t)(uintptr_t)conn | URING_CLOSE;
+  conn->pending++;
+}
+
+/*
+ * Function: login_uring_recv
+ * --------------------
+ * queues a recv into a provided buffer, linked
+ * with a timeout like SO_RCVTIMEO
+ * 
+ *  r: pointer to ring struct
+ *  conn: pointer to login connection
+ *
+ *  returns: void
+ *
+ */
+static void login_uring_recv(chuchu_uring_t *r, login_conn_t *conn) {
+  struct io_uring_sqe *sqe;
+
+  //A LINK_TIMEOUT submitted without its recv fails and the recv never times out
+  if (!chuchu_uring_reserve(r, 2)) {
+    login_uring_close(r, conn);
+    return;
+  }
+  sqe = chuchu_uring_get_sqe(r);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->pl.sock;
+  sqe->len = r->buf_size;
+  sqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+  sqe->buf_group = CHUCHU_URING_BGID;
+  sqe->user_data = (uint64_t)(uintptr_t)conn | URING_RECV;
+  conn->pending++;
+  conn->recv_armed = 1;
+
+  sqe = chuchu_uring_get_sqe(r);
+  conn->ts.tv_sec = CHUCHU_LOGIN_TIMEOUT;
+  conn->ts.tv_nsec = 0;
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (uint64_t)(uintptr_t)&conn->ts;
+  sqe->len = 1;
+  sqe->user_data = (uint64_t)(uintptr_t)conn | URING_TIMEOUT;
+  conn->pending++;
+}
+
+/*
+ * Function: login_uring_send
+ * --------------------
+ * queues a send, when close_after is set the close
+ * is linked to the send so both go in one submit.
+ * A failed or short send cancels the linked close,
+ * the socket is then closed on its CLOSE CQE
+ * 
+ *  r: pointer to ring struct
+ *  conn: pointer to login connection
+ *  buf: data to send, must live until the send completes
+ *  size: size of data
+ *  close_after: close the socket after the send
+ *
+ *  returns: void
+ *
+ */
+static void login_uring_send(chuchu_uring_t *r, login_conn_t *conn, char *buf, int size, int close_after) {
+  struct io_uring_sqe *sqe;
+
+  if (!chuchu_uring_reserve(r, close_after ? 2 : 1)) {
+    login_uring_close(r, conn);
+    return;
+  }
+  sqe = chuchu_uring_get_sqe(r);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->pl.sock;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (uint32_t)size;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uint64_t)(uintptr_t)conn | URING_SEND;
+  conn->pending++;
+  if (!close_after)
+    return;
+
+  sqe->flags = IOSQE_IO_LINK;
+  conn->closing = 1;
+  conn->close_queued = 1;
+  sqe = chuchu_uring_get_sqe(r);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = conn->pl.sock;
+  sqe->user_data = (uint64_t)(uintptr_t)conn | URING_CLOSE;
+  conn->pending++;
+}
+
+/*
+ * Function: login_uring_new_conn
+ * --------------------
+ * sets up an accepted connection, queues the
+ * copyright msg and the first recv
+ * 
+ *  r: pointer to ring struct
+ *  s: pointer to server data struct
+ *  sock: accepted socket
+ *
+ *  returns: void
+ *
+ */
+static void login_uring_new_conn(chuchu_uring_t *r, server_data_t *s, int sock) {
+  struct sockaddr_in client;
+  socklen_t c = sizeof(client);
+  login_conn_t *conn;
+  uint16_t write_size;
+
+  memset(&client, 0, sizeof(client));
+  getpeername(sock, (struct sockaddr *)&client, &c);
+  chuchu_info(LOGIN_SERVER,"Connection accepted from %s on socket %d", inet_ntoa(client.sin_addr), sock);
+
+  conn = (login_conn_t *)alloc_chuchu_pool(&conn_pool);
+  if (conn == NULL) {
+    close(sock);
+    return;
+  }
+  memset(conn, 0, sizeof(login_conn_t));
+  init_login_player(&conn->pl, s, sock, &client);
+  init_chuchu_crypt(&conn->pl);
+  //Held by the conn, the auth jobs take their own
+  conn->pl.refs = 1;
+  conn->r = r;
+  conn->a_state = AUTH_STARTED;
+
+  //Send inital message to the client
+  write_size = create_chuchu_copyright_msg(&conn->pl, conn->hello, LOGIN_SERVER);
+  login_uring_send(r, conn, conn->hello, write_size, 0);
+  login_uring_recv(r, conn);
+}
+
+/*
+ * Function: login_uring_wait_auth
+ * --------------------
+ * queues a read of the DB worker's eventfd, it
+ * completes when auth jobs are done
+ * 
+ *  r: pointer to ring struct
+ *  s: pointer to server data struct
+ *
+ *  returns: void
+ *
+ */
+static void login_uring_wait_auth(chuchu_uring_t *r, server_data_t *s) {
+  struct io_uring_sqe *sqe = chuchu_uring_get_sqe(r);
+
+  if (sqe == NULL)
+    return;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = s->db_event_fd;
+  sqe->addr = (uint64_t)(uintptr_t)&auth_events;
+  sqe->len = sizeof(auth_events);
+  sqe->user_data = URING_AUTH;
+}
+
+/*
+ * Function: login_auth_msgs
+ * --------------------
+ * runs the auth process on all complete msgs in the
+ * stream and encrypts the replies into s_msg. It
+ * runs SQL, so it is a DB_RUN job on the DB worker
+ * and the ring keeps serving the other logins
+ * 
+ *  job: DB job of the connection
+ *
+ *  returns: 0 => OK
+ *
+ */
+static int login_auth_msgs(chuchu_db_job_t *job) {
+  login_conn_t *conn = (login_conn_t *)job->pl;
+  player_t *pl = &conn->pl;
+  int pkt_size = 0, write_size = 0, s_len = 0;
+  char *c_msg = NULL;
+
+  while (conn->a_state != AUTH_BROKEN) {
+    if ((pkt_size = next_chuchu_msg(&pl->rx, &pl->client_cipher, &c_msg)) <= 0) {
+      if (pkt_size < 0)
+	conn->a_state = AUTH_BROKEN;
+      break;
+    }
+    write_size = auth_process(pl, &conn->s_msg[s_len], c_msg, &conn->a_state);
+    if (write_size > 0) {
+      crypt_chuchu_msg(&pl->server_cipher, &conn->s_msg[s_len], (long unsigned int)write_size);
+      s_len += write_size;
+    }
+    if (conn->a_state == AUTH_BROKEN || (write_size < 0 && conn->a_state != AUTH_DONE)) {
+      chuchu_error(LOGIN_SERVER,"Client with socket %d is not following protocol - Disconnecting", pl->sock);
+      conn->a_state = AUTH_BROKEN;
+      break;
+    }
+    if (conn->a_state == AUTH_DONE) {
+      chuchu_info(LOGIN_SERVER,"Done, disconnecting socket %d", pl->sock);
+      break;
+    }
+  }
+  conn->s_len = s_len;
+  return 0;
+}
+
+/*
+ * Function: login_uring_reply
+ * --------------------
+ * sends the replies of the auth process, then
+ * waits for more msgs or closes the connection
+ * 
+ *  r: pointer to ring struct
+ *  conn: pointer to login connection
+ *
+ *  returns: void
+ *
+ */
+static void login_uring_reply(chuchu_uring_t *r, login_conn_t *conn) {
+  if (conn->s_len > 0)
+    login_uring_send(r, conn, conn->s_msg, conn->s_len, conn->a_state == AUTH_DONE || conn->a_state == AUTH_BROKEN);
+  else if (conn->a_state == AUTH_DONE || conn->a_state == AUTH_BROKEN)
+    login_uring_close(r, conn);
+  else
+    login_uring_recv(r, conn);
+}
+
+/*
+ * Function: login_uring_auth_done
+ * --------------------
+ * done callback of the auth job, runs on the ring
+ * 
+ *  job: DB job of the connection
+ *
+ *  returns: 0 => OK
+ *
+ */
+static int login_uring_auth_done(chuchu_db_job_t *job) {
+  login_conn_t *conn = (login_conn_t *)job->pl;
+
+  conn->in_auth = 0;
+  conn->pending--;
+  if (!conn->closing)
+    login_uring_reply(conn->r, conn);
+  return 0;
+}
+
+/*
+ * Function: login_uring_read
+ * --------------------
+ * handles a completed recv, appends the data to the
+ * stream and hands it to the DB worker for the auth
+ * process, no recv is armed until the replies are out
+ * 
+ *  r: pointer to ring struct
+ *  conn: pointer to login connection
+ *  buf: provided buffer with the received data
+ *  read_size: size of received data
+ *
+ *  returns: void
+ *
+ */
+static void login_uring_read(chuchu_uring_t *r, login_conn_t *conn, char *buf, int read_size) {
+  player_t *pl = &conn->pl;
+  chuchu_db_job_t *job;
+
+  //Clear the previous replies, the send has completed
+  memset(conn->s_msg, 0, (size_t)conn->s_len + 4);
+  conn->s_len = 0;
+  if (write_chuchu_stream(&pl->rx, buf, (size_t)read_size) < 0) {
+    conn->a_state = AUTH_BROKEN;
+    login_uring_reply(r, conn);
+    return;
+  }
+  if ((job = new_chuchu_db_job(pl, DB_RUN, login_uring_auth_done)) == NULL) {
+    login_uring_close(r, conn);
+    return;
+  }
+  job->run = login_auth_msgs;
+  conn->in_auth = 1;
+  conn->pending++;
+  post_chuchu_db_job((server_data_t *)pl->data, job);
+}
+
+/*
+ * Function: login_uring_loop
+ * --------------------
+ * io_uring login server: multishot accept, recv into provided
+ * buffers and the last reply linked with the close
+ * 
+ *  s: pointer to server data struct
+ *  socket_desc: listen socket
+ *
+ *  returns: -1 => io_uring not available, use threads
+ *            1 => FAIL
+ *
+ */
+static int login_uring_loop(server_data_t *s, int socket_desc) {
+  chuchu_uring_t ring;
+  struct io_uring_cqe *cqe;
+  chuchu_db_job_t *job, *next;
+  login_conn_t *conn;
+  uint64_t user_data;
+  uint32_t flags;
+  uint16_t bid;
+  int res, event_fd;
+
+  if (!init_chuchu_pool(&conn_pool, "login connections", sizeof(login_conn_t), CHUCHU_POOL_SLAB, 0) ||
+      !chuchu_uring_init(&ring, LOGIN_URING_ENTRIES))
+    return -1;
+  if (!chuchu_uring_setup_bufs(&ring, LOGIN_URING_BUFS, LOGIN_URING_BUF_SIZE)) {
+    chuchu_uring_exit(&ring);
+    return -1;
+  }
+  //The auth process runs SQL, keep it off the ring
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0 || !start_chuchu_db_worker(s, event_fd)) {
+    perror("start_chuchu_db_worker");
+    chuchu_uring_exit(&ring);
+    return 1;
+  }
+  chuchu_info(LOGIN_SERVER,"Using io_uring");
+  login_uring_accept(&ring, socket_desc);
+  login_uring_wait_auth(&ring, s);
+
+  for (;;) {
+    if (chuchu_uring_submit_and_wait(&ring) < 0) {
+      perror("io_uring_enter");
+      break;
+    }
+    while ((cqe = chuchu_uring_peek_cqe(&ring)) != NULL) {
+      user_data = cqe->user_data;
+      res = cqe->res;
+      flags = cqe->flags;
+      chuchu_uring_cqe_seen(&ring);
+
+      conn = (login_conn_t *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+      switch (user_data & URING_OP_MASK) {
+      case URING_ACCEPT:
+	if (!(flags & IORING_CQE_F_MORE))
+	  login_uring_accept(&ring, socket_desc);
+	if (res < 0)
+	  chuchu_error(LOGIN_SERVER,"Accept failed: %s", strerror(-res));
+	else
+	  login_uring_new_conn(&ring, s, res);
+	continue;
+      case URING_AUTH:
+	if (res < 0)
+	  chuchu_error(LOGIN_SERVER,"DB event read failed: %s", strerror(-res));
+	login_uring_wait_auth(&ring, s);
+	for (job = get_chuchu_db_done(s); job; job = next) {
+	  next = job->next;
+	  conn = (login_conn_t *)job->pl;
+	  job->done(job);
+	  free_chuchu_db_job(job);
+	  if (conn->closing && conn->pending == 0) {
+	    free_chuchu_tx(&conn->pl);
+	    free_chuchu_pool(&conn_pool, conn);
+	  }
+	}
+	continue;
+      case URING_RECV:
+	conn->pending--;
+	conn->recv_armed = 0;
+	if (res > 0) {
+	  bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+	  if (!conn->closing)
+	    login_uring_read(&ring, conn, chuchu_uring_buf(&ring, bid), res);
+	  chuchu_uring_recycle_buf(&ring, bid);
+	} else if (res == -ENOBUFS) {
+	  if (!conn->closing)
+	    login_uring_recv(&ring, conn);
+	} else {
+	  if (res == 0)
+	    chuchu_info(LOGIN_SERVER,"Client with socket %d [%s] disconnected", conn->pl.sock, inet_ntoa(conn->pl.addr.sin_addr));
+	  else if (res == -ECANCELED)
+	    chuchu_info(LOGIN_SERVER,"Client with socket %d timed out", conn->pl.sock);
+	  else if (!conn->closing)
+	    chuchu_info(LOGIN_SERVER,"recv failed");
+	  login_uring_close(&ring, conn);
+	}
+	break;
+      case URING_SEND:
+	conn->pending--;
+	if (res < 0) {
+	  chuchu_info(LOGIN_SERVER,"send failed");
+	  login_uring_close(&ring, conn);
+	} else if (!conn->closing && !conn->recv_armed && !conn->in_auth)
+	  login_uring_recv(&ring, conn);
+	break;
+      case URING_CLOSE:
+	conn->pending--;
+	//The send it was linked to failed or was short
+	if (res == -ECANCELED)
+	  close(conn->pl.sock);
+	break;
+      case URING_TIMEOUT:
+	conn->pending--;
+	break;
+      }
+      if (conn->closing && conn->pending == 0) {
+	free_chuchu_tx(&conn->pl);
+	free_chuchu_pool(&conn_pool, conn);
+      }
+    }
+  }
+  chuchu_uring_exit(&ring);
+  return 1;
+}
+#endif
+
 int main(int argc , char *argv[]) {
   int socket_desc , client_sock , c, optval;
   struct sockaddr_in server , client;
@@ -157,6 +683,12 @@ int main(int argc , char *argv[]) {
   //Load chuch config
   if (!get_chuchu_config(&s_data, argc >= 2 ? argv[1] : "chuchu.cfg"))
     return 0;
+
+  //Upgrade the DB schema if needed
+  if (!migrate_chuchu_db(s_data.chu_db_path))
+    return 1;
+  if (!start_chuchu_db_maintenance(&s_data))
+    return 1;
   
   socket_desc = socket(AF_INET , SOCK_STREAM , 0);
   if (socket_desc == -1) {
@@ -177,9 +709,15 @@ int main(int argc , char *argv[]) {
   }
   chuchu_info(LOGIN_SERVER,"Bind done");
   
-  listen(socket_desc , 3);
+  listen(socket_desc , SOMAXCONN);
 
   chuchu_info(LOGIN_SERVER,"Waiting for incoming connections...");
+#ifdef IO_URING
+  int rc = login_uring_loop(&s_data, socket_desc);
+  if (rc >= 0)
+    return rc;
+  chuchu_info(LOGIN_SERVER,"io_uring not available, using threads");
+#endif
   
   c = sizeof(struct sockaddr_in);
   pthread_t thread_id;
@@ -187,16 +725,12 @@ int main(int argc , char *argv[]) {
   while( (client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c)) ) {
     chuchu_info(LOGIN_SERVER,"Connection accepted from %s on socket %d", inet_ntoa(client.sin_addr), client_sock);
     //Store player data
-    player_t *pl = (player_t *)malloc(sizeof(player_t));
-    pl->addr = client;
-    pl->sock = client_sock;
-    memset(pl->username, 0, MAX_UNAME_LEN);
-    memset(pl->dreamcast_id, 0, 6);
-    pl->controllers = 1;
-    pl->client_id = (uint32_t)(client_sock + 0x10000000);
-    pl->menu_id = SERVER_MENU;
-    pl->item_id = 0x00000000;
-    pl->data = &s_data;
+    player_t *pl = (player_t *)alloc_chuchu_pool(&s_data.player_pool);
+    if (pl == NULL) {
+      close(client_sock);
+      continue;
+    }
+    init_login_player(pl, &s_data, client_sock, &client);
 
     if( pthread_create( &thread_id , NULL ,  chuchu_client_handler , (void*)pl) < 0) {
       perror("Could not create thread");
@@ -230,9 +764,8 @@ void *chuchu_client_handler(void *data) {
   int sock = pl->sock; 
   AUTH_PROCESS a_state = AUTH_NOT_STARTED;
   ssize_t read_size=0, write_size=0;
-  uint16_t index=0, n_index=0;
-  char c_msg[MAX_PKT_SIZE], s_msg[MAX_PKT_SIZE];
-  memset(c_msg, 0, sizeof(c_msg));
+  int pkt_size=0;
+  char *c_msg = NULL, s_msg[MAX_PKT_SIZE];
   memset(s_msg, 0, sizeof(s_msg));
 
   struct timeval tv;
@@ -246,48 +779,41 @@ void *chuchu_client_handler(void *data) {
   //Send inital message to the client
   write_size = create_chuchu_copyright_msg(pl,s_msg,LOGIN_SERVER);
   if (write_size != 0) {
-    send_chuchu_msg(sock, s_msg , (int)write_size);
+    send_chuchu_msg(pl, s_msg , (int)write_size);
     memset(s_msg, 0, sizeof(s_msg));
   } else {
-    free(pl);
+    put_chuchu_player(pl);
     return 0;
   }
   
   a_state = AUTH_STARTED;
 
-  while( (read_size = recv(sock , c_msg , sizeof(c_msg) , 0)) > 0 ) {
-    decrypt_chuchu_msg(&pl->client_cipher, c_msg, (long unsigned int)read_size);
-            
-    index = 0;
-    n_index = 0;
-    while (read_size > 0) {
-      if ((n_index = parse_chuchu_msg(&c_msg[index], (int)read_size)) > 0) {
-	write_size = auth_process(pl, s_msg, c_msg, &a_state);
-	if (write_size > 0) {
-	  send_chuchu_crypt_msg(sock, &pl->server_cipher, s_msg, (int)write_size);
-	}
-	if (a_state == AUTH_BROKEN || (write_size < 0 && a_state != AUTH_DONE)) {
-	  chuchu_error(LOGIN_SERVER,"Client with socket %d is not following protocol - Disconnecting", sock);
-	  close(sock);
-	  free(pl);
-	  return 0;
-	}
-	if (a_state == AUTH_DONE) {
-	  chuchu_info(LOGIN_SERVER,"Done, disconnecting socket %d", sock);
-	  close(sock);
-	  free(pl);
-	  return 0;
-	}
-	//Decrease size
-	read_size -= n_index;
-	//Update pointer in recv buff
-	index = (uint16_t)(index + n_index);
-      } else {
-	break;
+  while( (read_size = recv_chuchu_stream(sock, &pl->rx)) > 0 ) {
+    while ((pkt_size = next_chuchu_msg(&pl->rx, &pl->client_cipher, &c_msg)) > 0) {
+      write_size = auth_process(pl, s_msg, c_msg, &a_state);
+      if (write_size > 0) {
+	send_chuchu_crypt_msg(pl, s_msg, (int)write_size);
+      }
+      if (a_state == AUTH_BROKEN || (write_size < 0 && a_state != AUTH_DONE)) {
+	chuchu_error(LOGIN_SERVER,"Client with socket %d is not following protocol - Disconnecting", sock);
+	close(sock);
+	put_chuchu_player(pl);
+	return 0;
+      }
+      if (a_state == AUTH_DONE) {
+	chuchu_info(LOGIN_SERVER,"Done, disconnecting socket %d", sock);
+	close(sock);
+	put_chuchu_player(pl);
+	return 0;
       }
       memset(s_msg, 0, sizeof(s_msg)); 
     }
-    memset(c_msg, 0, sizeof(c_msg));
+    if (pkt_size < 0) {
+      chuchu_error(LOGIN_SERVER,"Client with socket %d is not following protocol - Disconnecting", sock);
+      close(sock);
+      put_chuchu_player(pl);
+      return 0;
+    }
   }
   
   if(read_size == 0) {
@@ -298,6 +824,6 @@ void *chuchu_client_handler(void *data) {
     close(sock);
   }
   
-  free(pl);
+  put_chuchu_player(pl);
   return 0;
 } 
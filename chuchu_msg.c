@@ -20,9 +20,174 @@
  * ChuChu MSG functions for Dreamcast
  */
 
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
 #include "chuchu_common.h"
 #include "chuchu_sql.h"
 
+/*
+ * NEWS CACHE
+ *
+ * The info file is read once into a msg body and read again when
+ * inotify reports a change, so it can be edited while running.
+ * A new body is swapped in under news_lock, readers only copy it.
+ */
+
+typedef struct {
+  uint32_t size;
+  char body[];
+} chuchu_news_t;
+
+static chuchu_news_t *news = NULL;
+static pthread_mutex_t news_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Function: load_chuchu_news
+ * --------------------
+ *
+ * Reads the info file into a new body and swaps it in,
+ * a missing file gives an empty page
+ * 
+ *  *f_name: path of the info file
+ *
+ *  returns: void
+ *
+ */
+static void load_chuchu_news(const char *f_name) {
+  chuchu_news_t *n, *old;
+  FILE *file = NULL;
+  long fileLen = 0;
+
+  file = fopen(f_name, "rb");
+  if (file) {
+    fseek(file, 0, SEEK_END);
+    fileLen = ftell(file);
+    fseek(file, 0, SEEK_SET);
+  } else {
+    chuchu_error(SERVER, "Unable to open file %s, default page", f_name);
+  }
+
+  //Room for the header and padding
+  if (fileLen < 0 || fileLen > (MAX_PKT_SIZE-8)) {
+    chuchu_error(SERVER, "File size greater then buffer");
+    fileLen = 0;
+  }
+  n = (chuchu_news_t *)calloc(1, sizeof(chuchu_news_t) + (size_t)fileLen);
+  if (n == NULL) {
+    if (file)
+      fclose(file);
+    return;
+  }
+  if (file) {
+    //Cut short by a writer, keep the old one until its next event
+    if (fileLen > 0 && fread(n->body, (size_t)fileLen, 1, file) != 1) {
+      chuchu_error(SERVER, "Could not read %s", f_name);
+      fclose(file);
+      free(n);
+      return;
+    }
+    fclose(file);
+  }
+  n->size = (uint32_t)fileLen;
+
+  pthread_mutex_lock(&news_lock);
+  old = news;
+  news = n;
+  pthread_mutex_unlock(&news_lock);
+  free(old);
+  chuchu_info(SERVER, "Loaded %u bytes of news from %s", n->size, f_name);
+}
+
+/*
+ * Function: chuchu_news_watch
+ * --------------------
+ *
+ * Thread that reloads the info file when inotify
+ * reports it was written, moved or deleted. The dir
+ * is watched since editors replace the file.
+ * 
+ *  *data: ptr to server data struct
+ *
+ *  returns: NULL
+ *
+ */
+static void *chuchu_news_watch(void *data) {
+  server_data_t *s = (server_data_t *)data;
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  char dir[256];
+  const char *name;
+  const struct inotify_event *ev;
+  ssize_t len, i;
+  int fd, changed;
+
+  strlcpy(dir, s->chu_info_path, sizeof(dir));
+  name = strrchr(s->chu_info_path, '/');
+  if (name == NULL) {
+    strlcpy(dir, ".", sizeof(dir));
+    name = s->chu_info_path;
+  } else {
+    dir[name - s->chu_info_path] = '\0';
+    if (dir[0] == '\0')
+      strlcpy(dir, "/", sizeof(dir));
+    name++;
+  }
+
+  fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+    chuchu_error(SERVER, "Can't watch %s for news, no reload: %s", dir, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  for (;;) {
+    len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+      if (len < 0 && errno == EINTR)
+	continue;
+      chuchu_error(SERVER, "News watch failed: %s", strerror(errno));
+      break;
+    }
+    //Reload once per batch of events
+    changed = 0;
+    for (i = 0; i < len; i += (ssize_t)(sizeof(struct inotify_event) + ev->len)) {
+      ev = (const struct inotify_event *)&buf[i];
+      if (ev->len > 0 && strcmp(ev->name, name) == 0)
+	changed = 1;
+    }
+    if (changed)
+      load_chuchu_news(s->chu_info_path);
+  }
+  close(fd);
+  return NULL;
+}
+
+/*
+ * Function: start_chuchu_news
+ * --------------------
+ *
+ * Loads the info file and starts the thread
+ * that reloads it on changes
+ * 
+ *  *s: ptr to server data struct
+ *
+ *  returns: 
+ *           1 => OK
+ *           0 => FAILED
+ *        
+ */
+int start_chuchu_news(server_data_t *s) {
+  pthread_t thread_id;
+
+  load_chuchu_news(s->chu_info_path);
+  if (pthread_create(&thread_id, NULL, chuchu_news_watch, s) != 0)
+    return 0;
+  pthread_detach(thread_id);
+  return 1;
+}
+
 /*
  * Function:  create_chuchu_notify_msg
  * --------------------
@@ -184,11 +349,10 @@ uint16_t create_chuchu_chat_msg(player_t *pl, char* buf, char* msg) {
   uint16_t pkt_size = 0, str_len = 0;
   uint32_t menu_id = char_to_uint32(&buf[4]);
   uint32_t item_id = char_to_uint32(&buf[8]);
-  int i=0;
   char tmp_chat_msg[1024];
   char snd_username[MAX_UNAME_LEN];
   server_data_t *s = (server_data_t*)pl->data;
-  int max_client = s->m_cli;
+  player_t *to;
 
   memset(snd_username, 0, sizeof(snd_username));
   memset(tmp_chat_msg, 0, sizeof(tmp_chat_msg));
@@ -219,30 +383,30 @@ uint16_t create_chuchu_chat_msg(player_t *pl, char* buf, char* msg) {
     //Create header
     create_chuchu_hdr(msg, 0x06, 0x00, pkt_size);
     //Send to all
-    for(i=0;i<max_client;i++)
-      if(s->p_l[i])
-	send_chuchu_crypt_msg(s->p_l[i]->sock, &s->p_l[i]->server_cipher, msg, pkt_size);
+    send_chuchu_bcast(s, BCAST_AUTHORIZED, NULL, msg, pkt_size);
     
     return 0;
   }
   
   //Check after specfic user, whisper
-  for(i=0;i<max_client;i++) {
-    if(s->p_l[i]) {
-      if (s->p_l[i]->menu_id == menu_id && s->p_l[i]->client_id == item_id) {
-	//Create whisper to user msg
-	snprintf(tmp_chat_msg, sizeof(tmp_chat_msg), "Message from '%s'\n\n", snd_username);
-	strncat(tmp_chat_msg, &buf[12], str_len);
-	strcpy(&msg[4], tmp_chat_msg);
-	pkt_size = (uint16_t)(4 + strlen(tmp_chat_msg));
-	//Padding
-	pkt_size = (uint16_t)(pkt_size + 4);
-	create_chuchu_hdr(msg, 0x1a, 0x00, pkt_size);  
-	send_chuchu_crypt_msg(s->p_l[i]->sock, &s->p_l[i]->server_cipher, msg, pkt_size);
-	return 0;
-      }
-    }
-  }
+  to = get_chuchu_player(s, item_id);
+  if (to == NULL)
+    return 0;
+  lock_registry(s);
+  if (to->menu_id != menu_id)
+    to = NULL;
+  unlock_registry(s);
+  if (to == NULL)
+    return 0;
+  //Create whisper to user msg
+  snprintf(tmp_chat_msg, sizeof(tmp_chat_msg), "Message from '%s'\n\n", snd_username);
+  strncat(tmp_chat_msg, &buf[12], str_len);
+  strcpy(&msg[4], tmp_chat_msg);
+  pkt_size = (uint16_t)(4 + strlen(tmp_chat_msg));
+  //Padding
+  pkt_size = (uint16_t)(pkt_size + 4);
+  create_chuchu_hdr(msg, 0x1a, 0x00, pkt_size);  
+  queue_chuchu_crypt_msg(to, msg, pkt_size);
   
   return 0;
 }
@@ -253,7 +417,8 @@ uint16_t create_chuchu_chat_msg(player_t *pl, char* buf, char* msg) {
  * --------------------
  * 0x0E - Starts the actual game
  * 
- * Used to tell the DC clients that the game is starting
+ * Used to tell the DC clients that the game is starting,
+ * game room locked
  *
  *  *gr:  pointer to game room struct
  *
@@ -320,13 +485,14 @@ uint16_t create_chuchu_start_game_msg(game_room_t *gr) {
   create_chuchu_hdr(msg, 0x0e, (uint8_t)entries, pkt_size);
   
   //Send the start pkt to all in game room
+  send_chuchu_bcast(NULL, BCAST_GAME_ROOM, gr, msg, pkt_size);
   for(i=0;i<max_player_slots;i++) {
     if(gr->player_slots[i]) {
-      send_chuchu_crypt_msg(gr->player_slots[i]->sock, &gr->player_slots[i]->server_cipher, msg, pkt_size);
       //Set start_game value to 0, will be read in delete_player during disconnect
       gr->player_slots[i]->store_ranking = 0;
       //Remove user from game room slot
       gr->taken_seats--;
+      __atomic_store_n(&gr->player_slots[i]->room, NULL, __ATOMIC_RELAXED);
       gr->player_slots[i] = NULL;
     }
   }
@@ -354,45 +520,41 @@ uint16_t create_chuchu_add_info(server_data_t *s, char* msg, uint32_t menu_id, u
   uint16_t pkt_size = 12;
   game_room_t *gr = NULL;
   char box_text[128];
-  int i;
-  int max_puzzles = s->m_puzz;
-  int max_clients = s->m_cli;
+  puzzle_t *puz;
+  player_t *pl;
   memset(box_text, 0, sizeof(box_text));
 
   //View stat on a user, just check item_id
-  for (i=0;i<max_clients;i++) {
-    if (s->p_l[i] != NULL) {
-      if (s->p_l[i]->client_id == item_id) {
-	sprintf(box_text,
-		"Rounds\nWon: %d\nLost: %d\nTotal: %d\nControllers: %d",
-		(s->p_l[i]->won_rnds + s->p_l[i]->db_won_rnds),
-		(s->p_l[i]->lost_rnds + s->p_l[i]->db_lost_rnds),
-		(s->p_l[i]->total_rnds + s->p_l[i]->db_total_rnds),
-		 s->p_l[i]->controllers
-	  );
-	strcpy(&msg[pkt_size], box_text);
-	pkt_size = (uint16_t)(pkt_size + strlen(box_text));
-	//Padding
-	pkt_size = (uint16_t)(pkt_size + 4);
-	create_chuchu_hdr(msg, 0x11, 0x00, pkt_size); 
-	return pkt_size;
-      }
-    }
+  pl = get_chuchu_player(s, item_id);
+  if (pl != NULL) {
+    sprintf(box_text,
+	    "Rounds\nWon: %d\nLost: %d\nTotal: %d\nControllers: %d",
+	    (pl->won_rnds + pl->db_won_rnds),
+	    (pl->lost_rnds + pl->db_lost_rnds),
+	    (pl->total_rnds + pl->db_total_rnds),
+	    pl->controllers
+      );
+    strcpy(&msg[pkt_size], box_text);
+    pkt_size = (uint16_t)(pkt_size + strlen(box_text));
+    //Padding
+    pkt_size = (uint16_t)(pkt_size + 4);
+    create_chuchu_hdr(msg, 0x11, 0x00, pkt_size); 
+    return pkt_size;
   }
   //Else check the rest
   switch(menu_id) {
   case GAME_MENU:
-    for(i=0;i<s->m_rooms;i++)
-      if(s->g_l[i]) {
-	if (s->g_l[i]->item_id == item_id) {
-	  gr = s->g_l[i];
-	  break;
-	}
-      }
+    lock_rooms(s, 0);
+    gr = get_room_from_item_id(s, item_id);
     //If not a game room return 0
-    if (gr == NULL)
+    if (gr == NULL) {
+      unlock_rooms(s);
       return 0;
+    }
+    lock_room(gr);
     sprintf(box_text, "%d of 4\nusers in the room\nCreated by\n%s", gr->taken_seats,gr->creator);
+    unlock_room(gr);
+    unlock_rooms(s);
     strcpy(&msg[pkt_size], box_text);
     break;      
   case PUZZLE_ZONE_MENU:
@@ -400,15 +562,13 @@ uint16_t create_chuchu_add_info(server_data_t *s, char* msg, uint32_t menu_id, u
     strcpy(&msg[pkt_size], box_text);
     break;
   case PUZZLE_ZONE_FILE:
-    for (i=0;i<max_puzzles;i++) {
-      if (s->puzz_l[i] != NULL) {
-	if (s->puzz_l[i]->id == item_id) {
-	  sprintf(box_text, "Created by\n%s\nDownloaded:\n%d", s->puzz_l[i]->u_name, s->puzz_l[i]->dl);
-	  strcpy(&msg[pkt_size], box_text);
-	  break;
-	}
-      }
+    lock_puzzles(s);
+    puz = get_chuchu_puzzle(s, item_id);
+    if (puz != NULL) {
+      sprintf(box_text, "Created by\n%s\nDownloaded:\n%d", puz->u_name, puz->dl);
+      strcpy(&msg[pkt_size], box_text);
     }
+    unlock_puzzles(s);
     break;
   default:
     //Check if 
@@ -437,47 +597,34 @@ uint16_t create_chuchu_add_info(server_data_t *s, char* msg, uint32_t menu_id, u
  * 
  *  *msg: pointer to outgoing client msg  
  *  *s:  pointer to server data struct
- *  info_flag: Which info should be displayed, just added info or ranking in this server 
+ *  info_flag: Which info should be displayed, only NEWS. The top ranking
+ *             needs the DB, see create_chuchu_menu_msg
  *
  *  returns: packet size
  */
 uint16_t create_chuchu_info_msg(char* msg, server_data_t *s, int info_flag) {
-  FILE *file = NULL;
-  const char* f_name = s->chu_info_path;
   uint16_t pkt_size = 0;
   uint32_t fileLen = 0;
     
   switch(info_flag) {
   case NEWS:
-    
-    file = fopen(f_name, "rb");
-    if (!file) {
-      chuchu_error(SERVER, "Unable to open file %s, default page", f_name);
-      pkt_size = 4;
-      return pkt_size;
-    }
-	
-    fseek(file, 0, SEEK_END);
-    fileLen = (uint32_t)ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    if (fileLen > (MAX_PKT_SIZE-4)) {
-      chuchu_error(SERVER, "File size greater then buffer");
+    //Loaded by start_chuchu_news
+    pthread_mutex_lock(&news_lock);
+    if (news == NULL) {
+      pthread_mutex_unlock(&news_lock);
+      chuchu_error(SERVER, "No news loaded from %s", s->chu_info_path);
       return 0;
     }
-
-    fread(&msg[4], fileLen, 1, file);
-    fclose(file);
+    fileLen = news->size;
+    memcpy(&msg[4], news->body, fileLen);
+    pthread_mutex_unlock(&news_lock);
+    memset(&msg[4 + fileLen], 0, 4);
 
     pkt_size = (uint16_t)(4 + fileLen);
     break;
-  case RANKING:
-    pkt_size = (uint16_t)read_top_ranking_from_chuchu_db(&msg[4], s->chu_db_path);
-    if (pkt_size == 0) {
-      chuchu_error(SERVER, "Could not generate top ranking msg");
-      return 0;
-    }
-    pkt_size = (uint16_t)(pkt_size + 4);
+  default:
+    chuchu_error(SERVER, "No info msg for flag %d", info_flag);
+    return 0;
   }
   //Padding
   pkt_size = (uint16_t)(pkt_size + 4);  
@@ -13,6 +13,7 @@ uint16_t create_chuchu_chat_msg(player_t *pl, char* buf, char* msg);
 uint16_t create_chuchu_start_game_msg(game_room_t *gr);
 uint16_t create_chuchu_add_info(server_data_t *s, char* msg, uint32_t menu_id, uint32_t item_id);
 uint16_t create_chuchu_info_msg(char* msg,server_data_t *s, int info_flag);
+int start_chuchu_news(server_data_t *s);
 uint16_t create_chuchu_login_msg(char *msg, uint8_t flag);
 uint16_t create_chuchu_redirect_msg(uint32_t ip, uint16_t port, char * msg);
 
@@ -21,9 +21,24 @@
  */
 
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sqlite3.h>
-#include <assert.h>
 #include "chuchu_common.h"
+#include "chuchu_sql.h"
+
+static uint64_t chuchu_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+//Set by start_chuchu_db_maintenance
+static int db_synchronous = 1;
+static int db_autocheckpoint = 1000;
 
 /*
  * Function: open_chuchu_db
@@ -38,18 +53,252 @@
  */
 sqlite3* open_chuchu_db(const char* db_path) {
    sqlite3 *db;
+   char sql[128];
    int rc=0;
    rc = sqlite3_open(db_path, &db);
    if (rc != SQLITE_OK) {
      chuchu_error(SERVER, "Can't open database: %s", sqlite3_errmsg(db));
+     sqlite3_close(db);
      return NULL;
    }
 
    sqlite3_busy_timeout(db, 1000);
+   //WAL is checkpointed by the maintenance thread, not on commit
+   snprintf(sql, sizeof(sql), "PRAGMA synchronous = %d; PRAGMA wal_autocheckpoint = %d; PRAGMA journal_size_limit = %d;",
+	    db_synchronous, db_autocheckpoint, CHUCHU_WAL_SIZE_LIMIT);
+   sqlite3_exec(db, sql, NULL, NULL, NULL);
    
    return db;
 }
 
+/*
+ * MIGRATIONS
+ *
+ * Schema changes after createdb.sql, PRAGMA user_version is the
+ * nr of steps already done. Only append new steps, never edit one
+ * that has shipped.
+ */
+
+static const char *chuchu_migrations[] = {
+  //1: Indexes for the login, ranking and puzzle name lookups.
+  //Old code updated every row of a duplicated player, so the
+  //copies are equal and the oldest one is kept.
+  "DELETE FROM PLAYER_DATA WHERE ID NOT IN (SELECT MIN(ID) FROM PLAYER_DATA GROUP BY USERNAME, DC_ID);"
+  "CREATE UNIQUE INDEX IF NOT EXISTS PLAYER_DATA_NAME_IDX ON PLAYER_DATA(USERNAME, DC_ID);"
+  "CREATE INDEX IF NOT EXISTS PLAYER_DATA_DC_ID_IDX ON PLAYER_DATA(DC_ID);"
+  "CREATE INDEX IF NOT EXISTS PLAYER_DATA_WON_IDX ON PLAYER_DATA(WON_RNDS DESC, USERNAME, LOST_RNDS, TOTAL_RNDS);"
+  "CREATE INDEX IF NOT EXISTS PUZZLE_DATA_NAME_IDX ON PUZZLE_DATA(PUZZLE_NAME);",
+};
+
+#define CHUCHU_DB_VERSION ((int)(sizeof(chuchu_migrations) / sizeof(chuchu_migrations[0])))
+
+static int get_chuchu_db_pragma(sqlite3 *db, const char *pragma) {
+  sqlite3_stmt *pStmt;
+  int value = -1;
+
+  if (sqlite3_prepare_v2(db, pragma, -1, &pStmt, 0) != SQLITE_OK)
+    return -1;
+  if (sqlite3_step(pStmt) == SQLITE_ROW)
+    value = sqlite3_column_int(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return value;
+}
+
+/*
+ * Function: migrate_chuchu_db
+ * --------------------
+ *
+ * Brings the DB schema up to date, run by both servers
+ * at startup. Each step runs in its own transaction, the
+ * version is read again inside it in case the other
+ * server is migrating the same DB. Then switches the
+ * file to incremental auto vacuum and WAL journaling,
+ * both are stored in the DB and done only once.
+ * 
+ *  *db_path: full path and filename to the DB
+ *
+ *  returns: 1 => OK
+ *           0 => FAILED
+ *
+ */
+int migrate_chuchu_db(const char* db_path) {
+  sqlite3 *db;
+  char *err = NULL;
+  char sql[64];
+  int version, rc = 1;
+
+  if ((db = open_chuchu_db(db_path)) == NULL)
+    return 0;
+  //Startup only, give the other server time to finish
+  sqlite3_busy_timeout(db, 30000);
+
+  for (;;) {
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, &err) != SQLITE_OK)
+      break;
+    version = get_chuchu_db_pragma(db, "PRAGMA user_version;");
+    if (version < 0 || version >= CHUCHU_DB_VERSION) {
+      sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+      if (version > CHUCHU_DB_VERSION)
+	chuchu_error(SERVER, "DB version %d is newer than this server (%d)", version, CHUCHU_DB_VERSION);
+      else if (version < 0)
+	rc = 0;
+      break;
+    }
+    chuchu_info(SERVER, "Migrating DB from version %d to %d", version, version + 1);
+    snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;", version + 1);
+    if (sqlite3_exec(db, chuchu_migrations[version], NULL, NULL, &err) != SQLITE_OK ||
+	sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK ||
+	sqlite3_exec(db, "COMMIT;", NULL, NULL, &err) != SQLITE_OK) {
+      sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+      break;
+    }
+  }
+  if (err) {
+    chuchu_error(SERVER, "DB migration failed: %s", err);
+    sqlite3_free(err);
+    sqlite3_close(db);
+    return 0;
+  }
+
+  //Needs a VACUUM to rebuild the file, outside of a transaction
+  if (rc && get_chuchu_db_pragma(db, "PRAGMA auto_vacuum;") != 2) {
+    chuchu_info(SERVER, "Enabling incremental vacuum, rebuilding DB");
+    if (sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;", NULL, NULL, &err) != SQLITE_OK) {
+      chuchu_error(SERVER, "DB vacuum failed: %s", err);
+      sqlite3_free(err);
+      err = NULL;
+    }
+  }
+  if (rc && sqlite3_exec(db, "PRAGMA journal_mode = WAL;", NULL, NULL, &err) != SQLITE_OK) {
+    chuchu_error(SERVER, "Could not enable WAL: %s", err);
+    sqlite3_free(err);
+    rc = 0;
+  }
+  sqlite3_close(db);
+  return rc;
+}
+
+/*
+ * CONNECTIONS
+ *
+ * Every thread that runs SQL keeps its own connection open
+ * with all statements prepared, they are reset and rebound
+ * per call. The connection is closed when the thread exits.
+ */
+
+static const char *chuchu_sql[CHUCHU_STMT_COUNT] = {
+  [STMT_PLAYER_BY_NAME] = "SELECT COUNT(*) from PLAYER_DATA WHERE USERNAME = ?;",
+  [STMT_PLAYER_BY_DC_ID] = "SELECT COUNT(*) from PLAYER_DATA WHERE DC_ID = hex(?);",
+  [STMT_USERNAME_TAKEN] = "SELECT COUNT(*) from PLAYER_DATA WHERE USERNAME = trim(?);",
+  [STMT_VALIDATE_LOGIN] = "SELECT COUNT(*) from PLAYER_DATA WHERE USERNAME = trim(?) AND PASSWORD = trim(?) AND DC_ID = hex(?);",
+  [STMT_WRITE_PLAYER] = "INSERT INTO PLAYER_DATA(ID,DC_ID,USERNAME,PASSWORD,WON_RNDS,LOST_RNDS,TOTAL_RNDS) VALUES(NULL, hex(?), trim(?), trim(?), 0, 0, 0);",
+  [STMT_LOAD_PUZZLES] = "SELECT ID,PUZZLE_NAME,CREATOR,DOWNLOADED from PUZZLE_DATA;",
+  [STMT_WRITE_PUZZLE] = "INSERT INTO PUZZLE_DATA(ID,PUZZLE_NAME,CREATOR,PUZZLE_FILE,DOWNLOADED) VALUES(NULL, ?, ?, ?, 0);",
+  [STMT_READ_PUZZLE] = "SELECT PUZZLE_NAME FROM PUZZLE_DATA WHERE ID = ?",
+  [STMT_UPDATE_DOWNLOADED] = "UPDATE PUZZLE_DATA SET DOWNLOADED = ? WHERE ID = ?",
+  [STMT_UPDATE_RANKING] = "UPDATE PLAYER_DATA SET WON_RNDS = WON_RNDS + ?, LOST_RNDS = LOST_RNDS + ?, TOTAL_RNDS = TOTAL_RNDS + ? WHERE DC_ID = hex(?) AND USERNAME = trim(?);",
+  [STMT_READ_RANKING] = "SELECT WON_RNDS,LOST_RNDS,TOTAL_RNDS FROM PLAYER_DATA WHERE DC_ID = hex(?) AND USERNAME = trim(?)",
+  [STMT_TOP_RANKING] = "SELECT USERNAME,WON_RNDS,LOST_RNDS,TOTAL_RNDS FROM PLAYER_DATA ORDER BY WON_RNDS DESC LIMIT 10;",
+};
+
+typedef struct {
+  sqlite3 *db;
+  char db_path[256];
+  sqlite3_stmt *stmt[CHUCHU_STMT_COUNT];
+} chuchu_db_conn_t;
+
+static pthread_key_t db_conn_key;
+static pthread_once_t db_conn_once = PTHREAD_ONCE_INIT;
+
+static void close_chuchu_db_conn(void *data) {
+  chuchu_db_conn_t *conn = (chuchu_db_conn_t *)data;
+  int i;
+
+  for (i=0;i<CHUCHU_STMT_COUNT;i++)
+    sqlite3_finalize(conn->stmt[i]);
+  sqlite3_close(conn->db);
+  free(conn);
+}
+
+static void init_chuchu_db_conn_key(void) {
+  pthread_key_create(&db_conn_key, close_chuchu_db_conn);
+}
+
+/*
+ * Function: get_chuchu_db_conn
+ * --------------------
+ *
+ * Returns the connection of the calling thread,
+ * opens it and prepares all statements the first time
+ * 
+ *  *db_path: full path and filename to the DB
+ *
+ *  returns: ptr to connection
+ *           NULL => FAILED
+ *
+ */
+static chuchu_db_conn_t *get_chuchu_db_conn(const char* db_path) {
+  chuchu_db_conn_t *conn;
+  int i, rc;
+
+  pthread_once(&db_conn_once, init_chuchu_db_conn_key);
+  conn = (chuchu_db_conn_t *)pthread_getspecific(db_conn_key);
+  if (conn != NULL) {
+    if (strcmp(conn->db_path, db_path) == 0)
+      return conn;
+    //Other DB, should not happen
+    pthread_setspecific(db_conn_key, NULL);
+    close_chuchu_db_conn(conn);
+  }
+
+  conn = (chuchu_db_conn_t *)calloc(1, sizeof(chuchu_db_conn_t));
+  if (conn == NULL)
+    return NULL;
+  if ((conn->db = open_chuchu_db(db_path)) == NULL) {
+    free(conn);
+    return NULL;
+  }
+  strlcpy(conn->db_path, db_path, sizeof(conn->db_path));
+  for (i=0;i<CHUCHU_STMT_COUNT;i++) {
+    rc = sqlite3_prepare_v3(conn->db, chuchu_sql[i], -1, SQLITE_PREPARE_PERSISTENT, &conn->stmt[i], 0);
+    if (rc != SQLITE_OK) {
+      chuchu_error(SERVER, "Prepare SQL error: %d %s", rc, sqlite3_errmsg(conn->db));
+      close_chuchu_db_conn(conn);
+      return NULL;
+    }
+  }
+  pthread_setspecific(db_conn_key, conn);
+  return conn;
+}
+
+/*
+ * Function: get_chuchu_stmt
+ * --------------------
+ *
+ * Returns a prepared statement of the calling
+ * thread's connection, hand it back with
+ * put_chuchu_stmt when done
+ * 
+ *  *db_path: full path and filename to the DB
+ *  id: which statement
+ *
+ *  returns: ptr to statement
+ *           NULL => FAILED
+ *
+ */
+static sqlite3_stmt *get_chuchu_stmt(const char* db_path, CHUCHU_STMT id) {
+  chuchu_db_conn_t *conn = get_chuchu_db_conn(db_path);
+
+  if (conn == NULL)
+    return NULL;
+  return conn->stmt[id];
+}
+
+static void put_chuchu_stmt(sqlite3_stmt *pStmt) {
+  sqlite3_reset(pStmt);
+  sqlite3_clear_bindings(pStmt);
+}
+
 /*
  * Function: is_player_in_chuchu_db
  * --------------------
@@ -65,38 +314,28 @@ sqlite3* open_chuchu_db(const char* db_path) {
  *
  */
 int is_player_in_chuchu_db(const char* db_path, const char* name_or_dc_id, int name_search) {
-  sqlite3 *db;
   int rc, count = 0;
   sqlite3_stmt *pStmt;
   
-  if((db = open_chuchu_db(db_path)) == NULL) {
-    return -1;
-  }
-  
-  const char *zSql;
   if (name_search) {
-    zSql = "SELECT COUNT(*) from PLAYER_DATA WHERE USERNAME = ?;";
+    pStmt = get_chuchu_stmt(db_path, STMT_PLAYER_BY_NAME);
     count = (int)strlen(name_or_dc_id);
   }
   else {
-    zSql = "SELECT COUNT(*) from PLAYER_DATA WHERE DC_ID = hex(?);";
+    pStmt = get_chuchu_stmt(db_path, STMT_PLAYER_BY_DC_ID);
     count = 6;
   }
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if( rc != SQLITE_OK ){
-    chuchu_error(SERVER, "Prepare SQL error: %d", rc);
-    sqlite3_close(db);
+  if (pStmt == NULL)
     return -1;
-  }
 
   rc = sqlite3_bind_text(pStmt, 1, name_or_dc_id, count, SQLITE_STATIC);
   if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
+    put_chuchu_stmt(pStmt);
     chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
     return 0;
   }
   
+  count = 0;
   rc = sqlite3_step(pStmt);
   if (rc == SQLITE_ROW ) {
     count = sqlite3_column_int(pStmt, 0);
@@ -107,33 +346,22 @@ int is_player_in_chuchu_db(const char* db_path, const char* name_or_dc_id, int n
   else
     chuchu_info(SERVER,"Console ID/User '%s' is not in the DB", name_or_dc_id);
 
-  sqlite3_finalize(pStmt);
-  sqlite3_close(db);
+  put_chuchu_stmt(pStmt);
   return count;
 }
 
 int is_username_taken(const char* db_path, const char* u_name) {
-  sqlite3 *db;
   int rc, count = 0;
   sqlite3_stmt *pStmt;
   
-  if((db = open_chuchu_db(db_path)) == NULL) {
-    return -1;
-  }
-  
-  const char *zSql = "SELECT COUNT(*) from PLAYER_DATA WHERE USERNAME = trim(?);"; 
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if( rc != SQLITE_OK ){
-    chuchu_error(SERVER, "Prepare SQL error: %d", rc);
-    sqlite3_close(db);
+  if((pStmt = get_chuchu_stmt(db_path, STMT_USERNAME_TAKEN)) == NULL) {
     return -1;
   }
 
   rc = sqlite3_bind_text(pStmt, 1, u_name, (int)strlen(u_name), SQLITE_STATIC);
   if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
+    put_chuchu_stmt(pStmt);
     chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
     return 0;
   }
   
@@ -145,8 +373,7 @@ int is_username_taken(const char* db_path, const char* u_name) {
   if (count == 1)
     chuchu_info(SERVER,"Username taken...");
   
-  sqlite3_finalize(pStmt);
-  sqlite3_close(db);
+  put_chuchu_stmt(pStmt);
   return count;
 }
 
@@ -172,43 +399,21 @@ int validate_player_login(const char* db_path, const char* u_name, const char* p
   chuchu_info(SERVER,"Login granted");
   return 1;
 #else
-  sqlite3 *db;
   int rc, count = 0;
   sqlite3_stmt *pStmt;
   
-  if((db = open_chuchu_db(db_path)) == NULL) {
-    return -1;
-  }
-  
-  const char *zSql = "SELECT COUNT(*) from PLAYER_DATA WHERE USERNAME = trim(?) AND PASSWORD = trim(?) AND DC_ID = hex(?);"; 
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if( rc != SQLITE_OK ){
-    chuchu_error(SERVER, "Prepare SQL error: %d", rc);
-    sqlite3_close(db);
+  if((pStmt = get_chuchu_stmt(db_path, STMT_VALIDATE_LOGIN)) == NULL) {
     return -1;
   }
 
   rc = sqlite3_bind_text(pStmt, 1, u_name, (int)strlen(u_name), SQLITE_STATIC);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_text(pStmt, 2, passwd, (int)strlen(passwd), SQLITE_STATIC);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_text(pStmt, 3, dc_id, 6, SQLITE_STATIC);
   if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
-  }
-
-  rc = sqlite3_bind_text(pStmt, 2, passwd, (int)strlen(passwd), SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
-  }
-
-  rc = sqlite3_bind_text(pStmt, 3, dc_id, 6, SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
+    put_chuchu_stmt(pStmt);
     chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
     return 0;
   }
   
@@ -222,8 +427,7 @@ int validate_player_login(const char* db_path, const char* u_name, const char* p
   else
     chuchu_info(SERVER,"Login failed");
 
-  sqlite3_finalize(pStmt);
-  sqlite3_close(db);
+  put_chuchu_stmt(pStmt);
   return count;
 #endif
 }
@@ -246,58 +450,32 @@ int validate_player_login(const char* db_path, const char* u_name, const char* p
  *
  */
 int write_player_to_chuchu_db(const char* db_path, const char* dc_id, const char* u_name, const char* passwd) {
-  sqlite3 *db = NULL;
   int rc = 0;
   sqlite3_stmt *pStmt;
   
-  if((db = open_chuchu_db(db_path)) == NULL) {
+  if((pStmt = get_chuchu_stmt(db_path, STMT_WRITE_PLAYER)) == NULL) {
     return 0;
   }
 
-  const char* zSql = "INSERT INTO PLAYER_DATA(ID,DC_ID,USERNAME,PASSWORD,WON_RNDS,LOST_RNDS,TOTAL_RNDS) VALUES(NULL, hex(?), trim(?), trim(?), 0, 0, 0);";
-
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if( rc != SQLITE_OK ){
-    chuchu_error(SERVER, "Prepare SQL error: %d", rc);
-    sqlite3_close(db);
-    return -1;
-  }
-
   rc = sqlite3_bind_text(pStmt, 1, dc_id, 6, SQLITE_STATIC);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_text(pStmt, 2, u_name, (int)strlen(u_name), SQLITE_STATIC);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_text(pStmt, 3, passwd, (int)strlen(passwd), SQLITE_STATIC);
   if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
-  }
-  
-  rc = sqlite3_bind_text(pStmt, 2, u_name, (int)strlen(u_name), SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
-  }
-
-  rc = sqlite3_bind_text(pStmt, 3, passwd, (int)strlen(passwd), SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
+    put_chuchu_stmt(pStmt);
     chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
     return 0;
   }
 
   rc = sqlite3_step(pStmt);
+  put_chuchu_stmt(pStmt);
   if (rc != SQLITE_DONE) {
     chuchu_error(SERVER, "Insert failed error: %d", rc);
-    sqlite3_finalize(pStmt);
-    sqlite3_close(db);
     return 0;
   }
   
-  sqlite3_finalize(pStmt);
   chuchu_info(SERVER,"Records created successfully");
-  sqlite3_close(db);
   
   return 1;
 }
@@ -318,96 +496,37 @@ int write_player_to_chuchu_db(const char* db_path, const char* dc_id, const char
  *
  */
 int load_puzzles_to_array(server_data_t *s) {
-  sqlite3 *db;
-  int rc=0,index=0;
   sqlite3_stmt *pStmt;
     
-  if((db = open_chuchu_db(s->chu_db_path)) == NULL) {
-    return 0;
-  }
-
-  const char *zSql = "SELECT ID,PUZZLE_NAME,CREATOR,DOWNLOADED from PUZZLE_DATA;"; 
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if( rc != SQLITE_OK ){
-    chuchu_error(SERVER, "Prepare SQL error: %d", rc);
-    sqlite3_close(db);
+  if((pStmt = get_chuchu_stmt(s->chu_db_path, STMT_LOAD_PUZZLES)) == NULL) {
     return 0;
   }
 
-  //Puzzle struct is empty here, index is 0 and goes up
+  //Catalog is empty here and not shared yet
   while (sqlite3_step(pStmt) == SQLITE_ROW ) {
     puzzle_t *puz = (puzzle_t *)calloc(1, sizeof(puzzle_t));
+    if (puz == NULL) {
+      put_chuchu_stmt(pStmt);
+      return 0;
+    }
     puz->id = (uint32_t)sqlite3_column_int(pStmt, 0);
     strlcpy(puz->p_name, (char *)sqlite3_column_text(pStmt, 1), sizeof(puz->p_name));
     strlcpy(puz->u_name, (char *)sqlite3_column_text(pStmt, 2), sizeof(puz->u_name));
     puz->dl = (uint16_t)sqlite3_column_int(pStmt, 3);
-    //Should not happen
-    assert(s->puzz_l[index] == NULL);
-    s->puzz_l[index] = puz;
-    index++;
+    if (!add_chuchu_puzzle(s, puz)) {
+      free(puz);
+      put_chuchu_stmt(pStmt);
+      chuchu_error(SERVER, "Out of memory loading puzzles");
+      return 0;
+    }
   }
 
-  chuchu_info(SERVER,"Added %d puzzles",index);
+  chuchu_info(SERVER,"Added %d puzzles",s->puzz_count);
   
-  sqlite3_finalize(pStmt);
-  sqlite3_close(db);
+  put_chuchu_stmt(pStmt);
   return 1;
 }
 
-/*
- * Function: is_puzzle_in_chuchu_db
- * --------------------
- *
- * Function that checks if puzzle
- * name is not already taken
- * 
- *  *db_path: full path to DB
- *  *p_name:  name of the puzzle
- *  *u_name:  name of user
- *
- *  returns: nr of puzzles found
- *           1 => OK
- *           ELSE => FAILED
- *
- */
-int is_puzzle_in_chuchu_db(const char* db_path, const char* p_name, const char* u_name) {
-  sqlite3 *db;
-  int rc, count = 0;
-  sqlite3_stmt *pStmt;
-    
-  if((db = open_chuchu_db(db_path)) == NULL) {
-    return -1;
-  }
-
-  const char *zSql = "SELECT COUNT(*) from PUZZLE_DATA WHERE PUZZLE_NAME = ?;"; 
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if( rc != SQLITE_OK ){
-    chuchu_error(SERVER, "Prepare SQL error: %d", rc);
-    sqlite3_close(db);
-    return -1;
-  }
-
-  rc = sqlite3_bind_text(pStmt, 1, p_name, (int)strlen(p_name), SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
-  }
-
-  rc = sqlite3_step(pStmt);
-  if (rc == SQLITE_ROW ) {
-    count = sqlite3_column_int(pStmt, 0);
-  }
-  
-  if (count >= 1)
-    chuchu_info(SERVER,"Puzzle is already in the DB");
-  
-  sqlite3_finalize(pStmt);
-  sqlite3_close(db);
-  return count;
-}
-
 /*
  * Function: write_puzzle_in_chuchu_db
  * --------------------
@@ -426,84 +545,56 @@ int is_puzzle_in_chuchu_db(const char* db_path, const char* p_name, const char*
  *
  */
 int write_puzzle_in_chuchu_db(server_data_t *s, const char* p_name, const char* u_name, char* data, int nData) {
-  sqlite3 *db;
   int rc, lastid=0;
   sqlite3_stmt *pStmt;
-  const char * db_path = s->chu_db_path;
   
-  if((db = open_chuchu_db(db_path)) == NULL) {
+  if((pStmt = get_chuchu_stmt(s->chu_db_path, STMT_WRITE_PUZZLE)) == NULL) {
     return 0;
   }
 
   chuchu_info(SERVER,"Storing puzzle: %s in DB", p_name);
   
-  const char *zSql = "INSERT INTO PUZZLE_DATA(ID,PUZZLE_NAME,CREATOR,PUZZLE_FILE,DOWNLOADED) VALUES(NULL, ?, ?, ?, 0);";
- 
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if(rc != SQLITE_OK) {
-    chuchu_error(SERVER, "Prepare SQL statement failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
-  }
-
   rc = sqlite3_bind_text(pStmt, 1, p_name, (int)strlen(p_name), SQLITE_STATIC);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_text(pStmt, 2, u_name, (int)strlen(u_name), SQLITE_STATIC);
   if (rc != SQLITE_OK) {
     chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_finalize(pStmt);
-    sqlite3_close(db);
-    return 0;
-  }
-
-  rc = sqlite3_bind_text(pStmt, 2, u_name, (int)strlen(u_name), SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_finalize(pStmt);
-    sqlite3_close(db);
+    put_chuchu_stmt(pStmt);
     return 0;
   }
   
   rc = sqlite3_bind_blob(pStmt, 3, data, nData, SQLITE_STATIC);
   if (rc != SQLITE_OK) {
     chuchu_error(SERVER, "Bind BLOB failed error: %d", rc);
-    sqlite3_finalize(pStmt);
-    sqlite3_close(db);
+    put_chuchu_stmt(pStmt);
     return 0;
   }
   
   rc = sqlite3_step(pStmt);
+  put_chuchu_stmt(pStmt);
   if (rc != SQLITE_DONE) {
     chuchu_error(SERVER, "Insert BLOB failed error: %d", rc);
-    sqlite3_finalize(pStmt);
-    sqlite3_close(db);
-    return 0;
-  }
-  sqlite3_finalize(pStmt);
-  
-  const char *getID = "SELECT last_insert_rowid();";
-  rc = sqlite3_prepare_v2(db, getID, -1, &pStmt, 0);
-  if(rc != SQLITE_OK) {
-    chuchu_error(SERVER, "Prepare SQL statement failed error: %d", rc);
-    sqlite3_close(db);
     return 0;
   }
-  
-  rc = sqlite3_step(pStmt);
-  if (rc == SQLITE_ROW) {
-    lastid = sqlite3_column_int(pStmt, 0);
-  }
+  //Only this thread writes with this connection
+  lastid = (int)sqlite3_last_insert_rowid(sqlite3_db_handle(pStmt));
   
   //Create puzzle struct
   puzzle_t *puz = (puzzle_t *)calloc(1, sizeof(puzzle_t));
+  if (puz == NULL)
+    return 0;
   puz->id = (uint32_t)lastid;
   puz->dl = 0;
   strlcpy(puz->p_name, p_name, sizeof(puz->p_name));
   strlcpy(puz->u_name, u_name, sizeof(puz->u_name));
-  //Should not happen
-  assert(s->puzz_l[lastid] == NULL);
-  s->puzz_l[lastid] = puz;
-  
-  sqlite3_finalize(pStmt);
-  sqlite3_close(db);
+  lock_puzzles(s);
+  rc = add_chuchu_puzzle(s, puz);
+  unlock_puzzles(s);
+  if (!rc) {
+    free(puz);
+    chuchu_error(SERVER, "Could not add puzzle %d to the catalog", lastid);
+    return 0;
+  }
   
   return 1;
 }
@@ -514,7 +605,7 @@ int write_puzzle_in_chuchu_db(server_data_t *s, const char* p_name, const char*
  * --------------------
  *
  * Function that reads puzzle from
- * the DB
+ * the DB, the blob is read straight into the msg
  * 
  *  *db_path: full path to the DB
  *  *msg:  ptr to outgoing client msg
@@ -524,239 +615,354 @@ int write_puzzle_in_chuchu_db(server_data_t *s, const char* p_name, const char*
  *        
  */
 int read_puzzle_in_chuchu_db(server_data_t *s, const char* db_path, char* msg, uint32_t id) {
-  sqlite3 *db;
   int rc=0;
-  char *p_name = 0;
-  char *puzBlob = 0;
   int pnBlob = 0;           
   sqlite3_stmt *pStmt;
+  sqlite3_blob *pBlob;
+  sqlite3 *db;
   
-  if((db = open_chuchu_db(db_path)) == NULL){
-    return 0;
-  }
-  
-  const char *zSql = "SELECT PUZZLE_NAME,PUZZLE_FILE FROM PUZZLE_DATA WHERE ID = ?"; 
-  
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if(rc != SQLITE_OK) {
-    chuchu_error(SERVER, "Prepare SQL statement failed error: %d", rc);
-    sqlite3_close(db);
+  if((pStmt = get_chuchu_stmt(db_path, STMT_READ_PUZZLE)) == NULL){
     return 0;
   }
+  db = sqlite3_db_handle(pStmt);
 
   rc = sqlite3_bind_int(pStmt, 1, (int)id);
   if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
+    put_chuchu_stmt(pStmt);
     chuchu_error(SERVER, "Bind int failed error: %d", rc);
-    sqlite3_close(db);
     return 0;
   }
   
   rc = sqlite3_step(pStmt);
   
-  if(rc == SQLITE_ROW) {
-    p_name = (char*)sqlite3_column_text(pStmt, 0);
-    pnBlob = sqlite3_column_bytes(pStmt, 1);
-    puzBlob = malloc( (long unsigned int)pnBlob * sizeof(char) ); 
-    memcpy(puzBlob, sqlite3_column_blob(pStmt, 1), (size_t)pnBlob);
-  } else {
-    sqlite3_finalize(pStmt);
+  if(rc != SQLITE_ROW) {
+    put_chuchu_stmt(pStmt);
     chuchu_error(SERVER, "Can't find puzzle");
-    sqlite3_close(db); 
     return 0;
   }
-  //Add puzzle_name and blob to msg
-  strlcpy(msg, p_name, 0x10);
-  memcpy(&msg[0x10], puzBlob, (size_t)pnBlob);
-  
-  sqlite3_finalize(pStmt);
-  sqlite3_close(db);
+  //Add puzzle_name and blob to msg, room is left for the hdr
+  strlcpy(msg, (char*)sqlite3_column_text(pStmt, 0), 0x10);
+  put_chuchu_stmt(pStmt);
 
-  free(puzBlob);
+  //Puzzles never change, ID is the rowid
+  rc = sqlite3_blob_open(db, "main", "PUZZLE_DATA", "PUZZLE_FILE", id, 0, &pBlob);
+  if (rc != SQLITE_OK) {
+    chuchu_error(SERVER, "Can't open puzzle %d: %s", id, sqlite3_errmsg(db));
+    return 0;
+  }
+  pnBlob = sqlite3_blob_bytes(pBlob);
+  if (pnBlob > MAX_PKT_SIZE - 4 - 16) {
+    sqlite3_blob_close(pBlob);
+    chuchu_error(SERVER, "Puzzle %d is too big", id);
+    return 0;
+  }
+  rc = sqlite3_blob_read(pBlob, &msg[0x10], pnBlob, 0);
+  sqlite3_blob_close(pBlob);
+  if (rc != SQLITE_OK) {
+    chuchu_error(SERVER, "Can't read puzzle %d error: %d", id, rc);
+    return 0;
+  }
   
   return (pnBlob+16);
 }
 
 /*
- * Function: update_puzzle_downloaded_to_chuchu_db
- * --------------------
- *
- * Function that updates the amount of times the puzzle
- * has been downloaded
- * 
- *  *db_path: full path to the DB
- *  id: id of the puzzle in the DB
+ * PUZZLE CACHE
  *
- *  returns: 
- *           1 => OK
- *        -1,0 => FAILED
- *        
+ * Ready-made 0x13 bodies by puzzle id, least recently used ones
+ * are dropped above CHUCHU_PUZZLE_CACHE_BYTES. Misses are read by
+ * the DB worker one job at a time, so a miss queued behind another
+ * one for the same id finds it here and shares the DB read.
  */
-int update_puzzle_downloaded_to_chuchu_db(server_data_t *s, const char* db_path, uint32_t id) {
-  sqlite3 *db = NULL;
-  int rc = 0, i=0;
-  uint16_t cn=0;
-  sqlite3_stmt *pStmt;
-  
-  if((db = open_chuchu_db(db_path)) == NULL) {
-    return 0;
-  }
 
-  //Update puzzle downloaded counter
-  for (i=0;i<(s->m_puzz);i++) {
-    if(s->puzz_l[i]) {
-      if (s->puzz_l[i]->id == id) {
-	s->puzz_l[i]->dl++;
-	cn = s->puzz_l[i]->dl;
-	break;
-      }
-    }
-  }
-  
-  const char *zSql = "UPDATE PUZZLE_DATA SET DOWNLOADED = ? WHERE ID = ?"; 
+typedef struct chuchu_puzzle_entry {
+  struct chuchu_puzzle_entry *hnext;
+  struct chuchu_puzzle_entry *prev;
+  struct chuchu_puzzle_entry *next;
+  uint32_t id;
+  int size;
+  char body[];
+} chuchu_puzzle_entry_t;
 
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if( rc != SQLITE_OK ){
-    chuchu_error(SERVER, "Prepare SQL error: %d", rc);
-    sqlite3_close(db);
-    return 0;
-  }
+typedef struct {
+  pthread_mutex_t lock;
+  chuchu_puzzle_entry_t *hash[CHUCHU_PUZZLE_CACHE_BUCKETS];
+  //LRU list, first is the most recent
+  chuchu_puzzle_entry_t *first;
+  chuchu_puzzle_entry_t *last;
+  size_t bytes;
+  int entries;
+  uint64_t hits;
+  uint64_t misses;
+} chuchu_puzzle_cache_t;
 
-  rc = sqlite3_bind_int(pStmt, 1, (int)cn);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind int failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
-  }
-  
-  rc = sqlite3_bind_int(pStmt, 2, (int)id);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind int failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
-  }
+static chuchu_puzzle_cache_t puzzle_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
-  rc = sqlite3_step(pStmt);
-  if (rc != SQLITE_DONE) {
-    chuchu_error(SERVER, "Insert failed error: %d", rc);
-    sqlite3_finalize(pStmt);
-    sqlite3_close(db);
-    return 0;
-  }
-  
-  sqlite3_finalize(pStmt);
-  sqlite3_close(db);
+static void unlink_cached_puzzle(chuchu_puzzle_entry_t *e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    puzzle_cache.first = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    puzzle_cache.last = e->prev;
+}
 
-  chuchu_info(SERVER, "Puzzle id: [%d] has been downloaded for the %d time", id, cn);
-  
-  return 1;
+static void link_cached_puzzle(chuchu_puzzle_entry_t *e) {
+  e->prev = NULL;
+  e->next = puzzle_cache.first;
+  if (puzzle_cache.first)
+    puzzle_cache.first->prev = e;
+  else
+    puzzle_cache.last = e;
+  puzzle_cache.first = e;
 }
 
 /*
- * Function: update_player_ranking_to_chuchu_db
+ * Function: copy_cached_puzzle
  * --------------------
  *
- * Function that updates the players ranking
- * after disconnecting the game
+ * Copies a cached body and makes it the most
+ * recent, puzzle_cache.lock must be held
  * 
- *  *db_path: full path to the DB
- *  *pl:  ptr to player struct
+ *  id: id of puzzle
+ *  *msg: ptr to the body of the outgoing msg
  *
- *  returns: 
- *           1 => OK
- *        -1,0 => FAILED
+ *  returns: size of the body
+ *           0 => not cached
  *        
  */
-int update_player_ranking_to_chuchu_db(const char* db_path, player_t* pl) {
-  sqlite3 *db = NULL;
-  int rc = 0;
-  sqlite3_stmt *pStmt;
+static int copy_cached_puzzle(uint32_t id, char* msg) {
+  chuchu_puzzle_entry_t *e = puzzle_cache.hash[id % CHUCHU_PUZZLE_CACHE_BUCKETS];
 
-  const char* u_name = pl->username;
-  const char* dc_id = pl->dreamcast_id;
-#ifdef DISABLE_AUTH
-  if (!is_player_in_chuchu_db(db_path, u_name, 1))
-	  write_player_to_chuchu_db(db_path, dc_id, u_name, "");
-#endif
-  /*
-   Important, chuchu sends a updated stat packet after each game, so
-   we need to keep the orig. values and new apart, add here and store
-   but don't change the orig. read values from the DB and only update
-   after a disconnect
-  */
-  uint32_t won_rnds = pl->won_rnds + pl->db_won_rnds;
-  uint32_t lost_rnds = pl->lost_rnds + pl->db_lost_rnds;
-  uint32_t total_rnds = pl->total_rnds + pl->db_total_rnds;
-  
-  if((db = open_chuchu_db(db_path)) == NULL) {
+  while (e && e->id != id)
+    e = e->hnext;
+  if (e == NULL)
     return 0;
+  unlink_cached_puzzle(e);
+  link_cached_puzzle(e);
+  memcpy(msg, e->body, (size_t)e->size);
+  return e->size;
+}
+
+/*
+ * Function: get_puzzle_from_cache
+ * --------------------
+ *
+ * Copies the 0x13 body of a puzzle if it is cached,
+ * the caller posts a DB_READ_PUZZLE job on a miss
+ * 
+ *  id: id of puzzle
+ *  *msg: ptr to the body of the outgoing msg
+ *
+ *  returns: size of the body
+ *           0 => MISS
+ *        
+ */
+int get_puzzle_from_cache(uint32_t id, char* msg) {
+  int size;
+
+  pthread_mutex_lock(&puzzle_cache.lock);
+  size = copy_cached_puzzle(id, msg);
+  if (size > 0)
+    puzzle_cache.hits++;
+  else
+    puzzle_cache.misses++;
+  pthread_mutex_unlock(&puzzle_cache.lock);
+
+  return size;
+}
+
+/*
+ * Function: put_puzzle_in_cache
+ * --------------------
+ *
+ * Adds a body read from the DB and drops the least
+ * recently used ones until it fits
+ * 
+ *  id: id of puzzle
+ *  *body: 0x13 body without hdr
+ *  size: size of the body
+ *
+ *  returns: void
+ *
+ */
+static void put_puzzle_in_cache(uint32_t id, const char* body, int size) {
+  chuchu_puzzle_entry_t *e, **pp;
+  size_t bytes = sizeof(chuchu_puzzle_entry_t) + (size_t)size;
+
+  if (bytes > CHUCHU_PUZZLE_CACHE_BYTES)
+    return;
+  e = (chuchu_puzzle_entry_t *)malloc(bytes);
+  if (e == NULL)
+    return;
+  e->id = id;
+  e->size = size;
+  memcpy(e->body, body, (size_t)size);
+
+  pthread_mutex_lock(&puzzle_cache.lock);
+  while (puzzle_cache.last && puzzle_cache.bytes + bytes > CHUCHU_PUZZLE_CACHE_BYTES) {
+    chuchu_puzzle_entry_t *old = puzzle_cache.last;
+
+    unlink_cached_puzzle(old);
+    for (pp = &puzzle_cache.hash[old->id % CHUCHU_PUZZLE_CACHE_BUCKETS]; *pp != old; pp = &(*pp)->hnext);
+    *pp = old->hnext;
+    puzzle_cache.bytes -= sizeof(chuchu_puzzle_entry_t) + (size_t)old->size;
+    puzzle_cache.entries--;
+    free(old);
   }
+  pp = &puzzle_cache.hash[id % CHUCHU_PUZZLE_CACHE_BUCKETS];
+  e->hnext = *pp;
+  *pp = e;
+  link_cached_puzzle(e);
+  puzzle_cache.bytes += bytes;
+  puzzle_cache.entries++;
+  chuchu_info(SERVER, "Puzzle %d cached, %d puzzles %zu bytes, %llu hits %llu misses",
+	      id, puzzle_cache.entries, puzzle_cache.bytes,
+	      (unsigned long long)puzzle_cache.hits, (unsigned long long)puzzle_cache.misses);
+  pthread_mutex_unlock(&puzzle_cache.lock);
+}
 
-  const char* zSql = "UPDATE PLAYER_DATA SET WON_RNDS = ?, LOST_RNDS = ?, TOTAL_RNDS = ? WHERE DC_ID = hex(?) AND USERNAME = trim(?);";
+/*
+ * DOWNLOAD COUNTERS
+ *
+ * Downloads only bump puzzle_t.dl, which is what the menu shows.
+ * The DB worker writes the changed counters in one transaction
+ * CHUCHU_DOWNLOADS_FLUSH_MS after the first one, or on shutdown.
+ */
 
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if( rc != SQLITE_OK ){
-    chuchu_error(SERVER, "Prepare SQL error: %d", rc);
-    sqlite3_close(db);
-    return -1;
+//1 => a download is not written yet and downloads_timer is armed
+static int downloads_dirty = 0;
+static chuchu_timer_t downloads_timer;
+
+static void mark_puzzle_downloads(void) {
+  if (__atomic_exchange_n(&downloads_dirty, 1, __ATOMIC_SEQ_CST) == 0)
+    add_chuchu_timer(&downloads_timer, CHUCHU_DOWNLOADS_FLUSH_MS);
+}
+
+/*
+ * Function: count_puzzle_download
+ * --------------------
+ *
+ * Function that updates the amount of times the puzzle
+ * has been downloaded, the DB is updated later
+ * 
+ *  *s: ptr to server data struct
+ *  id: id of the puzzle in the DB
+ *
+ *  returns: void
+ *        
+ */
+void count_puzzle_download(server_data_t *s, uint32_t id) {
+  puzzle_t *puz;
+  uint16_t cn=0;
+
+  //Update puzzle downloaded counter
+  lock_puzzles(s);
+  puz = get_chuchu_puzzle(s, id);
+  if (puz) {
+    puz->dl++;
+    puz->dl_dirty = 1;
+    s->puzz_dl_gen++;
+    cn = puz->dl;
   }
+  unlock_puzzles(s);
+  if (puz == NULL)
+    return;
+  chuchu_info(SERVER, "Puzzle id: [%d] has been downloaded for the %d time", id, cn);
 
-  rc = sqlite3_bind_int(pStmt, 1, (int)won_rnds);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind int failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
+  //First one since the last write arms the timer
+  mark_puzzle_downloads();
+}
+
+/*
+ * Function: flush_puzzle_downloads
+ * --------------------
+ *
+ * Writes the changed download counters in one
+ * transaction, they are marked again if it fails
+ * 
+ *  *s: ptr to server data struct
+ *
+ *  returns: 
+ *           1 => OK
+ *           0 => FAILED
+ *        
+ */
+static int flush_puzzle_downloads(server_data_t *s) {
+  uint32_t *ids = NULL;
+  uint16_t *dls = NULL;
+  puzzle_t *puz;
+  int i, n = 0, rc;
+  sqlite3_stmt *pStmt;
+  sqlite3 *db;
+
+  //Counted from here on are for the next write
+  __atomic_store_n(&downloads_dirty, 0, __ATOMIC_SEQ_CST);
+  lock_puzzles(s);
+  if (s->puzz_count > 0) {
+    ids = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)s->puzz_count);
+    dls = (uint16_t *)malloc(sizeof(uint16_t) * (size_t)s->puzz_count);
   }
-  
-  rc = sqlite3_bind_int(pStmt, 2, (int)lost_rnds);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind int failed error: %d", rc);
-    sqlite3_close(db);
+  if (ids == NULL || dls == NULL) {
+    unlock_puzzles(s);
+    free(ids);
+    free(dls);
+    mark_puzzle_downloads();
     return 0;
   }
-  
-  rc = sqlite3_bind_int(pStmt, 3, (int)total_rnds);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind int failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
+  for (i=0;i<s->puzz_count;i++) {
+    if (s->puzz_l[i]->dl_dirty) {
+      s->puzz_l[i]->dl_dirty = 0;
+      ids[n] = s->puzz_l[i]->id;
+      dls[n++] = s->puzz_l[i]->dl;
+    }
   }
+  unlock_puzzles(s);
 
-  rc = sqlite3_bind_text(pStmt, 4, dc_id, 6, SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
-  }
-  
-  rc = sqlite3_bind_text(pStmt, 5, u_name, (int)strlen(u_name), SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
-    return 0;
+  rc = SQLITE_ERROR;
+  if ((pStmt = get_chuchu_stmt(s->chu_db_path, STMT_UPDATE_DOWNLOADED)) != NULL) {
+    db = sqlite3_db_handle(pStmt);
+    rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+      chuchu_error(SERVER, "Begin transaction failed error: %d", rc);
+    for (i=0;rc == SQLITE_OK && i<n;i++) {
+      sqlite3_bind_int(pStmt, 1, (int)dls[i]);
+      sqlite3_bind_int(pStmt, 2, (int)ids[i]);
+      rc = sqlite3_step(pStmt);
+      put_chuchu_stmt(pStmt);
+      if (rc != SQLITE_DONE) {
+	chuchu_error(SERVER, "Download counter update failed error: %d", rc);
+	//Roll back all of them, they are marked dirty again below
+	sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+	break;
+      }
+      rc = SQLITE_OK;
+    }
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+      if (rc != SQLITE_OK) {
+	chuchu_error(SERVER, "Commit failed error: %d", rc);
+	sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+      }
+    }
   }
 
-  rc = sqlite3_step(pStmt);
-  if (rc != SQLITE_DONE) {
-    chuchu_error(SERVER, "Insert failed error: %d", rc);
-    sqlite3_finalize(pStmt);
-    sqlite3_close(db);
-    return 0;
+  if (rc != SQLITE_OK) {
+    //Counters only go up, the next write has the latest
+    lock_puzzles(s);
+    for (i=0;i<n;i++)
+      if ((puz = get_chuchu_puzzle(s, ids[i])) != NULL)
+	puz->dl_dirty = 1;
+    unlock_puzzles(s);
+    mark_puzzle_downloads();
+  } else if (n > 0) {
+    chuchu_info(SERVER, "Wrote download counters of %d puzzles", n);
   }
-  
-  sqlite3_finalize(pStmt);
-  chuchu_info(SERVER,"[%s] Ranking before [%d][%d][%d]",pl->username,pl->db_won_rnds,pl->db_lost_rnds,pl->db_total_rnds);
-  chuchu_info(SERVER,"[%s] Ranking after [%d][%d][%d]",pl->username,won_rnds,lost_rnds,total_rnds);
-  sqlite3_close(db);
-  
-  return 1;
+  free(ids);
+  free(dls);
+  return rc == SQLITE_OK;
 }
 
 /*
@@ -775,39 +981,22 @@ int update_player_ranking_to_chuchu_db(const char* db_path, player_t* pl) {
  *        
  */
 int read_ranking_from_chuchu_db(const char* db_path, player_t* pl) {
-  sqlite3 *db;
   int rc;
   sqlite3_stmt *pStmt;
 
   const char* dc_id = pl->dreamcast_id;
   const char* u_name = pl->username;
   
-  if((db = open_chuchu_db(db_path)) == NULL){
-    return -1;
-  }
-  
-  const char *zSql = "SELECT WON_RNDS,LOST_RNDS,TOTAL_RNDS FROM PLAYER_DATA WHERE DC_ID = hex(?) AND USERNAME = trim(?)"; 
-  
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if(rc != SQLITE_OK) {
-    chuchu_error(SERVER, "Prepare SQL statement failed error: %d", rc);
-    sqlite3_close(db);
+  if((pStmt = get_chuchu_stmt(db_path, STMT_READ_RANKING)) == NULL){
     return -1;
   }
 
   rc = sqlite3_bind_text(pStmt, 1, dc_id, 6, SQLITE_STATIC);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_text(pStmt, 2, u_name, (int)strlen(u_name), SQLITE_STATIC);
   if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
+    put_chuchu_stmt(pStmt);
     chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
-    return -1;
-  }
-
-  rc = sqlite3_bind_text(pStmt, 2, u_name, (int)strlen(u_name), SQLITE_STATIC);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pStmt);
-    chuchu_error(SERVER, "Bind text failed error: %d", rc);
-    sqlite3_close(db);
     return -1;
   }
   
@@ -824,18 +1013,41 @@ int read_ranking_from_chuchu_db(const char* db_path, player_t* pl) {
     pl->db_lost_rnds = 0;
     pl->db_total_rnds = 0;
 #else
-    sqlite3_finalize(pStmt);
+    put_chuchu_stmt(pStmt);
     chuchu_error(SERVER, "Can't find user, getting %d", rc);
-    sqlite3_close(db); 
     return -1;
 #endif
   }
-  sqlite3_finalize(pStmt);
-  sqlite3_close(db);
+  put_chuchu_stmt(pStmt);
 
   return 1;
 }
 
+/*
+ * TOP RANKING CACHE
+ *
+ * The formatted top ranking is kept until a ranking update could
+ * change it, or for CHUCHU_TOP_RANKING_TTL seconds since the login
+ * server adds players behind our back.
+ */
+
+typedef struct {
+  pthread_mutex_t lock;
+  char body[CHUCHU_TOP_RANKING_SIZE];
+  int size;
+  uint32_t gen;
+  time_t built;
+  int count;
+  uint32_t min_won;
+  char names[CHUCHU_TOP_RANKING_ROWS][MAX_UNAME_LEN];
+  uint64_t hits;
+  uint64_t misses;
+} chuchu_top_ranking_t;
+
+static chuchu_top_ranking_t top_ranking = { .lock = PTHREAD_MUTEX_INITIALIZER };
+//Rebuilds the list every CHUCHU_TOP_RANKING_TTL/2 while it is read
+static chuchu_timer_t top_ranking_timer;
+
 /*
  * Function: read_top_ranking_from_chuchu_db
  * --------------------
@@ -850,26 +1062,22 @@ int read_ranking_from_chuchu_db(const char* db_path, player_t* pl) {
  *
  */
 int read_top_ranking_from_chuchu_db(char* msg, const char* db_path) {
-  sqlite3 *db;
   int rc = 0;
   sqlite3_stmt *pStmt;
   char u_name[MAX_UNAME_LEN];
-  int pkt_size = 0;
+  char names[CHUCHU_TOP_RANKING_ROWS][MAX_UNAME_LEN];
+  int pkt_size = 0, count = 0;
+  uint32_t gen;
   uint32_t won_rnds=0,lost_rnds=0,total_rnds=0;
   memset(u_name,0,sizeof(u_name));
   
-  if((db = open_chuchu_db(db_path)) == NULL){
-    return 0;
-  }
-  
-  const char *zSql = "SELECT USERNAME,WON_RNDS,LOST_RNDS,TOTAL_RNDS FROM PLAYER_DATA ORDER BY WON_RNDS DESC LIMIT 10;"; 
-  
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if(rc != SQLITE_OK) {
-    chuchu_error(SERVER, "Prepare SQL statement failed error: %d", rc);
-    sqlite3_close(db);
+  if((pStmt = get_chuchu_stmt(db_path, STMT_TOP_RANKING)) == NULL){
     return 0;
   }
+  //An update during the query makes this result stale
+  pthread_mutex_lock(&top_ranking.lock);
+  gen = top_ranking.gen;
+  pthread_mutex_unlock(&top_ranking.lock);
 
   pkt_size = sprintf(&msg[0], "================ TOP 10 RANKING ================\n%*s\n%*s%*s%*s%*s\n",33,"ROUNDS",-16,"Username",8,"Won",8,"Lost",8,"Total");
   
@@ -881,19 +1089,725 @@ int read_top_ranking_from_chuchu_db(char* msg, const char* db_path) {
       lost_rnds = (uint32_t)sqlite3_column_int(pStmt, 2);
       total_rnds = (uint32_t)sqlite3_column_int(pStmt, 3);
       pkt_size += sprintf(&msg[pkt_size], "%*s%*d%*d%*d\n",-16,u_name,8,won_rnds,8,lost_rnds,8,total_rnds);
+      if (count < CHUCHU_TOP_RANKING_ROWS)
+	strlcpy(names[count++], u_name, MAX_UNAME_LEN);
     } else if (rc == SQLITE_DONE) {
       break;
     }
     else {
-      sqlite3_finalize(pStmt);
+      put_chuchu_stmt(pStmt);
       chuchu_error(SERVER, "Can't get top ranking");
-      sqlite3_close(db); 
       return 0;
     }
   }
   
-  sqlite3_finalize(pStmt);
-  sqlite3_close(db);
+  put_chuchu_stmt(pStmt);
+
+  pthread_mutex_lock(&top_ranking.lock);
+  if (gen == top_ranking.gen && pkt_size < CHUCHU_TOP_RANKING_SIZE) {
+    memcpy(top_ranking.body, msg, (size_t)pkt_size);
+    memcpy(top_ranking.names, names, sizeof(names));
+    top_ranking.size = pkt_size;
+    top_ranking.count = count;
+    top_ranking.min_won = won_rnds;
+    top_ranking.built = time(NULL);
+    chuchu_info(SERVER, "Top ranking cached, %llu hits %llu misses",
+		(unsigned long long)top_ranking.hits, (unsigned long long)top_ranking.misses);
+  }
+  pthread_mutex_unlock(&top_ranking.lock);
 
   return pkt_size;
 }
+
+/*
+ * Function: get_top_ranking_from_cache
+ * --------------------
+ *
+ * Copies the cached top ranking body, the caller
+ * posts a DB_TOP_RANKING job on a miss
+ * 
+ *  *msg: ptr to the body of the outgoing msg
+ *
+ *  returns: size of the body
+ *           0 => MISS
+ *        
+ */
+int get_top_ranking_from_cache(char* msg) {
+  int size;
+
+  pthread_mutex_lock(&top_ranking.lock);
+  size = top_ranking.size;
+  if (size > 0 && time(NULL) - top_ranking.built >= CHUCHU_TOP_RANKING_TTL)
+    size = top_ranking.size = 0;
+  if (size > 0) {
+    memcpy(msg, top_ranking.body, (size_t)size);
+    top_ranking.hits++;
+  } else {
+    top_ranking.misses++;
+  }
+  pthread_mutex_unlock(&top_ranking.lock);
+  //Padding
+  if (size > 0)
+    memset(&msg[size], 0, 4);
+
+  return size;
+}
+
+/*
+ * Function: invalidate_top_ranking_cache
+ * --------------------
+ *
+ * Drops the cached top ranking if a player with
+ * these won rounds could be in it
+ * 
+ *  *username: name of the player
+ *  won_rnds: won rounds of the player after the update
+ *
+ *  returns: void
+ *
+ */
+static void invalidate_top_ranking_cache(const char* username, uint32_t won_rnds) {
+  int i, stale;
+
+  pthread_mutex_lock(&top_ranking.lock);
+  stale = top_ranking.size == 0 || top_ranking.count < CHUCHU_TOP_RANKING_ROWS ||
+    won_rnds >= top_ranking.min_won;
+  for (i=0;!stale && i<top_ranking.count;i++)
+    stale = strcmp(top_ranking.names[i], username) == 0;
+  if (stale) {
+    top_ranking.size = 0;
+    top_ranking.gen++;
+  }
+  pthread_mutex_unlock(&top_ranking.lock);
+}
+
+/*
+ * RANKING WRITE-BEHIND
+ *
+ * Ranking updates are deltas, the rounds played in a session. The
+ * worker adds them up per player and writes them all in one
+ * transaction every CHUCHU_RANKING_FLUSH_MS or when the buffer is
+ * full. Only the worker thread touches the buffer.
+ */
+
+typedef struct {
+  char username[MAX_UNAME_LEN];
+  char dreamcast_id[6];
+  uint32_t won_rnds, lost_rnds, total_rnds;
+} chuchu_ranking_t;
+
+static chuchu_ranking_t dirty_ranking[CHUCHU_RANKING_BATCH];
+static int dirty_count = 0;
+//Armed while the buffer is not empty
+static chuchu_timer_t ranking_timer;
+
+/*
+ * Function: flush_player_ranking
+ * --------------------
+ *
+ * Writes the ranking buffer in one transaction, the
+ * buffer is kept for the next try if it fails
+ * 
+ *  *s: ptr to server data struct
+ *
+ *  returns: 
+ *           1 => OK
+ *           0 => FAILED
+ *        
+ */
+static int flush_player_ranking(server_data_t *s) {
+  const char *db_path = s->chu_db_path;
+  chuchu_ranking_t *r;
+  sqlite3_stmt *pStmt;
+  sqlite3 *db;
+  int i, rc;
+
+  if((pStmt = get_chuchu_stmt(db_path, STMT_UPDATE_RANKING)) == NULL) {
+    add_chuchu_timer(&ranking_timer, CHUCHU_RANKING_FLUSH_MS);
+    return 0;
+  }
+  db = sqlite3_db_handle(pStmt);
+
+  rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    chuchu_error(SERVER, "Begin transaction failed error: %d", rc);
+    add_chuchu_timer(&ranking_timer, CHUCHU_RANKING_FLUSH_MS);
+    return 0;
+  }
+
+  for (i=0;i<dirty_count;i++) {
+    r = &dirty_ranking[i];
+#ifdef DISABLE_AUTH
+    rc = is_player_in_chuchu_db(db_path, r->username, 1);
+    if (rc < 0 || (rc == 0 && !write_player_to_chuchu_db(db_path, r->dreamcast_id, r->username, ""))) {
+      chuchu_error(SERVER, "Could not add player %s for its ranking", r->username);
+      break;
+    }
+#endif
+    sqlite3_bind_int(pStmt, 1, (int)r->won_rnds);
+    sqlite3_bind_int(pStmt, 2, (int)r->lost_rnds);
+    sqlite3_bind_int(pStmt, 3, (int)r->total_rnds);
+    sqlite3_bind_text(pStmt, 4, r->dreamcast_id, 6, SQLITE_STATIC);
+    sqlite3_bind_text(pStmt, 5, r->username, (int)strlen(r->username), SQLITE_STATIC);
+    rc = sqlite3_step(pStmt);
+    put_chuchu_stmt(pStmt);
+    if (rc != SQLITE_DONE) {
+      chuchu_error(SERVER, "Ranking update failed error: %d", rc);
+      break;
+    }
+    chuchu_info(SERVER,"[%s] Ranking added [%d][%d][%d]",r->username,r->won_rnds,r->lost_rnds,r->total_rnds);
+  }
+  if (i < dirty_count) {
+    //Nothing was added, the whole buffer is written on the next try
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    add_chuchu_timer(&ranking_timer, CHUCHU_RANKING_FLUSH_MS);
+    return 0;
+  }
+  
+  rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    chuchu_error(SERVER, "Commit failed error: %d", rc);
+    //Nothing was added, try again later
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    add_chuchu_timer(&ranking_timer, CHUCHU_RANKING_FLUSH_MS);
+    return 0;
+  }
+  dirty_count = 0;
+  del_chuchu_timer(&ranking_timer);
+  return 1;
+}
+
+/*
+ * Function: add_buffered_ranking
+ * --------------------
+ *
+ * Adds the rounds of a player that are still in the
+ * buffer to the ones just read from the DB
+ * 
+ *  *pl: ptr to player struct
+ *
+ *  returns: void
+ *
+ */
+static void add_buffered_ranking(player_t *pl) {
+  int i;
+
+  for (i=0;i<dirty_count;i++) {
+    if (strcmp(dirty_ranking[i].username, pl->username) == 0 &&
+	memcmp(dirty_ranking[i].dreamcast_id, pl->dreamcast_id, 6) == 0) {
+      pl->db_won_rnds += dirty_ranking[i].won_rnds;
+      pl->db_lost_rnds += dirty_ranking[i].lost_rnds;
+      pl->db_total_rnds += dirty_ranking[i].total_rnds;
+      return;
+    }
+  }
+}
+
+/*
+ * Function: buffer_player_ranking
+ * --------------------
+ *
+ * Adds the ranking delta of a DB_UPDATE_RANKING job
+ * to the buffer, flushes first if it is full. The
+ * cached top ranking is dropped once the delta is in
+ * the buffer, a DB_TOP_RANKING job runs after this
+ * one and flushes it before reading
+ * 
+ *  *s: ptr to server data struct
+ *  *job: ptr to job
+ *
+ *  returns: void
+ *
+ */
+static void buffer_player_ranking(server_data_t *s, chuchu_db_job_t *job) {
+  chuchu_ranking_t *r = NULL;
+  int i;
+
+  for (i=0;i<dirty_count;i++) {
+    if (strcmp(dirty_ranking[i].username, job->username) == 0 &&
+	memcmp(dirty_ranking[i].dreamcast_id, job->dreamcast_id, 6) == 0) {
+      r = &dirty_ranking[i];
+      break;
+    }
+  }
+  if (r == NULL) {
+    if (dirty_count == CHUCHU_RANKING_BATCH && !flush_player_ranking(s)) {
+      chuchu_error(SERVER, "Ranking buffer full, dropped [%s] [%d][%d][%d]", job->username, job->won_rnds, job->lost_rnds, job->total_rnds);
+      return;
+    }
+    if (dirty_count == 0)
+      add_chuchu_timer(&ranking_timer, CHUCHU_RANKING_FLUSH_MS);
+    r = &dirty_ranking[dirty_count++];
+    memset(r, 0, sizeof(chuchu_ranking_t));
+    strlcpy(r->username, job->username, sizeof(r->username));
+    memcpy(r->dreamcast_id, job->dreamcast_id, 6);
+  }
+  r->won_rnds += job->won_rnds;
+  r->lost_rnds += job->lost_rnds;
+  r->total_rnds += job->total_rnds;
+  if (job->won_rnds != 0 || job->lost_rnds != 0 || job->total_rnds != 0)
+    invalidate_top_ranking_cache(job->username, job->ranked_won);
+  if (dirty_count == CHUCHU_RANKING_BATCH)
+    flush_player_ranking(s);
+}
+
+/*
+ * DB WORKER
+ *
+ * The lobby never runs SQL while holding its locks, handlers
+ * post a job and reply from its done callback instead. The
+ * callback runs on the thread that owns the player, the epoll
+ * loop (woken by db_event_fd) or the player's handler thread.
+ * The io_uring login server runs its auth process as DB_RUN jobs.
+ */
+
+//Write-behind buffers whose timer went off, in db_due
+enum { DB_DUE_RANKING=0x01, DB_DUE_DOWNLOADS=0x02 };
+
+/*
+ * Function: new_chuchu_db_job
+ * --------------------
+ *
+ * Allocates a DB job, a ref is kept on the player
+ * until the job is freed
+ * 
+ *  *pl: player to reply to, NULL when no reply
+ *  type: what the worker should do
+ *  *done: callback run on the player's thread, NULL when no reply
+ *
+ *  returns: ptr to job
+ *           NULL => FAILED
+ *
+ */
+chuchu_db_job_t *new_chuchu_db_job(player_t *pl, DB_JOB type, int (*done)(chuchu_db_job_t *job)) {
+  chuchu_db_job_t *job = (chuchu_db_job_t *)calloc(1, sizeof(chuchu_db_job_t));
+
+  if (job == NULL) {
+    chuchu_error(SERVER, "Could not allocate DB job");
+    return NULL;
+  }
+  job->type = type;
+  job->done = done;
+  job->pl = pl;
+  if (pl)
+    __atomic_add_fetch(&pl->refs, 1, __ATOMIC_RELAXED);
+  return job;
+}
+
+void free_chuchu_db_job(chuchu_db_job_t *job) {
+  if (job->pl)
+    put_chuchu_player(job->pl);
+  free(job);
+}
+
+/*
+ * Function: post_chuchu_db_job
+ * --------------------
+ *
+ * Queues a job for the DB worker, may be
+ * called with any of the server locks held
+ * 
+ *  *s: ptr to server data struct
+ *  *job: ptr to job
+ *
+ *  returns: void
+ *
+ */
+void post_chuchu_db_job(server_data_t *s, chuchu_db_job_t *job) {
+  job->next = NULL;
+  pthread_mutex_lock(&s->db_mutex);
+  if (s->db_last)
+    s->db_last->next = job;
+  else
+    s->db_first = job;
+  s->db_last = job;
+  pthread_cond_signal(&s->db_cond);
+  pthread_mutex_unlock(&s->db_mutex);
+}
+
+/*
+ * Function: wait_chuchu_db_job
+ * --------------------
+ *
+ * Blocks until the worker is done with a job,
+ * used by the threaded lobby
+ * 
+ *  *s: ptr to server data struct
+ *  *job: ptr to job
+ *
+ *  returns: void
+ *
+ */
+void wait_chuchu_db_job(server_data_t *s, chuchu_db_job_t *job) {
+  pthread_mutex_lock(&s->db_mutex);
+  while (!job->finished)
+    pthread_cond_wait(&s->db_done_cond, &s->db_mutex);
+  pthread_mutex_unlock(&s->db_mutex);
+}
+
+/*
+ * Function: get_chuchu_db_done
+ * --------------------
+ *
+ * Takes the list of finished jobs, used by
+ * the epoll lobby when db_event_fd is readable
+ * 
+ *  *s: ptr to server data struct
+ *
+ *  returns: list of jobs linked by next
+ *
+ */
+chuchu_db_job_t *get_chuchu_db_done(server_data_t *s) {
+  chuchu_db_job_t *done;
+  uint64_t cnt;
+
+  if (read(s->db_event_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+    chuchu_error(SERVER, "DB event read failed: %s", strerror(errno));
+  pthread_mutex_lock(&s->db_mutex);
+  done = s->db_done;
+  s->db_done = NULL;
+  pthread_mutex_unlock(&s->db_mutex);
+  return done;
+}
+
+/*
+ * Function: run_chuchu_db_job
+ * --------------------
+ *
+ * Runs the SQL of one job on the worker thread,
+ * ranking updates only go to the write-behind buffer
+ * 
+ *  *s: ptr to server data struct
+ *  *job: ptr to job
+ *
+ *  returns: void
+ *
+ */
+static void run_chuchu_db_job(server_data_t *s, chuchu_db_job_t *job) {
+  //Replies are read at data[4], the callback adds the header
+  switch (job->type) {
+  case DB_READ_RANKING:
+    //The player waits for this job, nothing else writes these fields
+    job->rc = read_ranking_from_chuchu_db(s->chu_db_path, job->pl);
+    if (job->rc == 1)
+      add_buffered_ranking(job->pl);
+    break;
+  case DB_TOP_RANKING:
+    //The list has to show the buffered rounds too
+    if (dirty_count > 0)
+      flush_player_ranking(s);
+    job->size = read_top_ranking_from_chuchu_db(&job->data[4], s->chu_db_path);
+    break;
+  case DB_UPLOAD_PUZZLE:
+    //Only this thread adds puzzles, the name is still free when written
+    lock_puzzles(s);
+    job->found = find_chuchu_puzzle(s, job->p_name) != NULL;
+    unlock_puzzles(s);
+    if (job->found)
+      chuchu_info(SERVER,"Puzzle is already in the DB");
+    if (job->found == 0)
+      job->rc = write_puzzle_in_chuchu_db(s, job->p_name, job->username, job->data, job->size);
+    break;
+  case DB_READ_PUZZLE:
+    //Read by an earlier job for the same id
+    pthread_mutex_lock(&puzzle_cache.lock);
+    job->size = copy_cached_puzzle(job->id, &job->data[4]);
+    pthread_mutex_unlock(&puzzle_cache.lock);
+    if (job->size == 0) {
+      job->size = read_puzzle_in_chuchu_db(s, s->chu_db_path, &job->data[4], job->id);
+      if (job->size > 0)
+	put_puzzle_in_cache(job->id, &job->data[4], job->size);
+    }
+    if (job->size > 0)
+      count_puzzle_download(s, job->id);
+    break;
+  case DB_UPDATE_RANKING:
+    buffer_player_ranking(s, job);
+    break;
+  case DB_RUN:
+    job->rc = job->run(job);
+    break;
+  }
+}
+
+/*
+ * Function: finish_chuchu_db_job
+ * --------------------
+ *
+ * Hands a finished job back to the thread of its
+ * player, or frees it if nobody waits for it
+ * 
+ *  *s: ptr to server data struct
+ *  *job: ptr to job
+ *
+ *  returns: void
+ *
+ */
+static void finish_chuchu_db_job(server_data_t *s, chuchu_db_job_t *job) {
+  uint64_t one = 1;
+
+  if (job->done == NULL) {
+    free_chuchu_db_job(job);
+    return;
+  }
+  pthread_mutex_lock(&s->db_mutex);
+  job->finished = 1;
+  if (s->db_event_fd >= 0) {
+    job->next = s->db_done;
+    s->db_done = job;
+  } else {
+    pthread_cond_broadcast(&s->db_done_cond);
+  }
+  pthread_mutex_unlock(&s->db_mutex);
+  if (s->db_event_fd >= 0 && write(s->db_event_fd, &one, sizeof(one)) < 0)
+    chuchu_error(SERVER, "DB event write failed: %s", strerror(errno));
+}
+
+/*
+ * Function: due_chuchu_db_timer
+ * --------------------
+ *
+ * Timer callback of the write-behind buffers, runs on
+ * the lobby loop and hands the write to the worker
+ * 
+ *  *t: ranking_timer or downloads_timer
+ *
+ *  returns: void
+ *
+ */
+static void due_chuchu_db_timer(chuchu_timer_t *t) {
+  server_data_t *s = (server_data_t *)t->data;
+
+  pthread_mutex_lock(&s->db_mutex);
+  s->db_due |= t == &ranking_timer ? DB_DUE_RANKING : DB_DUE_DOWNLOADS;
+  pthread_cond_signal(&s->db_cond);
+  pthread_mutex_unlock(&s->db_mutex);
+}
+
+/*
+ * Function: refresh_top_ranking
+ * --------------------
+ *
+ * Timer callback that rebuilds the top ranking before
+ * it gets stale, as long as somebody reads it
+ * 
+ *  *t: top_ranking_timer
+ *
+ *  returns: void
+ *
+ */
+static void refresh_top_ranking(chuchu_timer_t *t) {
+  server_data_t *s = (server_data_t *)t->data;
+  static uint64_t last_hits = 0;
+  chuchu_db_job_t *job;
+  uint64_t hits;
+
+  pthread_mutex_lock(&top_ranking.lock);
+  hits = top_ranking.hits;
+  pthread_mutex_unlock(&top_ranking.lock);
+  if (hits != last_hits && (job = new_chuchu_db_job(NULL, DB_TOP_RANKING, NULL)) != NULL)
+    post_chuchu_db_job(s, job);
+  last_hits = hits;
+  add_chuchu_timer(t, CHUCHU_TOP_RANKING_TTL * 1000 / 2);
+}
+
+static void *chuchu_db_worker(void *data) {
+  server_data_t *s = (server_data_t *)data;
+  chuchu_db_job_t *batch, *job, *next;
+  int flush, due;
+
+  for (;;) {
+    pthread_mutex_lock(&s->db_mutex);
+    //Sleep until there is a job, a flush request or a buffer is due
+    while (s->db_first == NULL && !s->db_flush && !s->db_due)
+      pthread_cond_wait(&s->db_cond, &s->db_mutex);
+    batch = s->db_first;
+    s->db_first = NULL;
+    s->db_last = NULL;
+    flush = s->db_flush;
+    due = s->db_due;
+    s->db_due = 0;
+    pthread_mutex_unlock(&s->db_mutex);
+
+    for (job = batch; job; job = next) {
+      next = job->next;
+      run_chuchu_db_job(s, job);
+      finish_chuchu_db_job(s, job);
+    }
+    if (dirty_count > 0 && (flush || (due & DB_DUE_RANKING)))
+      flush_player_ranking(s);
+    if (__atomic_load_n(&downloads_dirty, __ATOMIC_SEQ_CST) && (flush || (due & DB_DUE_DOWNLOADS)))
+      flush_puzzle_downloads(s);
+    if (flush) {
+      pthread_mutex_lock(&s->db_mutex);
+      s->db_flush = 0;
+      pthread_cond_broadcast(&s->db_done_cond);
+      pthread_mutex_unlock(&s->db_mutex);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Function: start_chuchu_db_worker
+ * --------------------
+ *
+ * Starts the DB worker thread
+ * 
+ *  *s: ptr to server data struct
+ *  event_fd: eventfd signaled when a job is done,
+ *            -1 => threads wait with wait_chuchu_db_job
+ *
+ *  returns: 1 => OK
+ *           0 => FAILED
+ *
+ */
+int start_chuchu_db_worker(server_data_t *s, int event_fd) {
+  pthread_t thread_id;
+
+  s->db_first = NULL;
+  s->db_last = NULL;
+  s->db_done = NULL;
+  s->db_flush = 0;
+  s->db_due = 0;
+  s->db_event_fd = event_fd;
+  if (pthread_mutex_init(&s->db_mutex, NULL) ||
+      pthread_cond_init(&s->db_cond, NULL) ||
+      pthread_cond_init(&s->db_done_cond, NULL))
+    return 0;
+  //Deadlines come from the lobby timer wheel
+  init_chuchu_timer(&ranking_timer, due_chuchu_db_timer, s);
+  init_chuchu_timer(&downloads_timer, due_chuchu_db_timer, s);
+  init_chuchu_timer(&top_ranking_timer, refresh_top_ranking, s);
+  if (pthread_create(&thread_id, NULL, chuchu_db_worker, s)) {
+    chuchu_error(SERVER, "Could not create DB worker thread");
+    return 0;
+  }
+  pthread_detach(thread_id);
+  add_chuchu_timer(&top_ranking_timer, CHUCHU_TOP_RANKING_TTL * 1000 / 2);
+  return 1;
+}
+
+/*
+ * Function: flush_chuchu_db_worker
+ * --------------------
+ *
+ * Runs the queued jobs and writes the ranking
+ * buffer and download counters now, blocks until
+ * it is done. Used on shutdown.
+ * 
+ *  *s: ptr to server data struct
+ *
+ *  returns: void
+ *
+ */
+void flush_chuchu_db_worker(server_data_t *s) {
+  pthread_mutex_lock(&s->db_mutex);
+  s->db_flush = 1;
+  pthread_cond_signal(&s->db_cond);
+  while (s->db_flush)
+    pthread_cond_wait(&s->db_done_cond, &s->db_mutex);
+  pthread_mutex_unlock(&s->db_mutex);
+}
+
+/*
+ * DB MAINTENANCE
+ *
+ * Connections don't checkpoint on commit, a thread per process
+ * checkpoints the WAL every CHUCHU_DB_CHECKPOINT_INTERVAL seconds
+ * and gives free pages back to the file system.
+ */
+
+/*
+ * Function: run_chuchu_db_maintenance
+ * --------------------
+ *
+ * Checkpoints the WAL without waiting for readers
+ * or writers and runs a step of incremental vacuum
+ * 
+ *  *s: ptr to server data struct
+ *  *db: connection of the maintenance thread
+ *
+ *  returns: void
+ *
+ */
+static void run_chuchu_db_maintenance(server_data_t *s, sqlite3 *db) {
+  char wal_path[sizeof(s->chu_db_path) + 4];
+  struct stat st;
+  uint64_t start, usec;
+  int rc, frames = 0, done = 0, free_pages;
+  static int last_frames = 0;
+
+  snprintf(wal_path, sizeof(wal_path), "%s-wal", s->chu_db_path);
+  s->db_wal_bytes = (stat(wal_path, &st) == 0) ? (uint64_t)st.st_size : 0;
+
+  start = chuchu_usec();
+  rc = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &frames, &done);
+  usec = chuchu_usec() - start;
+  if (rc != SQLITE_OK && rc != SQLITE_BUSY)
+    chuchu_error(SERVER, "WAL checkpoint failed: %s", sqlite3_errmsg(db));
+  s->db_checkpoints++;
+  s->db_checkpoint_usec += usec;
+  if (usec > s->db_checkpoint_max_usec)
+    s->db_checkpoint_max_usec = usec;
+
+  free_pages = get_chuchu_db_pragma(db, "PRAGMA freelist_count;");
+  if (free_pages > 0) {
+    if (sqlite3_exec(db, "PRAGMA incremental_vacuum(" CHUCHU_VACUUM_PAGES ");", NULL, NULL, NULL) == SQLITE_OK)
+      s->db_vacuumed_pages += (uint64_t)free_pages - (uint64_t)get_chuchu_db_pragma(db, "PRAGMA freelist_count;");
+  }
+
+  //Quiet when there was nothing to do
+  if (frames != last_frames || free_pages > 0)
+    chuchu_info(SERVER, "DB checkpoint: WAL %llu bytes, %d/%d frames in %llu us (avg %llu us, max %llu us), %llu pages vacuumed",
+		(unsigned long long)s->db_wal_bytes, done, frames, (unsigned long long)usec,
+		(unsigned long long)(s->db_checkpoint_usec / s->db_checkpoints),
+		(unsigned long long)s->db_checkpoint_max_usec, (unsigned long long)s->db_vacuumed_pages);
+  last_frames = frames;
+}
+
+static void *chuchu_db_maintenance(void *data) {
+  server_data_t *s = (server_data_t *)data;
+  chuchu_db_conn_t *conn;
+
+  for (;;) {
+    sleep((unsigned)s->db_checkpoint_interval);
+    if ((conn = get_chuchu_db_conn(s->chu_db_path)) != NULL)
+      run_chuchu_db_maintenance(s, conn->db);
+  }
+  return NULL;
+}
+
+/*
+ * Function: start_chuchu_db_maintenance
+ * --------------------
+ *
+ * Applies the synchronous level of the config and
+ * starts the checkpoint thread, call it before any
+ * other thread opens the DB
+ * 
+ *  *s: ptr to server data struct
+ *
+ *  returns: 1 => OK
+ *           0 => FAILED
+ *
+ */
+int start_chuchu_db_maintenance(server_data_t *s) {
+  pthread_t thread_id;
+
+  db_synchronous = s->db_synchronous;
+  s->db_checkpoints = 0;
+  s->db_checkpoint_usec = 0;
+  s->db_checkpoint_max_usec = 0;
+  s->db_wal_bytes = 0;
+  s->db_vacuumed_pages = 0;
+  if (s->db_checkpoint_interval <= 0)
+    return 1;
+  if (pthread_create(&thread_id, NULL, chuchu_db_maintenance, s)) {
+    chuchu_error(SERVER, "Could not create DB maintenance thread");
+    return 0;
+  }
+  pthread_detach(thread_id);
+  db_autocheckpoint = 0;
+  return 1;
+}
@@ -1,15 +1,96 @@
 #include <sqlite3.h> 
 
-sqlite3* open_chuchu_db(void);
+sqlite3* open_chuchu_db(const char* db_path);
+int migrate_chuchu_db(const char* db_path);
+int start_chuchu_db_maintenance(server_data_t *s);
+
+//WAL file is cut back to this size after a checkpoint
+#define CHUCHU_WAL_SIZE_LIMIT (4 * 1024 * 1024)
+//Free pages given back per maintenance run
+#define CHUCHU_VACUUM_PAGES "256"
 int write_player_to_chuchu_db(const char* db_path, const char* dc_id, const char* u_name, const char* passwd);
 int load_puzzles_to_array(server_data_t *s);
 int is_player_in_chuchu_db(const char* db_path, const char* name_or_dc_id, int name_search);
-int is_puzzle_in_chuchu_db(const char* db_path, const char* p_name, const char* u_name);
 int read_puzzle_in_chuchu_db(server_data_t *s, const char* db_path, char* msg, uint32_t id);
 int write_puzzle_in_chuchu_db(server_data_t *s, const char* p_name, const char* u_name, char* data, int nData);
 int is_username_taken(const char* db_path, const char* u_name);
 int validate_player_login(const char* db_path, const char* u_name, const char* passwd, const char* dc_id);
 int read_ranking_from_chuchu_db(const char* db_path, player_t* pl);
-int update_player_ranking_to_chuchu_db(const char* db_path, player_t* pl);
 int read_top_ranking_from_chuchu_db(char* msg, const char* db_path);
-int update_puzzle_downloaded_to_chuchu_db(server_data_t *s,const char* db_path, uint32_t id);
+int get_top_ranking_from_cache(char* msg);
+
+int get_puzzle_from_cache(uint32_t id, char* msg);
+
+//Puzzle cache, bodies are at most MAX_PKT_SIZE
+#define CHUCHU_PUZZLE_CACHE_BYTES (1024*1024)
+#define CHUCHU_PUZZLE_CACHE_BUCKETS 256
+
+//Top ranking cache, rebuilt after this many seconds at the latest
+#define CHUCHU_TOP_RANKING_ROWS 10
+#define CHUCHU_TOP_RANKING_SIZE 1024
+#define CHUCHU_TOP_RANKING_TTL 60
+void count_puzzle_download(server_data_t *s, uint32_t id);
+
+//Statements prepared once per connection
+typedef enum {
+  STMT_PLAYER_BY_NAME,
+  STMT_PLAYER_BY_DC_ID,
+  STMT_USERNAME_TAKEN,
+  STMT_VALIDATE_LOGIN,
+  STMT_WRITE_PLAYER,
+  STMT_LOAD_PUZZLES,
+  STMT_WRITE_PUZZLE,
+  STMT_READ_PUZZLE,
+  STMT_UPDATE_DOWNLOADED,
+  STMT_UPDATE_RANKING,
+  STMT_READ_RANKING,
+  STMT_TOP_RANKING,
+  CHUCHU_STMT_COUNT,
+} CHUCHU_STMT;
+
+//DB worker
+typedef enum {
+  DB_READ_RANKING = 0x01,
+  DB_UPDATE_RANKING = 0x02, //Rounds to add, no reply
+  DB_TOP_RANKING = 0x03,
+  DB_UPLOAD_PUZZLE = 0x04,
+  DB_READ_PUZZLE = 0x05,
+  DB_RUN = 0x06, //Calls run, for DB work outside chuchu_sql.c
+} DB_JOB;
+
+typedef struct chuchu_db_job {
+  struct chuchu_db_job *next;
+  DB_JOB type;
+  player_t *pl;
+  int (*done)(struct chuchu_db_job *job);
+  int (*run)(struct chuchu_db_job *job);
+  int finished;
+  //Request
+  char username[MAX_UNAME_LEN];
+  char dreamcast_id[6];
+  char p_name[MAX_UNAME_LEN];
+  uint32_t id;
+  uint32_t won_rnds, lost_rnds, total_rnds;
+  //Won rounds after a DB_UPDATE_RANKING
+  uint32_t ranked_won;
+  //Result
+  int found;
+  int rc;
+  //Request or result data
+  int size;
+  char data[MAX_PKT_SIZE];
+} chuchu_db_job_t;
+
+int start_chuchu_db_worker(server_data_t *s, int event_fd);
+chuchu_db_job_t *new_chuchu_db_job(player_t *pl, DB_JOB type, int (*done)(chuchu_db_job_t *job));
+void post_chuchu_db_job(server_data_t *s, chuchu_db_job_t *job);
+void wait_chuchu_db_job(server_data_t *s, chuchu_db_job_t *job);
+chuchu_db_job_t *get_chuchu_db_done(server_data_t *s);
+void free_chuchu_db_job(chuchu_db_job_t *job);
+void flush_chuchu_db_worker(server_data_t *s);
+
+//Ranking write-behind, flushed after this many ms or entries
+#define CHUCHU_RANKING_FLUSH_MS 1000
+#define CHUCHU_RANKING_BATCH 64
+//Download counters are written after this many ms
+#define CHUCHU_DOWNLOADS_FLUSH_MS 5000
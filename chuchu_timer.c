@@ -0,0 +1,267 @@
+/*
+ *
+ * Copyright 2026 Flyinghead
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * ChuChu timer wheel
+ *
+ * Hierarchical timing wheel with CHUCHU_TIMER_LEVELS levels of
+ * CHUCHU_TIMER_SLOTS slots. Level n holds the timers that are due
+ * within 64^(n+1) ticks and moves them one level down when the
+ * wheel below it has turned once, so adding, deleting and expiring
+ * a timer never looks at the other timers.
+ *
+ * Any thread may add or delete timers, the lobby loop runs them
+ * with run_chuchu_timers and sleeps for as long as it returns.
+ * Callbacks run on that thread without the wheel lock held.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "chuchu_common.h"
+
+#define TIMER_MASK (CHUCHU_TIMER_SLOTS - 1)
+#define TIMER_RANGE ((uint64_t)1 << (CHUCHU_TIMER_BITS * CHUCHU_TIMER_LEVELS))
+
+static struct {
+  pthread_mutex_t lock;
+  chuchu_timer_t *slots[CHUCHU_TIMER_LEVELS][CHUCHU_TIMER_SLOTS];
+  //Expired, waiting for their callback
+  chuchu_timer_t *due;
+  //Next tick to run
+  uint64_t now;
+  //Tick the loop sleeps until, an earlier timer wakes it up
+  uint64_t wake_at;
+  int count;
+  int wake_fd;
+} wheel = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake_at = UINT64_MAX, .wake_fd = -1 };
+
+static uint64_t chuchu_msec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void link_timer(chuchu_timer_t **head, chuchu_timer_t *t) {
+  t->next = *head;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+}
+
+static void unlink_timer(chuchu_timer_t *t) {
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+/*
+ * Function: queue_timer
+ * --------------------
+ * puts a timer in the slot of the lowest level that
+ * reaches its expiry, wheel locked
+ *
+ *  *t: pointer to timer
+ *
+ *  returns: void
+ *
+ */
+static void queue_timer(chuchu_timer_t *t) {
+  uint64_t delta;
+  int level = 0;
+
+  if (t->expires < wheel.now)
+    t->expires = wheel.now;
+  if (t->expires - wheel.now >= TIMER_RANGE)
+    t->expires = wheel.now + TIMER_RANGE - 1;
+  delta = t->expires - wheel.now;
+  while (delta >= (uint64_t)1 << (CHUCHU_TIMER_BITS * (level + 1)))
+    level++;
+  link_timer(&wheel.slots[level][(t->expires >> (CHUCHU_TIMER_BITS * level)) & TIMER_MASK], t);
+}
+
+/*
+ * Function: run_timer_tick
+ * --------------------
+ * runs tick wheel.now: moves the slots of the upper levels
+ * that start at this tick down and the expired timers to
+ * the due list, wheel locked
+ *
+ *  returns: void
+ *
+ */
+static void run_timer_tick(void) {
+  chuchu_timer_t *t, *list;
+  int level;
+
+  for (level=1;level<CHUCHU_TIMER_LEVELS;level++) {
+    if (wheel.now & (((uint64_t)1 << (CHUCHU_TIMER_BITS * level)) - 1))
+      break;
+    list = wheel.slots[level][(wheel.now >> (CHUCHU_TIMER_BITS * level)) & TIMER_MASK];
+    wheel.slots[level][(wheel.now >> (CHUCHU_TIMER_BITS * level)) & TIMER_MASK] = NULL;
+    while ((t = list) != NULL) {
+      list = t->next;
+      queue_timer(t);
+    }
+  }
+  while ((t = wheel.slots[0][wheel.now & TIMER_MASK]) != NULL) {
+    unlink_timer(t);
+    link_timer(&wheel.due, t);
+  }
+  wheel.now++;
+}
+
+/*
+ * Function: init_chuchu_timers
+ * --------------------
+ * starts the wheel at the current time
+ *
+ *  returns: >=0 => eventfd the loop has to wait on
+ *            -1 => FAIL
+ *
+ */
+int init_chuchu_timers(void) {
+  pthread_mutex_lock(&wheel.lock);
+  wheel.now = chuchu_msec() / CHUCHU_TIMER_TICK_MS;
+  wheel.wake_at = UINT64_MAX;
+  if (wheel.wake_fd < 0)
+    wheel.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  pthread_mutex_unlock(&wheel.lock);
+  if (wheel.wake_fd < 0)
+    chuchu_error(SERVER, "Timer eventfd failed: %s", strerror(errno));
+  return wheel.wake_fd;
+}
+
+void init_chuchu_timer(chuchu_timer_t *t, void (*fn)(chuchu_timer_t *t), void *data) {
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->fn = fn;
+  t->data = data;
+}
+
+/*
+ * Function: add_chuchu_timer
+ * --------------------
+ * (re)arms a timer, wakes up the loop if it
+ * sleeps past the new expiry
+ *
+ *  *t: pointer to timer
+ *  ms: delay, rounded up to CHUCHU_TIMER_TICK_MS
+ *
+ *  returns: void
+ *
+ */
+void add_chuchu_timer(chuchu_timer_t *t, uint64_t ms) {
+  uint64_t one = 1;
+  int wake = 0;
+
+  pthread_mutex_lock(&wheel.lock);
+  if (t->pprev)
+    unlink_timer(t);
+  else
+    wheel.count++;
+  t->expires = (chuchu_msec() + ms + CHUCHU_TIMER_TICK_MS - 1) / CHUCHU_TIMER_TICK_MS;
+  queue_timer(t);
+  if (wheel.wake_fd >= 0 && t->expires < wheel.wake_at) {
+    wheel.wake_at = t->expires;
+    wake = 1;
+  }
+  pthread_mutex_unlock(&wheel.lock);
+  if (wake && write(wheel.wake_fd, &one, sizeof(one)) < 0)
+    chuchu_error(SERVER, "Timer wake up failed: %s", strerror(errno));
+}
+
+/*
+ * Function: del_chuchu_timer
+ * --------------------
+ * disarms a timer, does not wait for a callback
+ * that is already running
+ *
+ *  *t: pointer to timer
+ *
+ *  returns: void
+ *
+ */
+void del_chuchu_timer(chuchu_timer_t *t) {
+  pthread_mutex_lock(&wheel.lock);
+  if (t->pprev) {
+    unlink_timer(t);
+    wheel.count--;
+  }
+  pthread_mutex_unlock(&wheel.lock);
+}
+
+int pending_chuchu_timer(chuchu_timer_t *t) {
+  int pending;
+
+  pthread_mutex_lock(&wheel.lock);
+  pending = t->pprev != NULL;
+  pthread_mutex_unlock(&wheel.lock);
+  return pending;
+}
+
+/*
+ * Function: run_chuchu_timers
+ * --------------------
+ * catches the wheel up with the clock and runs the
+ * callbacks of the expired timers
+ *
+ *  returns: ms until the next tick that has a timer or
+ *           moves timers down, -1 => no timers
+ *
+ */
+int run_chuchu_timers(void) {
+  chuchu_timer_t *t;
+  uint64_t one, now_ms, wake_ms;
+  int i;
+
+  if (wheel.wake_fd >= 0 && read(wheel.wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    chuchu_error(SERVER, "Timer eventfd read failed: %s", strerror(errno));
+
+  pthread_mutex_lock(&wheel.lock);
+  now_ms = chuchu_msec();
+  while (wheel.now <= now_ms / CHUCHU_TIMER_TICK_MS)
+    run_timer_tick();
+  //Callbacks may add or delete timers, even their own
+  while ((t = wheel.due) != NULL) {
+    unlink_timer(t);
+    wheel.count--;
+    pthread_mutex_unlock(&wheel.lock);
+    t->fn(t);
+    pthread_mutex_lock(&wheel.lock);
+  }
+  if (wheel.count == 0) {
+    wheel.wake_at = UINT64_MAX;
+    pthread_mutex_unlock(&wheel.lock);
+    return -1;
+  }
+  //Nothing in the rest of level 0 => wake up when it wraps
+  for (i=(int)(wheel.now & TIMER_MASK);i<CHUCHU_TIMER_SLOTS && wheel.slots[0][i] == NULL;i++);
+  wheel.wake_at = wheel.now + (uint64_t)i - (wheel.now & TIMER_MASK);
+  wake_ms = wheel.wake_at * CHUCHU_TIMER_TICK_MS;
+  pthread_mutex_unlock(&wheel.lock);
+
+  now_ms = chuchu_msec();
+  return wake_ms > now_ms ? (int)(wake_ms - now_ms) : 0;
+}
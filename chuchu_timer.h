@@ -0,0 +1,33 @@
+/*
+
+  ChuChu timer wheel header
+  Timers are embedded in the struct they belong to
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Resolution of the wheel and how far ahead it reaches (64^4 ticks, ~19 days)
+#define CHUCHU_TIMER_TICK_MS 100
+#define CHUCHU_TIMER_BITS 6
+#define CHUCHU_TIMER_SLOTS (1 << CHUCHU_TIMER_BITS)
+#define CHUCHU_TIMER_LEVELS 4
+
+typedef struct chuchu_timer {
+  struct chuchu_timer *next;
+  struct chuchu_timer **pprev;
+  uint64_t expires;
+  void (*fn)(struct chuchu_timer *t);
+  void *data;
+} chuchu_timer_t;
+
+//Struct a timer is embedded in
+#define chuchu_timer_entry(t, type, member) ((type *)((char *)(t) - offsetof(type, member)))
+
+int init_chuchu_timers(void);
+void init_chuchu_timer(chuchu_timer_t *t, void (*fn)(chuchu_timer_t *t), void *data);
+void add_chuchu_timer(chuchu_timer_t *t, uint64_t ms);
+void del_chuchu_timer(chuchu_timer_t *t);
+int pending_chuchu_timer(chuchu_timer_t *t);
+int run_chuchu_timers(void);
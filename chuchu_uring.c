@@ -0,0 +1,287 @@
+/*
+ *
+ * Copyright 2026 Flyinghead
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ * ChuChu io_uring functions
+ *
+ * Thin wrapper around the io_uring syscalls, only what the
+ * login server needs: SQ/CQ rings and a provided buffer ring.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "chuchu_common.h"
+#include "chuchu_uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Function: chuchu_uring_init
+ * --------------------
+ * creates the ring and maps the SQ/CQ rings and SQE array
+ *
+ *  *r: pointer to ring struct
+ *  entries: nr of SQ entries, CQ gets twice as many
+ *
+ *  returns: 1 => OK
+ *           0 => FAIL, io_uring not available
+ *
+ */
+int chuchu_uring_init(chuchu_uring_t *r, unsigned entries) {
+  struct io_uring_params p;
+  char *sq_ring, *cq_ring;
+
+  memset(r, 0, sizeof(chuchu_uring_t));
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 2;
+
+  r->fd = sys_io_uring_setup(entries, &p);
+  if (r->fd < 0) {
+    chuchu_error(SERVER, "io_uring_setup failed: %s", strerror(errno));
+    return 0;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    chuchu_error(SERVER, "io_uring is too old");
+    close(r->fd);
+    return 0;
+  }
+
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (r->cq_ring_size > r->sq_ring_size)
+    r->sq_ring_size = r->cq_ring_size;
+  r->cq_ring_size = r->sq_ring_size;
+
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) {
+    close(r->fd);
+    return 0;
+  }
+  r->cq_ring = r->sq_ring;
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    return 0;
+  }
+
+  sq_ring = r->sq_ring;
+  cq_ring = r->cq_ring;
+  r->sq_entries = p.sq_entries;
+  r->sq_head = (unsigned *)(sq_ring + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq_ring + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq_ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq_ring + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq_ring + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq_ring + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq_ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq_ring + p.cq_off.cqes);
+  r->sq_local_tail = *r->sq_tail;
+
+  return 1;
+}
+
+/*
+ * Function: chuchu_uring_setup_bufs
+ * --------------------
+ * registers a provided buffer ring (group CHUCHU_URING_BGID)
+ * that recv ops pick their buffer from
+ *
+ *  *r: pointer to ring struct
+ *  count: nr of buffers, power of 2
+ *  size: size of each buffer
+ *
+ *  returns: 1 => OK
+ *           0 => FAIL, kernel without buffer rings
+ *
+ */
+int chuchu_uring_setup_bufs(chuchu_uring_t *r, unsigned count, unsigned size) {
+  struct io_uring_buf_reg reg;
+  size_t ring_size = count * sizeof(struct io_uring_buf);
+  unsigned i;
+
+  r->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->buf_ring == MAP_FAILED) {
+    r->buf_ring = NULL;
+    return 0;
+  }
+  r->bufs = malloc((size_t)count * size);
+  if (r->bufs == NULL) {
+    munmap(r->buf_ring, ring_size);
+    r->buf_ring = NULL;
+    return 0;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)r->buf_ring;
+  reg.ring_entries = count;
+  reg.bgid = CHUCHU_URING_BGID;
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    chuchu_error(SERVER, "io_uring buffer ring failed: %s", strerror(errno));
+    free(r->bufs);
+    munmap(r->buf_ring, ring_size);
+    r->bufs = NULL;
+    r->buf_ring = NULL;
+    return 0;
+  }
+  r->buf_count = count;
+  r->buf_size = size;
+  r->buf_tail = 0;
+  for (i=0;i<count;i++)
+    chuchu_uring_recycle_buf(r, (uint16_t)i);
+
+  return 1;
+}
+
+void chuchu_uring_exit(chuchu_uring_t *r) {
+  if (r->buf_ring) {
+    munmap(r->buf_ring, r->buf_count * sizeof(struct io_uring_buf));
+    free(r->bufs);
+  }
+  munmap(r->sqes, r->sqes_size);
+  munmap(r->sq_ring, r->sq_ring_size);
+  close(r->fd);
+}
+
+/*
+ * Function: chuchu_uring_reserve
+ * --------------------
+ * makes sure the next n SQEs are free, submits the queued
+ * ones first if needed, so linked SQEs go in one submit
+ *
+ *  *r: pointer to ring struct
+ *  n: nr of SQEs
+ *
+ *  returns: 1 => OK
+ *           0 => FAIL
+ *
+ */
+int chuchu_uring_reserve(chuchu_uring_t *r, unsigned n) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+  if (r->sq_local_tail - head + n > r->sq_entries) {
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    if (sys_io_uring_enter(r->fd, r->sq_local_tail - head, 0, 0) < 0)
+      return 0;
+    head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head + n > r->sq_entries)
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Function: chuchu_uring_get_sqe
+ * --------------------
+ * returns the next free and zeroed SQE, submits
+ * the queued ones first if the SQ is full
+ *
+ *  *r: pointer to ring struct
+ *
+ *  returns: pointer to SQE
+ *           NULL => FAIL
+ *
+ */
+struct io_uring_sqe *chuchu_uring_get_sqe(chuchu_uring_t *r) {
+  struct io_uring_sqe *sqe;
+
+  if (!chuchu_uring_reserve(r, 1))
+    return NULL;
+  sqe = &r->sqes[r->sq_local_tail & *r->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  r->sq_array[r->sq_local_tail & *r->sq_mask] = r->sq_local_tail & *r->sq_mask;
+  r->sq_local_tail++;
+
+  return sqe;
+}
+
+/*
+ * Function: chuchu_uring_submit_and_wait
+ * --------------------
+ * submits all queued SQEs and waits for at least one CQE
+ *
+ *  *r: pointer to ring struct
+ *
+ *  returns: >=0 => nr of submitted SQEs
+ *            <0 => FAIL
+ *
+ */
+int chuchu_uring_submit_and_wait(chuchu_uring_t *r) {
+  unsigned to_submit;
+  int rc;
+
+  __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+  do {
+    to_submit = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    rc = sys_io_uring_enter(r->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+  } while (rc < 0 && errno == EINTR);
+
+  return rc;
+}
+
+struct io_uring_cqe *chuchu_uring_peek_cqe(chuchu_uring_t *r) {
+  unsigned head = *r->cq_head;
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void chuchu_uring_cqe_seen(chuchu_uring_t *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char *chuchu_uring_buf(chuchu_uring_t *r, uint16_t bid) {
+  return &r->bufs[(size_t)bid * r->buf_size];
+}
+
+/*
+ * Function: chuchu_uring_recycle_buf
+ * --------------------
+ * gives a provided buffer back to the kernel
+ *
+ *  *r: pointer to ring struct
+ *  bid: buffer id from the recv CQE
+ *
+ *  returns: void
+ *
+ */
+void chuchu_uring_recycle_buf(chuchu_uring_t *r, uint16_t bid) {
+  struct io_uring_buf *buf = &r->buf_ring->bufs[r->buf_tail & (r->buf_count - 1)];
+
+  buf->addr = (unsigned long)chuchu_uring_buf(r, bid);
+  buf->len = r->buf_size;
+  buf->bid = bid;
+  r->buf_tail++;
+  __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
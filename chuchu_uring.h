@@ -0,0 +1,41 @@
+/*
+
+  ChuChu io_uring helper header
+  Minimal raw syscall wrapper, no liburing needed
+
+*/
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  unsigned sq_local_tail;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+
+  //Provided buffers
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+  unsigned buf_count;
+  unsigned buf_size;
+  uint16_t buf_tail;
+} chuchu_uring_t;
+
+#define CHUCHU_URING_BGID 0
+
+int chuchu_uring_init(chuchu_uring_t *r, unsigned entries);
+int chuchu_uring_setup_bufs(chuchu_uring_t *r, unsigned count, unsigned size);
+void chuchu_uring_exit(chuchu_uring_t *r);
+int chuchu_uring_reserve(chuchu_uring_t *r, unsigned n);
+struct io_uring_sqe *chuchu_uring_get_sqe(chuchu_uring_t *r);
+int chuchu_uring_submit_and_wait(chuchu_uring_t *r);
+struct io_uring_cqe *chuchu_uring_peek_cqe(chuchu_uring_t *r);
+void chuchu_uring_cqe_seen(chuchu_uring_t *r);
+char *chuchu_uring_buf(chuchu_uring_t *r, uint16_t bid);
+void chuchu_uring_recycle_buf(chuchu_uring_t *r, uint16_t bid);
@@ -0,0 +1,137 @@
+/*
+ *
+ * ChuChu broadcast benchmark
+ *
+ * Fills the player registry with authorized players on
+ * socketpairs and sends the same msg to all of them, once
+ * with one send_chuchu_crypt_msg per player and once with
+ * send_chuchu_bcast under players_lock, for a few lobby
+ * sizes. Prints the time per broadcast and how much of it
+ * is spent holding the lock.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "chuchu_common.h"
+
+#define BENCH_ROUNDS 2000
+#define BENCH_MSG_SIZE 80
+#define BENCH_MAX_LOBBY 500
+
+static double now_us(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec * 1e6 + (double)t.tv_nsec / 1e3;
+}
+
+static void drain_peers(int *peer, int n) {
+  static char buf[65536];
+  int i;
+
+  for (i = 0; i < n; i++)
+    while (recv(peer[i], buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
+
+/*
+ * Function: add_bench_player
+ * --------------------
+ * adds an authorized player whose socket is one end
+ * of a socketpair, peer gets the other end
+ *
+ *  *s: pointer to server data struct
+ *  i: nr of the player
+ *  *peer: receiving end
+ *
+ *  returns: 1 => OK
+ *           0 => FAILED
+ *
+ */
+static int add_bench_player(server_data_t *s, int i, int *peer) {
+  player_t *pl;
+  int sv[2], sndbuf = 1 << 22;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    return 0;
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  if ((pl = alloc_chuchu_pool(&s->player_pool)) == NULL)
+    return 0;
+  memset(pl, 0, sizeof(player_t));
+  pl->sock = sv[0];
+  pl->client_id = (uint32_t)(i + 0x0100);
+  pl->data = s;
+  pl->nonblock = 1;
+  init_chuchu_tx(pl);
+  CRYPT_DC_CreateKeys(&pl->server_cipher, (uint32_t)i);
+  snprintf(pl->username, sizeof(pl->username), "bench%d", i);
+  memcpy(pl->dreamcast_id, &i, sizeof(i));
+  lock_players(s, 1);
+  add_chuchu_player(s, pl);
+  authorize_chuchu_player(s, pl);
+  unlock_players(s);
+  *peer = sv[1];
+  return 1;
+}
+
+int main(void) {
+  static server_data_t s;
+  static int peer[BENCH_MAX_LOBBY];
+  int sizes[] = { 10, 50, 100, 250, BENCH_MAX_LOBBY };
+  char msg[BENCH_MSG_SIZE], tmp[BENCH_MSG_SIZE];
+  double t0, t1, t_send, t_bcast, t_lock;
+  player_t *pl;
+  unsigned k;
+  int i, r, n;
+
+  s.m_cli = BENCH_MAX_LOBBY;
+  s.epoll_fd = -1;
+  s.p_l = calloc((size_t)s.m_cli, sizeof(player_t *));
+  if (s.p_l == NULL || !init_chuchu_locks(&s) || !init_chuchu_registry(&s) ||
+      !init_chuchu_pool(&s.player_pool, "players", sizeof(player_t), CHUCHU_POOL_SLAB, 0))
+    return 1;
+  memset(msg, 0x41, sizeof(msg));
+  create_chuchu_hdr(msg, 0x06, 0, BENCH_MSG_SIZE);
+
+  for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    n = sizes[k];
+    for (i = 0; i < n; i++)
+      if (!add_bench_player(&s, i, &peer[i]))
+	return 1;
+    t_send = t_bcast = t_lock = 0;
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+      t0 = now_us();
+      for (i = 0; i < n; i++) {
+	//Encrypted in place, every player gets a fresh copy
+	memcpy(tmp, msg, sizeof(msg));
+	send_chuchu_crypt_msg(s.p_l[i], tmp, BENCH_MSG_SIZE);
+      }
+      t_send += now_us() - t0;
+      drain_peers(peer, n);
+
+      t0 = now_us();
+      lock_players(&s, 0);
+      send_chuchu_bcast(&s, BCAST_AUTHORIZED, NULL, msg, BENCH_MSG_SIZE);
+      t1 = now_us();
+      unlock_players(&s);
+      t_lock += t1 - t0;
+      t_bcast += now_us() - t0;
+      drain_peers(peer, n);
+    }
+    printf("lobby %4d: per player send %7.1f us, bcast %7.1f us, %6.1f us of it under players_lock\n",
+	   n, t_send / BENCH_ROUNDS, t_bcast / BENCH_ROUNDS, t_lock / BENCH_ROUNDS);
+
+    lock_players(&s, 1);
+    for (i = 0; i < n; i++) {
+      pl = s.p_l[i];
+      remove_chuchu_player(&s, pl);
+      close(pl->sock);
+      close(peer[i]);
+      put_chuchu_player(pl);
+    }
+    unlock_players(&s);
+  }
+  return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ *
+ * ChuChu DB benchmark
+ *
+ * Creates a DB from createdb.sql in a temp dir and calls
+ * each exported function of chuchu_sql.c in a loop, as
+ * the login server and the DB worker do. Prints calls/s
+ * per function. The server logs are sent to /dev/null.
+ *
+ * usage: bench_sql <createdb.sql> [calls]
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "chuchu_common.h"
+#include "chuchu_sql.h"
+
+#define BENCH_CALLS 2000
+#define BENCH_LOADS 20
+#define BENCH_DC_ID "\x01\x02\x03\x04\x05\x06"
+
+#define BENCH(name, n, call) do {					\
+    double t0 = now_s();						\
+    for (i = 0; i < (n); i++) {						\
+      call;								\
+    }									\
+    printf("%-40s %10.0f calls/s\n", name, (n) / (now_s() - t0));	\
+  } while (0)
+
+static double now_s(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+/*
+ * Function: create_bench_db
+ * --------------------
+ * runs the schema script on a new DB
+ *
+ *  *db_path: DB to create
+ *  *sql_path: createdb.sql
+ *
+ *  returns: 1 => OK
+ *           0 => FAILED
+ *
+ */
+static int create_bench_db(const char *db_path, const char *sql_path) {
+  FILE *file;
+  char *sql;
+  long size;
+  sqlite3 *db;
+  int rc;
+
+  if ((file = fopen(sql_path, "r")) == NULL) {
+    perror(sql_path);
+    return 0;
+  }
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  rewind(file);
+  if (size < 0 || (sql = calloc(1, (size_t)size + 1)) == NULL) {
+    fclose(file);
+    return 0;
+  }
+  rc = fread(sql, 1, (size_t)size, file) == (size_t)size;
+  fclose(file);
+  if (rc && sqlite3_open(db_path, &db) == SQLITE_OK) {
+    rc = sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK;
+    sqlite3_close(db);
+  } else {
+    rc = 0;
+  }
+  free(sql);
+  return rc;
+}
+
+//Loads the catalog into an empty copy of s, like at startup
+static void load_bench_puzzles(server_data_t *s) {
+  server_data_t c;
+  int i;
+
+  memset(&c, 0, sizeof(c));
+  strlcpy(c.chu_db_path, s->chu_db_path, sizeof(c.chu_db_path));
+  c.m_puzz = s->m_puzz;
+  if (!init_chuchu_puzzles(&c))
+    return;
+  load_puzzles_to_array(&c);
+  for (i = 0; i < c.puzz_count; i++)
+    free(c.puzz_l[i]);
+  free(c.puzz_l);
+  free(c.puzz_id_hash);
+  free(c.puzz_name_hash);
+}
+
+int main(int argc, char **argv) {
+  static server_data_t s;
+  player_t pl;
+  char dir[] = "/tmp/chuchu_bench.XXXXXX";
+  char msg[MAX_PKT_SIZE], data[0x390 - 0x14], name[32], path[64];
+  int i, n;
+
+  if (argc < 2) {
+    printf("usage: %s <createdb.sql> [calls]\n", argv[0]);
+    return 1;
+  }
+  n = argc > 2 ? atoi(argv[2]) : BENCH_CALLS;
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(s.chu_db_path, sizeof(s.chu_db_path), "%s/bench.db", dir);
+  if (!create_bench_db(s.chu_db_path, argv[1]))
+    return 1;
+  s.m_puzz = 16;
+  if (!init_chuchu_locks(&s) || !init_chuchu_puzzles(&s))
+    return 1;
+  memset(&pl, 0, sizeof(pl));
+  memset(data, 0x55, sizeof(data));
+  if (freopen("/dev/null", "w", stderr) == NULL)
+    return 1;
+
+  BENCH("write_player_to_chuchu_db", n,
+	(snprintf(name, sizeof(name), "user%d", i),
+	 write_player_to_chuchu_db(s.chu_db_path, BENCH_DC_ID, name, "pw")));
+  BENCH("is_player_in_chuchu_db (name)", n, is_player_in_chuchu_db(s.chu_db_path, "user7", 1));
+  BENCH("is_player_in_chuchu_db (dc id)", n, is_player_in_chuchu_db(s.chu_db_path, BENCH_DC_ID, 0));
+  BENCH("is_username_taken", n, is_username_taken(s.chu_db_path, "user7"));
+  BENCH("validate_player_login", n, validate_player_login(s.chu_db_path, "user7", "pw", BENCH_DC_ID));
+  strlcpy(pl.username, "user7", sizeof(pl.username));
+  memcpy(pl.dreamcast_id, BENCH_DC_ID, sizeof(pl.dreamcast_id));
+  BENCH("read_ranking_from_chuchu_db", n, read_ranking_from_chuchu_db(s.chu_db_path, &pl));
+  BENCH("read_top_ranking_from_chuchu_db", n, read_top_ranking_from_chuchu_db(msg, s.chu_db_path));
+  BENCH("write_puzzle_in_chuchu_db", n,
+	(snprintf(name, sizeof(name), "p%d", i),
+	 write_puzzle_in_chuchu_db(&s, name, "user7", data, (int)sizeof(data))));
+  BENCH("read_puzzle_in_chuchu_db", n, read_puzzle_in_chuchu_db(&s, s.chu_db_path, msg, (uint32_t)(1 + i)));
+  BENCH("load_puzzles_to_array", BENCH_LOADS, load_bench_puzzles(&s));
+
+  snprintf(path, sizeof(path), "%s/bench.db", dir);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/bench.db-wal", dir);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/bench.db-shm", dir);
+  unlink(path);
+  rmdir(dir);
+  return 0;
+}
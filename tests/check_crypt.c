@@ -0,0 +1,194 @@
+/*
+ *
+ * ChuChu cipher check
+ *
+ * Runs CRYPT_DC_CryptData against the original per-word
+ * CRYPT_DC_GetNextKey loop, over random seeds, lengths,
+ * offsets and chained calls on the same cipher, and
+ * compares the output bytes and the cipher state.
+ * Prints the throughput of both afterwards.
+ *
+ * Build it plain, with -mavx2 and with -DCHUCHU_NO_SIMD
+ * to cover every CRYPT_DC_XorKeys path, see make check.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "chuchu_common.h"
+
+#define CHECK_SEEDS 20000
+#define CHECK_CHAIN 4
+#define CHECK_MAX_LEN 4100
+#define BENCH_BYTES 50000000L
+
+//Cipher as it was before the keys were cut down to CRYPT_DC_KEYS
+typedef struct {
+  uint32_t keys[1042];
+  uint32_t pc_posn;
+} OLD_CRYPT_SETUP;
+
+static void old_mix_keys(OLD_CRYPT_SETUP* pc) {
+  uint32_t esi,eax,ebp,edx;
+  edx = 0x18;
+  eax = 1;
+  while (edx > 0) {
+    esi = pc->keys[eax + 0x1F];
+    ebp = pc->keys[eax];
+    pc->keys[eax] = ebp - esi;
+    eax++;
+    edx--;
+  }
+  edx = 0x1F;
+  eax = 0x19;
+  while (edx > 0) {
+    esi = pc->keys[eax - 0x18];
+    ebp = pc->keys[eax];
+    pc->keys[eax] = ebp - esi;
+    eax++;
+    edx--;
+  }
+}
+
+static void old_create_keys(OLD_CRYPT_SETUP* pc, uint32_t val) {
+  uint32_t esi,ebx,edi,edx;
+
+  memset(pc, 0, sizeof(OLD_CRYPT_SETUP));
+  esi = 1;
+  ebx = val;
+  edi = 0x15;
+  pc->keys[56] = ebx;
+  pc->keys[55] = ebx;
+  while (edi <= 0x46E) {
+    edx = edi % 55;
+    ebx = ebx - esi;
+    edi = edi + 0x15;
+    pc->keys[edx] = esi;
+    esi = ebx;
+    ebx = pc->keys[edx];
+  }
+  old_mix_keys(pc);
+  old_mix_keys(pc);
+  old_mix_keys(pc);
+  old_mix_keys(pc);
+  pc->pc_posn = 56;
+}
+
+static uint32_t old_get_next_key(OLD_CRYPT_SETUP* pc) {
+  uint32_t re;
+  if (pc->pc_posn == 56) {
+    old_mix_keys(pc);
+    pc->pc_posn = 1;
+  }
+  re = pc->keys[pc->pc_posn];
+  pc->pc_posn++;
+  return re;
+}
+
+//Whole words, a last partial word also writes the bytes past size
+__attribute__((noinline)) static void old_crypt_data(OLD_CRYPT_SETUP* pc, char* data, unsigned long size) {
+  uint32_t x, tmp;
+  for (x = 0; x < size; x += 4) {
+    memcpy(&tmp, data + x, 4);
+    tmp = LE32(tmp) ^ old_get_next_key(pc);
+    tmp = LE32(tmp);
+    memcpy(data + x, &tmp, 4);
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+/*
+ * Function: check_crypt
+ * --------------------
+ * encrypts the same random buffers with both
+ * ciphers, CHECK_CHAIN calls per seed
+ *
+ *  returns: nr of seeds that did not match
+ *
+ */
+static int check_crypt(void) {
+  static char a[CHECK_MAX_LEN + 16], b[CHECK_MAX_LEN + 16];
+  OLD_CRYPT_SETUP o;
+  CRYPT_SETUP n;
+  int i, k, bad = 0;
+  unsigned long len, off;
+  uint32_t seed;
+
+  srand(7);
+  for (i = 0; i < CHECK_SEEDS; i++) {
+    seed = (uint32_t)rand() * 2654435761U ^ (uint32_t)rand();
+    old_create_keys(&o, seed);
+    CRYPT_DC_CreateKeys(&n, seed);
+    for (k = 0; k < CHECK_CHAIN; k++) {
+      len = (unsigned long)rand() % CHECK_MAX_LEN;
+      off = (unsigned long)rand() % 8;
+      for (size_t j = 0; j < sizeof(a); j++)
+	a[j] = (char)rand();
+      memcpy(b, a, sizeof(a));
+      old_crypt_data(&o, a + off, len);
+      CRYPT_DC_CryptData(&n, b + off, len);
+      if (memcmp(a + off, b + off, len) != 0) {
+	printf("seed %08x call %d len %lu off %lu: output differs\n", seed, k, len, off);
+	bad++;
+	break;
+      }
+      if (o.pc_posn != n.pc_posn || memcmp(o.keys, n.keys, sizeof(n.keys)) != 0) {
+	printf("seed %08x call %d len %lu off %lu: cipher state differs\n", seed, k, len, off);
+	bad++;
+	break;
+      }
+    }
+  }
+  return bad;
+}
+
+static void bench_crypt(void) {
+  static char buf[4096];
+  OLD_CRYPT_SETUP o;
+  CRYPT_SETUP n;
+  unsigned long len;
+  long r, reps;
+  uint64_t t0, t1, t2;
+
+  old_create_keys(&o, 1);
+  CRYPT_DC_CreateKeys(&n, 1);
+  for (len = 16; len <= 4096; len *= 4) {
+    reps = BENCH_BYTES / (long)len;
+    t0 = now_ns();
+    for (r = 0; r < reps; r++)
+      old_crypt_data(&o, buf, len);
+    t1 = now_ns();
+    for (r = 0; r < reps; r++)
+      CRYPT_DC_CryptData(&n, buf, len);
+    t2 = now_ns();
+    printf("len %4lu: per-word %.2f GB/s, CryptData %.2f GB/s\n", len,
+	   (double)len * (double)reps / (double)(t1 - t0),
+	   (double)len * (double)reps / (double)(t2 - t1));
+  }
+}
+
+int main(void) {
+  int bad;
+
+#if defined(CHUCHU_NO_SIMD)
+  printf("CRYPT_DC_XorKeys: portable\n");
+#elif defined(__AVX2__)
+  printf("CRYPT_DC_XorKeys: AVX2\n");
+#elif defined(__SSE2__)
+  printf("CRYPT_DC_XorKeys: SSE2\n");
+#else
+  printf("CRYPT_DC_XorKeys: portable\n");
+#endif
+  bad = check_crypt();
+  printf("%d seeds x %d calls: %d mismatches\n", CHECK_SEEDS, CHECK_CHAIN, bad);
+  if (bad)
+    return 1;
+  bench_crypt();
+  return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ *
+ * ChuChu handshake check
+ *
+ * Maps a key table built in a temp dir and checks that
+ * init_chuchu_crypt hands out the keys CRYPT_DC_CreateKeys
+ * makes for its seeds, and that the seeds keep the four
+ * 0..15 bytes format and spread over all of them. Prints
+ * handshakes/s for the original srand/rand code, for keys
+ * per handshake and for the table.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "chuchu_common.h"
+
+#define CHECK_HANDSHAKES 200000
+#define BENCH_HANDSHAKES 500000
+//200000 draws cover about 62400 of the 65536 seeds
+#define CHECK_MIN_DISTINCT 60000
+
+//init_chuchu_crypt as it was before the key table
+__attribute__((noinline)) static void old_init_chuchu_crypt(player_t* pl) {
+  int i=0;
+  srand((unsigned int)time(NULL));
+  char server_seed_dc[4],client_seed_dc[4];
+
+  for(i=0;i<4;i++) {
+    server_seed_dc[i] = (char)(rand()%16);
+    client_seed_dc[i] = (char)(rand()%16);
+  }
+
+  pl->server_seed =  char_to_uint32(server_seed_dc);
+  pl->client_seed =  char_to_uint32(client_seed_dc);
+
+  CRYPT_DC_CreateKeys(&pl->server_cipher, pl->server_seed);
+  CRYPT_DC_CreateKeys(&pl->client_cipher, pl->client_seed);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+static void bench_handshake(const char *name, void (*init)(player_t*)) {
+  static player_t pl;
+  uint64_t t0;
+  double s;
+  long i;
+
+  t0 = now_ns();
+  for (i = 0; i < BENCH_HANDSHAKES; i++)
+    init(&pl);
+  s = (double)(now_ns() - t0) / 1e9;
+  printf("%-14s %.2f M handshakes/s (%.0f ns)\n", name,
+	 BENCH_HANDSHAKES / s / 1e6, s * 1e9 / BENCH_HANDSHAKES);
+}
+
+/*
+ * Function: check_cipher
+ * --------------------
+ * checks a seed is four bytes of 0..15 and that
+ * its cipher matches CRYPT_DC_CreateKeys
+ *
+ *  seed: seed sent to the client
+ *  *pc: cipher init_chuchu_crypt set up for it
+ *
+ *  returns: 1 => OK
+ *           0 => mismatch
+ *
+ */
+static int check_cipher(uint32_t seed, const CRYPT_SETUP *pc) {
+  CRYPT_SETUP c;
+
+  if ((seed & 0xf0f0f0f0) != 0) {
+    printf("seed %08x: not four bytes of 0..15\n", seed);
+    return 0;
+  }
+  CRYPT_DC_CreateKeys(&c, seed);
+  if (c.pc_posn != pc->pc_posn || memcmp(c.keys, pc->keys, sizeof(c.keys)) != 0) {
+    printf("seed %08x: keys differ from CRYPT_DC_CreateKeys\n", seed);
+    return 0;
+  }
+  return 1;
+}
+
+int main(void) {
+  static player_t pl;
+  static uint8_t seen[0x10000];
+  char dir[] = "/tmp/chuchu_check.XXXXXX", path[64];
+  uint32_t seed;
+  int i, bad = 0, distinct = 0;
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/keys", dir);
+
+  bench_handshake("srand/rand", old_init_chuchu_crypt);
+  bench_handshake("per handshake", init_chuchu_crypt);
+  if (!init_chuchu_crypt_table(path)) {
+    rmdir(dir);
+    return 1;
+  }
+  bench_handshake("key table", init_chuchu_crypt);
+
+  for (i = 0; i < CHECK_HANDSHAKES; i++) {
+    init_chuchu_crypt(&pl);
+    if (!check_cipher(pl.server_seed, &pl.server_cipher) ||
+	!check_cipher(pl.client_seed, &pl.client_cipher)) {
+      bad++;
+      continue;
+    }
+    seed = pl.server_seed;
+    seed = (seed >> 12 & 0xf000) | (seed >> 8 & 0x0f00) | (seed >> 4 & 0x00f0) | (seed & 0x000f);
+    if (!seen[seed]) {
+      seen[seed] = 1;
+      distinct++;
+    }
+  }
+  printf("%d handshakes: %d mismatches, %d/65536 distinct server seeds\n",
+	 CHECK_HANDSHAKES, bad, distinct);
+
+  unlink(path);
+  rmdir(dir);
+  return bad != 0 || distinct < CHECK_MIN_DISTINCT;
+}